@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "listdir.h"
+
+//+
+// File:    listdir.c
+//
+// Purpose: Directory listing for the ls builtin, see listdir.h.
+//-
+
+// bytes asked of each getdents64 call, and the size of each kept buffer
+#define DIR_BUFFER (1 << 20)
+// most threads calling statx for a long listing
+#define STAT_THREADS 8
+// entries each thread takes at a time, and fewest worth starting threads for
+#define STAT_CHUNK 64
+
+// What getdents64 fills the buffer with
+struct linuxDirent64{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// A directory entry, pointing into the buffer it was read into
+struct dirEntry{
+    // the first 8 bytes of the name in lower case, most significant first,
+    // so keys order like strcasecmp on those bytes
+    uint64_t key;
+    const char *name;
+};
+
+// What a long listing shows of an entry, from statx
+struct entryStat{
+    int ok;
+    mode_t mode;
+    nlink_t nlink;
+    uid_t uid;
+    gid_t gid;
+    uint64_t size;
+    int64_t mtime;
+};
+
+// Entries to statx, shared by the threads of the pool
+struct statJob{
+    int dirFd;
+    struct dirEntry *entries;
+    struct entryStat *stats;
+    size_t numEntries;
+    // next entry not yet taken by a thread
+    atomic_size_t next;
+};
+
+//+
+// Function: nameKey
+//
+// Purpose: Makes the sort key of a name.
+//
+// Parameters:
+//   name (entry name)
+//
+// Returns: the key
+//-
+
+static uint64_t nameKey(const char *name){
+    uint64_t key = 0;
+    int i = 0;
+    for (; i < 8 && name[i] != '\0'; i++){
+        unsigned char c = name[i];
+        key = key << 8 | (c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c);
+    }
+    return key << (8 * (8 - i));
+}
+
+//+
+// Function: compareNames
+//
+// Purpose: qsort comparison of entries with the same key, by strcasecmp
+//      and then by strcmp so names differing only in case have an order.
+//
+// Parameters:
+//   a, b (the entries)
+//
+// Returns: negative, zero or positive as a sorts before, with or after b
+//-
+
+static int compareNames(const void *a, const void *b){
+    const char *x = ((const struct dirEntry *) a)->name;
+    const char *y = ((const struct dirEntry *) b)->name;
+    int order = strcasecmp(x, y);
+    return order != 0 ? order : strcmp(x, y);
+}
+
+//+
+// Function: sortEntries
+//
+// Purpose: Sorts entries like strcasecmp. An LSD radix sort on the keys,
+//      one byte per pass and skipping bytes every key shares, does most of
+//      the work touching only the compact entry array. Then each run of
+//      equal keys, whose names agree in their first 8 bytes, is sorted by
+//      comparing the names.
+//
+// Parameters:
+//   entries, numEntries (the entries, entries may be NULL when there are none)
+//
+// Returns: (none)
+//-
+
+static void sortEntries(struct dirEntry *entries, size_t numEntries){
+    // nothing to sort, and entries may not even have been allocated
+    if (numEntries == 0){
+        return;
+    }
+    struct dirEntry *spare = malloc(numEntries * sizeof(struct dirEntry));
+    if (spare == NULL){
+        // sort by comparing names alone
+        qsort(entries, numEntries, sizeof(struct dirEntry), compareNames);
+        return;
+    }
+    struct dirEntry *from = entries;
+    struct dirEntry *to = spare;
+    for (int shift = 0; shift < 64; shift += 8){
+        size_t count[256] = {0};
+        for (size_t i = 0; i < numEntries; i++){
+            count[from[i].key >> shift & 0xff]++;
+        }
+        if (count[from[0].key >> shift & 0xff] == numEntries){
+            continue;
+        }
+        size_t start = 0;
+        for (int b = 0; b < 256; b++){
+            size_t c = count[b];
+            count[b] = start;
+            start += c;
+        }
+        for (size_t i = 0; i < numEntries; i++){
+            to[count[from[i].key >> shift & 0xff]++] = from[i];
+        }
+        struct dirEntry *t = from;
+        from = to;
+        to = t;
+    }
+    if (from != entries){
+        memcpy(entries, from, numEntries * sizeof(struct dirEntry));
+    }
+    free(spare);
+
+    for (size_t i = 0; i < numEntries; ){
+        size_t j = i + 1;
+        while (j < numEntries && entries[j].key == entries[i].key){
+            j++;
+        }
+        if (j - i > 1){
+            qsort(entries + i, j - i, sizeof(struct dirEntry), compareNames);
+        }
+        i = j;
+    }
+}
+
+//+
+// Function: statEntries
+//
+// Purpose: Thread body of the statx pool. Takes STAT_CHUNK entries at a
+//      time until there are none left.
+//
+// Parameters:
+//   arg (the statJob)
+//
+// Returns: NULL
+//-
+
+static void * statEntries(void *arg){
+    struct statJob *job = arg;
+    size_t first;
+    while ((first = atomic_fetch_add(&job->next, STAT_CHUNK)) < job->numEntries){
+        size_t last = first + STAT_CHUNK < job->numEntries ? first + STAT_CHUNK : job->numEntries;
+        for (size_t i = first; i < last; i++){
+            struct statx sx;
+            struct entryStat *st = &job->stats[i];
+            st->ok = statx(job->dirFd, job->entries[i].name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+                           STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME,
+                           &sx) == 0;
+            st->mode = sx.stx_mode;
+            st->nlink = sx.stx_nlink;
+            st->uid = sx.stx_uid;
+            st->gid = sx.stx_gid;
+            st->size = sx.stx_size;
+            st->mtime = sx.stx_mtime.tv_sec;
+        }
+    }
+    return NULL;
+}
+
+//+
+// Function: statAll
+//
+// Purpose: Gets the metadata of entries, with the thread pool when there
+//      are enough entries for it to pay.
+//
+// Parameters:
+//   dirFd (the directory the names are in)
+//   entries, numEntries (the entries)
+//   stats (set to the metadata of each entry)
+//
+// Returns: (none)
+//-
+
+static void statAll(int dirFd, struct dirEntry *entries, size_t numEntries, struct entryStat *stats){
+    struct statJob job = {dirFd, entries, stats, numEntries, 0};
+    pthread_t threads[STAT_THREADS];
+    int numThreads = numEntries / STAT_CHUNK;
+
+    numThreads = numThreads > STAT_THREADS ? STAT_THREADS : numThreads;
+    for (int i = 0; i < numThreads; i++){
+        if (pthread_create(&threads[i], NULL, statEntries, &job) != 0){
+            numThreads = i;
+            break;
+        }
+    }
+    // this thread works too, and finishes alone if none could start
+    statEntries(&job);
+    for (int i = 0; i < numThreads; i++){
+        pthread_join(threads[i], NULL);
+    }
+}
+
+//+
+// Function: printLong
+//
+// Purpose: Prints an entry in the long format: type and permissions,
+//      links, owner, group, size, modification time and name, with the
+//      target of a symbolic link.
+//
+// Parameters:
+//   out (where to print)
+//   dirFd (the directory the entry is in)
+//   name (the entry)
+//   st (its metadata)
+//
+// Returns: (none)
+//-
+
+static void printLong(FILE *out, int dirFd, const char *name, const struct entryStat *st){
+    // the last owner and group looked up, as most entries share them
+    static uid_t lastUid = -1;
+    static gid_t lastGid = -1;
+    static char owner[32], group[32];
+
+    if (!st->ok){
+        fprintf(out, "?????????? %s\n", name);
+        return;
+    }
+    char mode[11];
+    const char *types = "?pc?d?b?-?l?s???";
+    mode[0] = types[(st->mode >> 12) & 0xf];
+    const char *rwx = "rwxrwxrwx";
+    for (int i = 0; i < 9; i++){
+        mode[i + 1] = st->mode & (0400 >> i) ? rwx[i] : '-';
+    }
+    mode[10] = '\0';
+    if (st->uid != lastUid){
+        struct passwd *pw = getpwuid(st->uid);
+        pw != NULL ? snprintf(owner, sizeof(owner), "%s", pw->pw_name) : snprintf(owner, sizeof(owner), "%u", st->uid);
+        lastUid = st->uid;
+    }
+    if (st->gid != lastGid){
+        struct group *gr = getgrgid(st->gid);
+        gr != NULL ? snprintf(group, sizeof(group), "%s", gr->gr_name) : snprintf(group, sizeof(group), "%u", st->gid);
+        lastGid = st->gid;
+    }
+    // the year instead of the time for files more than six months old
+    char when[32];
+    struct tm tm;
+    time_t mtime = st->mtime;
+    localtime_r(&mtime, &tm);
+    strftime(when, sizeof(when), llabs(time(NULL) - mtime) < 182 * 24 * 3600 ? "%b %e %H:%M" : "%b %e  %Y", &tm);
+
+    fprintf(out, "%s %3lu %-8s %-8s %10llu %s %s", mode, (unsigned long) st->nlink, owner, group,
+            (unsigned long long) st->size, when, name);
+    if (S_ISLNK(st->mode)){
+        char target[4096];
+        ssize_t len = readlinkat(dirFd, name, target, sizeof(target) - 1);
+        if (len >= 0){
+            target[len] = '\0';
+            fprintf(out, " -> %s", target);
+        }
+    }
+    fputc('\n', out);
+}
+
+//+
+// Function: printEntries
+//
+// Purpose: Prints entries in the order given, getting their metadata
+//      first for a long listing.
+//
+// Parameters:
+//   out (where to print)
+//   dirFd (the directory)
+//   entries, numEntries (the entries)
+//   flags (LIST_LONG)
+//
+// Returns: 0, or -1 if memory for the metadata ran out
+//-
+
+static int printEntries(FILE *out, int dirFd, struct dirEntry *entries, size_t numEntries, int flags){
+    if (!(flags & LIST_LONG)){
+        for (size_t i = 0; i < numEntries; i++){
+            fputs_unlocked(entries[i].name, out);
+            fputc_unlocked('\n', out);
+        }
+        return 0;
+    }
+    struct entryStat *stats = malloc(numEntries * sizeof(struct entryStat));
+    if (stats == NULL && numEntries > 0){
+        return -1;
+    }
+    statAll(dirFd, entries, numEntries, stats);
+    for (size_t i = 0; i < numEntries; i++){
+        printLong(out, dirFd, entries[i].name, &stats[i]);
+    }
+    free(stats);
+    return 0;
+}
+
+//+
+// Function: listDirectory
+//
+// Purpose: Lists the directory dirName. Sorted listings keep every buffer
+//      read until the end, with an entry array pointing into them, and then
+//      sort and print. Unsorted ones print each buffer as it is read and
+//      reuse it.
+//
+// Parameters:
+//   dirName (the directory)
+//   flags (LIST_ALL, LIST_UNSORTED and LIST_LONG)
+//   out (where to print)
+//
+// Returns: 0 on success, -1 with errno set on failure
+//-
+
+int listDirectory(const char *dirName, int flags, FILE *out){
+    int dirFd = open(dirName, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0){
+        return -1;
+    }
+    // buffers read so far, chained through their first bytes
+    char *buffers = NULL;
+    struct dirEntry *entries = NULL;
+    size_t numEntries = 0;
+    size_t maxEntries = 0;
+    int result = 0;
+
+    while (1){
+        // the first pointer's worth links the buffers, names come after it
+        char *buffer = buffers != NULL && (flags & LIST_UNSORTED) ? buffers : malloc(DIR_BUFFER);
+        if (buffer == NULL){
+            errno = ENOMEM;
+            result = -1;
+            break;
+        }
+        if (buffer != buffers){
+            *(char **) buffer = buffers;
+            buffers = buffer;
+        }
+        char *data = buffer + sizeof(char *);
+        long got = syscall(SYS_getdents64, dirFd, data, DIR_BUFFER - sizeof(char *));
+        if (got <= 0){
+            result = got < 0 ? -1 : 0;
+            break;
+        }
+        for (long pos = 0; pos < got; ){
+            struct linuxDirent64 *d = (struct linuxDirent64 *) (data + pos);
+            pos += d->d_reclen;
+            if (d->d_name[0] == '.' && !(flags & LIST_ALL)){
+                continue;
+            }
+            if (numEntries == maxEntries){
+                maxEntries = maxEntries ? maxEntries * 2 : 4096;
+                struct dirEntry *grown = realloc(entries, maxEntries * sizeof(struct dirEntry));
+                if (grown == NULL){
+                    errno = ENOMEM;
+                    result = -1;
+                    break;
+                }
+                entries = grown;
+            }
+            entries[numEntries].name = d->d_name;
+            entries[numEntries].key = (flags & LIST_UNSORTED) ? 0 : nameKey(d->d_name);
+            numEntries++;
+        }
+        if (result != 0){
+            break;
+        }
+        if (flags & LIST_UNSORTED){
+            // stream this buffer and start again with it
+            if (printEntries(out, dirFd, entries, numEntries, flags) != 0){
+                errno = ENOMEM;
+                result = -1;
+                break;
+            }
+            numEntries = 0;
+        }
+    }
+
+    if (result == 0 && !(flags & LIST_UNSORTED)){
+        sortEntries(entries, numEntries);
+        if (printEntries(out, dirFd, entries, numEntries, flags) != 0){
+            errno = ENOMEM;
+            result = -1;
+        }
+    }
+    int savedErrno = errno;
+    while (buffers != NULL){
+        char *next = *(char **) buffers;
+        free(buffers);
+        buffers = next;
+    }
+    free(entries);
+    close(dirFd);
+    errno = savedErrno;
+    return result;
+}
@@ -0,0 +1,32 @@
+//+
+// File:    listdir.h
+//
+// Purpose: Lists a directory for the shell's ls builtin without scandir.
+//      Entries are read with getdents64 into 1 MiB buffers that are kept
+//      for the whole listing, so names are never copied or allocated one by
+//      one. Sorting, case-insensitively like strcasecmp, is a radix sort on
+//      an 8 byte key made from the start of each name, and only names that
+//      share the key are compared in full. Unsorted listings stream out one
+//      buffer at a time in constant memory.
+//
+//      The long listing gets each entry's metadata with statx, spread over
+//      a small pool of threads so a large or cold directory has many
+//      lookups in flight at once.
+//-
+
+#ifndef LISTDIR_H
+#define LISTDIR_H
+
+#include <stdio.h>
+
+// Listing flags
+// -a, show entries starting with .
+#define LIST_ALL 1
+// -U, directory order, streamed as it is read
+#define LIST_UNSORTED 2
+// -l, mode, links, owner, group, size and time for each entry
+#define LIST_LONG 4
+
+int listDirectory(const char *dirName, int flags, FILE *out);
+
+#endif
@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+
+//+
+// File:    server.c
+//
+// Purpose: The shell's server and the client side of its connections, see
+//      server.h.
+//-
+
+// Bytes moved at a time between a connection and a file
+#define EXCHANGE_CHUNK 65536
+
+//+
+// Function: socketAddress
+//
+// Purpose: Fills in the address of the socket at path.
+//
+// Parameters:
+//   addr (set to the address)
+//   path (path of the socket)
+//
+// Returns: 0 on success, -1 with errno set if path is too long
+//-
+
+int socketAddress(struct sockaddr_un *addr, const char *path){
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+//+
+// Function: serverConnect
+//
+// Purpose: Connects to a server listening at path.
+//
+// Parameters:
+//   path (path of the socket)
+//
+// Returns: the connection, -1 with errno set if there is no server
+//-
+
+int serverConnect(const char *path){
+    struct sockaddr_un addr;
+    if (socketAddress(&addr, path) != 0){
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0){
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0){
+        int savedErrno = errno;
+        close(fd);
+        errno = savedErrno;
+        return -1;
+    }
+    return fd;
+}
+
+//+
+// Function: serverListen
+//
+// Purpose: Creates the server's socket at path. A socket left there by a
+//      server that has gone is replaced, but not one a server still
+//      answers on. Exits on failure.
+//
+// Parameters:
+//   path (path of the socket)
+//
+// Returns: the listening socket
+//-
+
+int serverListen(const char *path){
+    struct sockaddr_un addr;
+    if (socketAddress(&addr, path) != 0){
+        perror(path);
+        exit(1);
+    }
+    int fd = serverConnect(path);
+    if (fd >= 0){
+        fprintf(stderr, "%s: a server is already running\n", path);
+        exit(1);
+    }
+    if (errno == ECONNREFUSED){
+        unlink(path);
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0){
+        perror("socket");
+        exit(1);
+    }
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0){
+        perror(path);
+        exit(1);
+    }
+    return fd;
+}
+
+//+
+// Function: serveSessions
+//
+// Purpose: Accepts connections for ever, starting a session for each. Only
+//      returns in a session, with the connection as its standard input,
+//      output and error, and with SIGCHLD ignored, so the caller must put
+//      back its handler. Sessions that end are reaped by the kernel, as
+//      the server ignores SIGCHLD.
+//
+// Parameters:
+//   listenFd (the listening socket)
+//
+// Returns: (in each session)
+//-
+
+void serveSessions(int listenFd){
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_IGN;
+    action.sa_flags = SA_NOCLDWAIT;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+    fflush(stdout);
+    fflush(stderr);
+
+    while (1){
+        int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0){
+            if (errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            perror("accept");
+            exit(1);
+        }
+        pid_t pid = fork();
+        if (pid == 0){
+            close(listenFd);
+            if (dup2(fd, STDIN_FILENO) < 0 || dup2(fd, STDOUT_FILENO) < 0 || dup2(fd, STDERR_FILENO) < 0){
+                perror("dup2");
+                _exit(1);
+            }
+            close(fd);
+            return;
+        }
+        if (pid < 0){
+            perror("fork");
+        }
+        close(fd);
+    }
+}
+
+//+
+// Function: writeAll
+//
+// Purpose: Writes all of buf to fd.
+//
+// Parameters:
+//   fd (where to write)
+//   buf, len (what to write)
+//
+// Returns: 0 on success, -1 with errno set if writing failed
+//-
+
+int writeAll(int fd, const char *buf, size_t len){
+    while (len > 0){
+        ssize_t put = write(fd, buf, len);
+        if (put < 0 && errno != EINTR){
+            return -1;
+        }
+        if (put > 0){
+            buf += put;
+            len -= put;
+        }
+    }
+    return 0;
+}
+
+//+
+// Function: serverExchange
+//
+// Purpose: Sends everything in inFd over a connection, then copies what the
+//      session sends back to outFd until it closes the connection. Output
+//      is copied while the input is still being sent, so neither side
+//      waits on the other with a full socket.
+//
+// Parameters:
+//   sock (the connection)
+//   inFd (what to send, -1 for nothing)
+//   outFd (where the output goes)
+//
+// Returns: 0 on success, -1 with errno set if reading or writing failed
+//-
+
+int serverExchange(int sock, int inFd, int outFd){
+    // output read from the connection, then input to send to it
+    char *buf = malloc(2 * EXCHANGE_CHUNK);
+    char *pending = NULL;
+    size_t pendingLen = 0;
+    int result = -1;
+
+    if (buf == NULL){
+        return -1;
+    }
+    if (inFd < 0){
+        shutdown(sock, SHUT_WR);
+    }
+    while (1){
+        // read more input only once the last has been sent
+        struct pollfd fds[2] = {{sock, POLLIN, 0}, {-1, 0, 0}};
+        if (inFd >= 0){
+            fds[1].fd = pendingLen > 0 ? sock : inFd;
+            fds[1].events = pendingLen > 0 ? POLLOUT : POLLIN;
+        }
+        if (poll(fds, 2, -1) < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        if (fds[0].revents != 0){
+            ssize_t got = read(sock, buf, EXCHANGE_CHUNK);
+            if (got == 0){
+                result = 0;
+                break;
+            }
+            if (got < 0 && errno != EINTR){
+                break;
+            }
+            if (got > 0 && writeAll(outFd, buf, got) != 0){
+                break;
+            }
+        }
+        if (inFd >= 0 && fds[1].revents != 0){
+            if (pendingLen > 0){
+                ssize_t put = send(sock, pending, pendingLen, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (put < 0 && errno != EAGAIN && errno != EINTR){
+                    break;
+                }
+                if (put > 0){
+                    pending += put;
+                    pendingLen -= put;
+                }
+            } else {
+                // the input goes after the output in buf
+                pending = buf + EXCHANGE_CHUNK;
+                ssize_t got = read(inFd, pending, EXCHANGE_CHUNK);
+                if (got <= 0){
+                    if (got < 0 && errno == EINTR){
+                        continue;
+                    }
+                    // end of the input, the session sees the end of its commands
+                    shutdown(sock, SHUT_WR);
+                    inFd = -1;
+                } else {
+                    pendingLen = got;
+                }
+            }
+        }
+    }
+    free(buf);
+    return result;
+}
@@ -0,0 +1,25 @@
+//+
+// File:    server.h
+//
+// Purpose: Runs the shell as a server on a Unix domain socket, so scripted
+//      commands don't pay for starting a shell each time. Each connection
+//      gets a session, a child of the server that reads command lines from
+//      the connection and writes their output back to it as it is made.
+//      A session is a process of its own, so cd and the rest of its state
+//      affect no other session, and it starts with the server's table of
+//      internal commands and open path directories rather than building
+//      them again.
+//-
+
+#ifndef SERVER_H
+#define SERVER_H
+
+// Socket the server listens on and the client connects to by default
+#define SERVER_SOCKET "/tmp/lab2-shell.sock"
+
+int serverListen(const char *path);
+void serveSessions(int listenFd);
+int serverConnect(const char *path);
+int serverExchange(int sock, int inFd, int outFd);
+
+#endif
@@ -1,13 +1,26 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-#include <dirent.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <ctype.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <signal.h>
+
+#include "spawn.h"
+#include "tokenize.h"
+#include "listdir.h"
+#include "walk.h"
+#include "server.h"
 
 //+
 // File:    shell.c
@@ -19,34 +32,75 @@
 //      The commands are:
 //         cd name -> change to directory name, print an error if the directory doesn't exist.
 //                    If there is no parameter, then change to the home directory.
-//         ls -> list the entries in the current directory.
+//         ls [-a] [-U] [-l] [dir] -> list the entries in the current directory, or dir.
 //                If no arguments, then ignores entries starting with .
 //                If -a then all entries
+//                If -U then unsorted, as they are read
+//                If -l then with mode, links, owner, group, size and time
 //         pwd -> print the current directory.
 //         exit -> exit the shell (default exit value 0)
 //              any argument must be numeric and is the exit value
+//         hash -> list the programs found in the path, with how often each
+//                 has been run. hash -r forgets them, hash name... looks
+//                 the names up.
+//         cat file... -> copy the files, or standard input, to standard output.
+//         tee [-a] [file] -> copy standard input to standard output and to file.
+//         find [path...] [-name pattern] [-type f|d|l] [-size [+|-]n[c|k|M|G]] [-j threads]
+//              -> print the paths under each path (default .) that match.
+//         du [-s] [-j threads] [path...] -> print the disk usage of each directory in KiB.
+//              -s prints only the total of each path.
+//         jobs -> list the background jobs.
+//         wait [n...] -> wait for background jobs n..., or all of them.
+//         parallel [-j N] cmd [args...] [::: input...] -> run cmd args input
+//                for each input, or each line of standard input, N at a time.
+//         time command... -> run the command line and print the wall time, CPU
+//                time, largest resident set, page faults and context switches
+//                it used to standard error.
 //
 //      if the command is not recognized an error is printed.
+//
+//      Words are separated by spaces or tabs, and can be quoted with ' or "
+//      or escaped with \. Commands can be joined into a pipeline with |,
+//      and each command can have its input redirected with < file and its
+//      output with > file or >> file. All the commands of a
+//      pipeline run at once, builtins in a child shell, and the shell waits
+//      for them all. A command line ending in & runs in the background as a
+//      job, and the shell reaps its processes when SIGCHLD arrives.
+//
+//      Programs are started with posix_spawn, or with fork and execv when
+//      the shell is run with -f.
+//
+//      The shell collects the resources used by every command, with wait4
+//      for processes and getrusage for builtins run in the shell. Run with
+//      -p file, it adds them up by command name and writes them to file as
+//      CSV when it exits.
+//
+//      Run with -s socket, the shell is a server on a Unix domain socket,
+//      and runs the command lines of each connection in a session of its
+//      own, with no prompt. shellc is its client. -p can't be used with -s.
 //-
 
-#define CMD_BUFFSIZE 1024
-#define MAXARGS 10
+int doInternalCommand(char *args[], int nargs);
+int doProgram(char *args[], int nargs);
+void builtinInit();
+void jobsInit();
+void reportDoneJobs();
+int isPipeline(char *args[], int nargs);
+void doPipeline(char *args[], int nargs);
+void runCommandLine(char *args[], int nargs);
+void timeFunc(char *args[], int nargs);
+void profileInit(char *fileName);
+uint32_t hashName(const char *name);
+void pathOpenAll();
 
-// Function to filter hidden files in scandir
-int filterHidden(const struct dirent *entry) {
-    // Filter out entries starting with a dot (hidden files)
-    return (entry->d_name[0] != '.');
-}
+// How external programs are started, SPAWN_POSIX or SPAWN_FORK (-f)
+int spawnMethod = SPAWN_POSIX;
 
-// Comparison function for alphasort
-int alphaSort(const struct dirent **a, const struct dirent **b) {
-    // Compare two dirent structures by their names
-    return strcasecmp((*a)->d_name, (*b)->d_name);
-}
+// Holds the words of the command line being run, emptied for each line
+struct arena commandArena;
 
-int splitCommandLine(char *commandBuffer, char *args[], int maxargs);
-int doInternalCommand(char *args[], int nargs);
-int doProgram(char *args[], int nargs);
+// Print a prompt before each command line, not in a server's sessions
+int showPrompt = 1;
 
 //+
 // Function: main
@@ -54,39 +108,72 @@ int doProgram(char *args[], int nargs);
 // Purpose: The main function. Contains the read
 //      eval print loop for the shell.
 //
-// Parameters: (none)
+// Parameters:
+//   argc, argv (options, -f starts programs with fork and execv, -p file
+//       writes a profile of the commands run to file at exit, -s socket
+//       serves sessions on the socket)
 //
 // Returns: integer (exit status of shell)
 //-
 
-int main() {
-    char commandBuffer[CMD_BUFFSIZE];
-    // Note the plus one, allows for an extra null
-    char *args[MAXARGS+1];
+int main(int argc, char *argv[]) {
+    // grows to the longest line, so lines are only limited by ARG_MAX
+    char *commandBuffer = NULL;
+    size_t bufferSize = 0;
+    ssize_t cmdLen;
+    char **args;
+    char *socketPath = NULL;
+    char *profilePath = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "fp:s:")) != -1) {
+        if (opt == 'f') {
+            spawnMethod = SPAWN_FORK;
+        } else if (opt == 'p') {
+            profilePath = optarg;
+        } else if (opt == 's') {
+            socketPath = optarg;
+        } else {
+            fprintf(stderr, "usage: %s [-f] [-p profile.csv] [-s socket]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (profilePath != NULL && socketPath != NULL) {
+        // the commands run in the sessions, which the server's profile never sees
+        fprintf(stderr, "%s: -p can't be used with -s\n", argv[0]);
+        exit(1);
+    }
+    if (profilePath != NULL) {
+        profileInit(profilePath);
+    }
+    builtinInit();
+    jobsInit();
+    if (socketPath != NULL) {
+        // open the path directories once, so every session starts with them
+        pathOpenAll();
+        // only returns in a session, reading from its connection
+        serveSessions(serverListen(socketPath));
+        jobsInit();
+        showPrompt = 0;
+    }
     // Print prompt.. fflush is needed because
     // Stdout is line buffered, and won't
     // Write to terminal until newline
-    printf("%%> ");
+    if (showPrompt) {
+        printf("%%> ");
+    }
     fflush(stdout);
-    while(fgets(commandBuffer,CMD_BUFFSIZE,stdin) != NULL){
+    while((cmdLen = getline(&commandBuffer, &bufferSize, stdin)) > 0){
         //printf("%s",commandBuffer);
-        // Remove newline at end of buffer
-        int cmdLen = strlen(commandBuffer);
-        if (commandBuffer[cmdLen-1] == '\n'){
-            commandBuffer[cmdLen-1] = '\0';
-            cmdLen--;
-            //printf("<%s>\n",commandBuffer);
-        }
-
-        // Split command line into words.(Step 2)
-
-        // TODO
-        int nargs = splitCommandLine(commandBuffer, args, MAXARGS);
 
-        // Add a null to end of array (Step 2)
-
-        // TODO
-        args[nargs] = NULL;
+        // Split command line into words, ending with a null.(Step 2)
+        long nargs = splitCommandLine(commandBuffer, cmdLen, &commandArena, &args);
+        if (nargs == SPLIT_UNTERMINATED) {
+            printf("Error: Unterminated quote.\n");
+            nargs = 0;
+        } else if (nargs == SPLIT_TOO_LONG) {
+            printf("Error: Argument list too long.\n");
+            nargs = 0;
+        }
 
         //Debugging
         // printf("%d\n", nargs);
@@ -101,371 +188,1974 @@ int main() {
         // TODO: if one or more args, call doInternalCommand  (Step 3)        
         // TODO: if doInternalCommand returns 0, call doProgram  (Step 4)
         // TODO: if doProgram returns 0, print error message (Step 3 & 4) that the command was not found.
-        if (nargs > 0) {
-            if (doInternalCommand(args, nargs) == 0) {
-                if (doProgram(args, nargs) == 0) {
-                    printf("Error: Command '%s' not found.\n", args[0]);
-                }
-            }
-        }
+        runCommandLine(args, nargs);
 
-        // Print prompt
-        printf("%%> ");
+        // Print prompt, after any background jobs that have finished
+        reportDoneJobs();
+        if (showPrompt) {
+            printf("%%> ");
+        }
         fflush(stdout);
     }
+    free(commandBuffer);
     return 0;
 }
 
-////////////////////////////// String Handling (Step 1) ///////////////////////////////////
-
 //+
-// Function: skipChar
+// Function: runCommandLine
 //
-// Purpose: This function skips over a given char in a string
-//      For security, will not skip null chars.
+// Purpose: Runs the words of a command line, as a pipeline, an internal
+//      command or a program. time comes first, so it times a whole
+//      pipeline rather than its first command.
 //
 // Parameters:
-//    charPtr Pointer to string
-//    skip character to skip
+//   args (Array containing the words of the command line, ending with NULL)
+//   nargs (Number of words in args)
 //
-// Returns: Pointer to first character after skipped chars
-//      ID function if the string doesn't start with skip,
-//      or skip is the null character
+// Returns: (none)
 //-
 
-char * skipChar(char * charPtr, char skip){
-    // TODO: contents of function
-    if (charPtr != NULL) {
-        while (*charPtr != '\0' && *charPtr == skip) {
-            charPtr++;
+void runCommandLine(char *args[], int nargs) {
+    if (nargs > 0 && strcmp(args[0], "time") == 0) {
+        timeFunc(args, nargs);
+    } else if (nargs > 0 && isPipeline(args, nargs)) {
+        doPipeline(args, nargs);
+    } else if (nargs > 0) {
+        if (doInternalCommand(args, nargs) == 0) {
+            if (doProgram(args, nargs) == 0) {
+                printf("Error: Command '%s' not found.\n", args[0]);
+            }
         }
-    // TODO: replace null with proper value
-    return charPtr;
     }
-    
 }
 
+////////////////////////////// Profiling ///////////////////////////////////
+
+// Resources used by a command, or added up over several
+struct usage{
+    int64_t wallNs;
+    int64_t userNs;
+    int64_t sysNs;
+    // largest resident set of any of the processes, in KiB
+    long maxRss;
+    long minorFaults;
+    long majorFaults;
+    long voluntarySwitches;
+    long involuntarySwitches;
+};
+
+// A command's totals in the session profile
+struct profileEntry{
+    char *name;
+    long count;
+    struct usage total;
+};
+
+// What the command line being run has used so far, for time
+struct usage lineUsage;
+
+// Session profile (-p), by command name, open addressing with linear
+// probing. NULL when profiling is off, which costs nothing more than
+// collecting the usage wait4 gives anyway
+struct profileEntry *profile = NULL;
+size_t profileSlots = 0;
+size_t profileCount = 0;
+// the profile's file, opened when -p is given so a cd doesn't move it
+FILE *profileOut = NULL;
+// the shell's own process, children that exit don't write the profile
+pid_t shellPid;
+
 //+
-// Function: splitCommandLine
+// Function: timeNs
 //
-// Purpose: SplitCommandLine splits a command line input into individual arguments and stores
-//          them in the arguments array. It also makes sure number of arguments <= max arguments parameter
-//      
+// Purpose: Converts a time to nanoseconds.
 //
 // Parameters:
-//   commandBuffer (String representing the command line input to be split)
-//   args (Array to store indiviudal arguements)
-//   maxargs (Max number of arguements contained in args)
+//   tv (the time)
 //
-// Returns: Number of arguments stored in args, returns 0 if an error
-//          occurs (ex: args > maxargs).
+// Returns: the time in nanoseconds
 //-
 
-int splitCommandLine(char * commandBuffer, char* args[], int maxargs){
-    // TODO: contents of function
-    int nargs = 0;
-    char *token = commandBuffer;
-    // Enter a loop
-    do {
-        // Skip leading spaces using external function
-        token = skipChar(token, ' ');
-        // Check if we've reached the end of the input string
-        if (*token == '\0') {
-            return nargs;
-        }
-        // Check if we've exceeded the maximum number of arguments
-        if (nargs == maxargs) {
-            fprintf(stderr, "Error: Too many arguments.\n");
-            return 0;
-        }
-        // Store the current word in the args array and increment the argument count
-        args[nargs++] = token;
-        // Find the next space character (word separator).
-        char *nextSpace = strchr(token, ' ');
-        if (nextSpace == NULL){
-            // If no more spaces are found, set token to the end of the string which will terminate the loop
-            token = strchr(token, '\0');
-        } else {
-            // If a space is found, update the token to point to the next word and terminate the current word
-            token = nextSpace;
-            *token++ = '\0';
-        }
-    } while (*token != '\0');
-    // TODO: reutrn proper value
-    return nargs;
+int64_t timeNs(struct timeval tv) {
+    return (int64_t) tv.tv_sec * 1000000000 + (int64_t) tv.tv_usec * 1000;
 }
 
-////////////////////////////// External Program  (Note this is step 4, complete doeInternalCommand first!!) ///////////////////////////////////
+//+
+// Function: nowNs
+//
+// Purpose: Returns the monotonic clock in nanoseconds.
+//
+// Parameters: (none)
+//
+// Returns: the time
+//-
 
-// List of directorys to check for command
-// Terminated by null value
-char * path[] = {
-    ".",
-    "/usr/bin",
-    NULL
-};
+int64_t nowNs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
 //+
-// Function: doProgram
+// Function: usageFromRusage
 //
-// Purpose: Searches for executable file that matches input, in the directories listed in the path array.
-//      If executable is found, fork is used to create a child process and attempts to execute
-//      the command using execv (takes path of file to execute and the arguements).
+// Purpose: Fills in a usage from what wait4 or getrusage returned.
 //
 // Parameters:
-//   args (Array containing the command and its arguments)
-//   nargs (Number of arguments in args)
+//   u (set to the usage)
+//   ru (the resource usage)
+//   wallNs (wall time the command took)
 //
-// Returns:
-//   1 = found and executed the file
-//   0 = could not find and execute the file
+// Returns: (none)
 //-
 
-int doProgram(char *args[], int nargs){
-    // Find the executable
-    // TODO: add body.
-    // Note this is step 4, complete doInternalCommand first!!!
-    struct stat status;
-    char *cmd_path;
-    int i = 0;
-    int currentDirectory = 0;
-    // Loop through the directories in the 'path' array to find the executable
-    while (path[currentDirectory] != NULL) {
-        // Allocate memory for the command path
-        cmd_path = (char *) malloc(strlen(path[currentDirectory]) + strlen(args[0]) + strlen("/"));
-        // Create the complete command path
-        sprintf(cmd_path, path[currentDirectory]);
-        sprintf(cmd_path + strlen(cmd_path), "/");
-        sprintf(cmd_path + strlen(cmd_path), args[0]);
-        // Check the status of the file
-        if (stat(cmd_path, &status) == 0) {
-            if (S_ISREG(status.st_mode)) {
-                if (status.st_mode&S_IXUSR) {
-                    // The file is a regular file and is executable
-                    break;
-                }
-                else {
-                    // The file is not executable
-                    printf("Error: File found is not executable.\n");
-                    return 0;
-                }
-            }
-        }
-        currentDirectory++;
-    }
-    // If cmd_path is still NULL, no executable was found
-    if (cmd_path == NULL) {
-        return 0;
-    }
-    // Fork a child process
-    int processID = fork();
-    if (processID == -1) {
-        // Child process could not be created
-        printf("Unable to create child process.\n");
-        free(cmd_path);
-        return 0;
-    }
-    else if (processID == 0) {
-        // This code will be executed in the child process
-        // Execute the command using execv
-        execv(cmd_path, args);
-    }
-    else {
-        wait(NULL);
-    }
-    free(cmd_path);
-    return 1;
+void usageFromRusage(struct usage *u, const struct rusage *ru, int64_t wallNs) {
+    u->wallNs = wallNs;
+    u->userNs = timeNs(ru->ru_utime);
+    u->sysNs = timeNs(ru->ru_stime);
+    u->maxRss = ru->ru_maxrss;
+    u->minorFaults = ru->ru_minflt;
+    u->majorFaults = ru->ru_majflt;
+    u->voluntarySwitches = ru->ru_nvcsw;
+    u->involuntarySwitches = ru->ru_nivcsw;
 }
 
-////////////////////////////// Internal Command Handling (Step 3) ///////////////////////////////////
-
-///////////////////////////////
-// Command Handling Functions //
-///////////////////////////////
-
-// TODO: a function for each command handling function
-// goes here. Also make sure a comment block prefaces
-// each of the command handling functions.
-
-// Define command handling function pointer type
-typedef void(*commandFunc)(char * args[], int nargs);
-
 //+
-// Function: exitFunc
+// Function: usageAdd
 //
-// Purpose: Exits the shell
+// Purpose: Adds one usage to a total. Times and counts add up, the
+//      resident set is the largest. Wall time adds up too, callers
+//      timing processes that ran together take the largest instead.
 //
 // Parameters:
-//   args (Array containing the command and its arguments)
-//   nargs (Number of arguments in args)
+//   total (the total)
+//   u (usage to add)
 //
 // Returns: (none)
 //-
 
-void exitFunc(char *args[], int nargs) {
-    // Exits the system
-    exit(0);
+void usageAdd(struct usage *total, const struct usage *u) {
+    total->wallNs += u->wallNs;
+    total->userNs += u->userNs;
+    total->sysNs += u->sysNs;
+    total->maxRss = u->maxRss > total->maxRss ? u->maxRss : total->maxRss;
+    total->minorFaults += u->minorFaults;
+    total->majorFaults += u->majorFaults;
+    total->voluntarySwitches += u->voluntarySwitches;
+    total->involuntarySwitches += u->involuntarySwitches;
 }
 
 //+
-// Function: pwdFunc
+// Function: recordUsage
 //
-// Purpose: Retrieves and prints the current working directory.
+// Purpose: Records what a command used, in the totals of the command line
+//      and, when profiling, of the command's name. The wall time of the
+//      line is the longest of its commands, which run together.
 //
 // Parameters:
-//   args (Array containing the command and its arguments)
-//   nargs (Number of arguments in args)
+//   name (command name)
+//   u (what it used)
 //
 // Returns: (none)
 //-
 
-void pwdFunc(char *args[], int nargs) {
-    // Get the current working directory.
-    char *cwd = getcwd(NULL, 0);
-    // Check if getcwd() returned NULL (indicating an error).
-    if (cwd == NULL) {
-        printf("Error: Could not retrive working directory.\n");
+void recordUsage(const char *name, const struct usage *u) {
+    int64_t lineWall = lineUsage.wallNs > u->wallNs ? lineUsage.wallNs : u->wallNs;
+    usageAdd(&lineUsage, u);
+    lineUsage.wallNs = lineWall;
+    if (profile == NULL) {
+        return;
     }
-    // If getcwd() was successful, print the current working directory and free the allocated memory.
-    else {
-        printf("%s\n", cwd);
-        free(cwd);
+    if (profileCount * 2 >= profileSlots) {
+        // grow, and put the entries back in
+        size_t newSlots = profileSlots * 2;
+        struct profileEntry *grown = calloc(newSlots, sizeof(struct profileEntry));
+        if (grown == NULL) {
+            perror("recordUsage");
+            exit(1);
+        }
+        for (size_t i = 0; i < profileSlots; i++) {
+            if (profile[i].name != NULL) {
+                uint32_t slot = hashName(profile[i].name) & (newSlots - 1);
+                while (grown[slot].name != NULL) {
+                    slot = (slot + 1) & (newSlots - 1);
+                }
+                grown[slot] = profile[i];
+            }
+        }
+        free(profile);
+        profile = grown;
+        profileSlots = newSlots;
+    }
+    uint32_t slot = hashName(name) & (profileSlots - 1);
+    while (profile[slot].name != NULL && strcmp(profile[slot].name, name) != 0) {
+        slot = (slot + 1) & (profileSlots - 1);
+    }
+    if (profile[slot].name == NULL) {
+        if ((profile[slot].name = strdup(name)) == NULL) {
+            perror("recordUsage");
+            exit(1);
+        }
+        profileCount++;
     }
+    profile[slot].count++;
+    usageAdd(&profile[slot].total, u);
 }
 
 //+
-// Function: cdFunc
+// Function: reapChild
 //
-// Purpose: Changes the current working directory based on input. If only cd is entered with no second argument,
-//          it changes the current directory to one before/above the current. If another arguement is provided
-//          after cd it changes the current directory to the specified directory.
+// Purpose: Waits for a child with wait4 and records what it used.
 //
 // Parameters:
-//   args (Array containing the command and its arguments)
-//   nargs (Number of arguments in args)
+//   pid (the child)
+//   name (its command name)
+//   startNs (when it was started, from nowNs)
 //
-// Returns: (none)
+// Returns: the wait status
 //-
 
-void cdFunc(char *args[], int nargs) {
-    // New character pointer varible for storing start of string of directory
-    char *newDirectory;
-    // Check if user would like to return back a directory (the current directory is changed to the home directory), if only a single word is input (without a space)
-    if (nargs == 1) {
-        // Retrieve a pointer to the password file entry of a user
-        struct passwd *pw = getpwuid(getuid());
-        // Ensure the result is not NULL and print an error if the pw_dir field of the password struct cannout be used to retrive the home directory
-        if (pw == NULL) {
-            printf("Error: Unable to retrieve home directory.\n");
-            return;
+int reapChild(pid_t pid, const char *name, int64_t startNs) {
+    struct rusage ru;
+    struct usage u;
+    int status = 0;
+    while (wait4(pid, &status, 0, &ru) < 0) {
+        if (errno != EINTR) {
+            return status;
         }
-        // Set new directory pointer varible to current directory if there are no errors
-        newDirectory = pw->pw_dir;
-    }
-    // Check if user would like to move into a specified directory, if two words are input (separated by space)
-    else {
-        // Set new directory to the specified directory as the second argument of input (second word after the space), if that directory exists
-        newDirectory = args[1];
-    }
-    // Print an error if the specified directory does not exist
-    if (chdir(newDirectory) != 0) {
-        printf("Error: Unable to locate the specified directory.\n");
-        return;
     }
+    usageFromRusage(&u, &ru, nowNs() - startNs);
+    recordUsage(name, &u);
+    return status;
 }
 
 //+
-// Function: lsFunc
+// Function: writeProfile
 //
-// Purpose: This function lists the contents of the current working directory. If -a is used as the
-//          second argument, it can show hidden files (files that begin with .).
+// Purpose: Writes the session profile as CSV, one line per command name,
+//      when the shell exits.
 //
-// Parameters:
-//   args (Array containing the command and its arguments)
-//   nargs (Number of arguments in args)
+// Parameters: (none)
 //
 // Returns: (none)
 //-
 
-void lsFunc(char *args[], int nargs) {
-    // Flag to show hidden files (default: off)
-    int showHidden = 0;
-    // Ensure if two paramters are input, that an error message is printed, and the routine is returned at that point
-    if (nargs > 1 && strcmp(args[1], "-a") != 0) {
-        printf("Error: Invalid second input parameter (should be '-a').\n");
+void writeProfile() {
+    if (getpid() != shellPid) {
         return;
     }
-    // Set hidden flag on if the second word (paramter after the space) is equal to -a
-    if (nargs > 1 && strcmp(args[1], "-a") == 0) {
-        showHidden = 1;
+    FILE *out = profileOut;
+    fprintf(out, "command,count,wall_s,user_s,sys_s,max_rss_kb,minor_faults,major_faults,"
+            "voluntary_switches,involuntary_switches\n");
+    for (size_t i = 0; i < profileSlots; i++) {
+        struct profileEntry *e = &profile[i];
+        if (e->name == NULL) {
+            continue;
+        }
+        fprintf(out, "%s,%ld,%.6f,%.6f,%.6f,%ld,%ld,%ld,%ld,%ld\n", e->name, e->count,
+                e->total.wallNs / 1e9, e->total.userNs / 1e9, e->total.sysNs / 1e9, e->total.maxRss,
+                e->total.minorFaults, e->total.majorFaults, e->total.voluntarySwitches,
+                e->total.involuntarySwitches);
     }
-    // Since scandir function is used to list the contents of a directory, and it is passed a pointer to a pointer to a pointer of the dirent structure (directory entity) and stores an array of pointers to dirents in the pointer, nameList is the pointer to pointers
-    struct dirent **nameList;
-    // Set numEnts to the number of entries in the array using the pointer to the list, determining whether to include hidden files (files that start with a dot .) in the directory listing, and alphabetically sorting them
-    int numEnts = scandir(".", &nameList, showHidden ? NULL : filterHidden, alphaSort);
-    // Return if there are no entries and thus not in a current directory
-    if (numEnts < 0) {
-        return;
+    fclose(out);
+}
+
+//+
+// Function: profileInit
+//
+// Purpose: Turns the session profile on, to be written to fileName when
+//      the shell exits. The file is opened now, so a relative name is
+//      taken from the directory the shell started in. Exits if it can't
+//      be opened.
+//
+// Parameters:
+//   fileName (CSV file for the profile)
+//
+// Returns: (none)
+//-
+
+void profileInit(char *fileName) {
+    profileSlots = 64;
+    profile = calloc(profileSlots, sizeof(struct profileEntry));
+    if (profile == NULL) {
+        perror("profileInit");
+        exit(1);
     }
-    // Print the directory
-    for (int i = 0; i < numEnts; i++) {
-        printf("%s\n", nameList[i]->d_name);
-        free(nameList[i]);
+    if ((profileOut = fopen(fileName, "we")) == NULL) {
+        perror(fileName);
+        exit(1);
     }
-    free(nameList);
+    shellPid = getpid();
+    atexit(writeProfile);
 }
 
-// Associate a command name with a command handling function
-struct cmdStruct{
-   char *cmdName;
-   commandFunc cmdFunc;
+////////////////////////////// External Program  (Note this is step 4, complete doeInternalCommand first!!) ///////////////////////////////////
+
+// List of directorys to check for command
+// Terminated by null value
+char * path[] = {
+    ".",
+    "/usr/bin",
+    NULL
 };
 
-// Prototypes for command handling functions
-// TODO: add prototype for each comamand function
-void exitFunc(char *args[], int nargs);
-void pwdFunc(char *args[], int nargs);
-void lsFunc(char *args[], int nargs);
-void cdFunc(char *args[], int nargs);
+///////////////////
+// Command Cache //
+///////////////////
 
-// List commands and functions
-// Must be terminated by {NULL, NULL} 
-// In a real shell, this would be a hashtable.
-struct cmdStruct commands[] = {
-   // TODO: add entry for each command
-   {"exit", exitFunc},
-   {"pwd", pwdFunc},
-   {"ls", lsFunc},
-   {"cd", cdFunc},
-   {NULL, NULL}     // Terminator
+// Number of slots in the command cache, a power of two. The cache is
+// emptied when it gets half full, so probes stay short
+#define CACHE_SLOTS 256
+
+// Most directories in path[]
+#define MAX_PATH_DIRS 16
+
+// A command name and the file it was found as
+struct cacheEntry{
+    char *name;
+    // directory, slash and name, as passed to execv
+    char *file;
+    // index of the directory in path[]
+    int dir;
+    // times the command has been run through the cache
+    unsigned long hits;
 };
 
+// Commands found in the path, open addressing with linear probing. Entries
+// are only ever removed all at once, so there are no deleted markers
+struct cacheEntry cache[CACHE_SLOTS];
+int cacheCount = 0;
+
+// The path directories, held open so checking one is an fstat rather than a
+// walk of its name, and their modification times when the cache was filled.
+// -1 is a directory not yet opened, or that couldn't be
+int pathFds[MAX_PATH_DIRS];
+struct timespec pathTimes[MAX_PATH_DIRS];
+// directory modification times close to when they were read, which a change
+// in the same clock tick could leave unchanged
+int pathRacy[MAX_PATH_DIRS];
+int pathOpened = 0;
+
 //+
-// Function: doInternalCommand
+// Function: hashName
 //
-// Purpose: Checks if the specified command input is an valid internal command by comparing the input 
-//          to a predefined list of commands and their associated functions. If the input matches a predifned
-//          command the corresponding function is called with the given arguments. 
+// Purpose: FNV-1a hash of a command name, for the command cache and the
+//      table of internal commands.
 //
 // Parameters:
-//   args (Array containing the command and its arguments)
-//   nargs (Number of arguments in args)
+//   name (command name)
+//
+// Returns: the hash
+//-
+
+uint32_t hashName(const char *name){
+    uint32_t hash = 2166136261u;
+    while (*name != '\0') {
+        hash = (hash ^ (unsigned char) *name++) * 16777619u;
+    }
+    return hash;
+}
+
+//+
+// Function: cacheClear
+//
+// Purpose: Forgets every command in the cache.
+//
+// Parameters: (none)
+//
+// Returns: (none)
+//-
+
+void cacheClear() {
+    for (int i = 0; i < CACHE_SLOTS && cacheCount > 0; i++) {
+        if (cache[i].name != NULL) {
+            free(cache[i].name);
+            free(cache[i].file);
+            cache[i].name = NULL;
+            cacheCount--;
+        }
+    }
+}
+
+//+
+// Function: pathDirsChanged
+//
+// Purpose: Checks directories 0 to last of path[] against the times recorded
+//      when the cache was filled, and records the new times. A command found
+//      in directory d depends on directories 0 to d, as a new file in an
+//      earlier directory would be found first. Directories are opened the
+//      first time they are checked.
+//
+// Parameters:
+//   last (index of the last directory to check)
 //
 // Returns:
-//   1: If args[0] is an internal command and its corresponding function is executed.
-//   0: If args[0] is not an internal command.
+//   1 = a directory has changed, or may have
+//   0 = none of the directories has changed
 //-
 
-int doInternalCommand(char * args[], int nargs){
-    // TODO: function contents (step 3)
-    int i = 0;
-    while (commands[i].cmdName != NULL) {
-        //printf("%d ", strcmp(commands[i].cmdName,args[0]));
-        if (strcmp(commands[i].cmdName,args[0]) == 0) {
-            commands[i].cmdFunc(args, nargs);
-            return 1;
+int pathDirsChanged(int last) {
+    struct stat status;
+    struct timespec now;
+    int changed = 0;
+
+    if (!pathOpened) {
+        for (int i = 0; i < MAX_PATH_DIRS; i++) {
+            pathFds[i] = -1;
         }
-        i++;
+        pathOpened = 1;
     }
-    return 0;
-}
\ No newline at end of file
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (int i = 0; i <= last && path[i] != NULL; i++) {
+        if (pathFds[i] < 0) {
+            pathFds[i] = open(path[i], O_PATH | O_DIRECTORY | O_CLOEXEC);
+        }
+        struct timespec mtime = {0, 0};
+        if (pathFds[i] >= 0 && fstat(pathFds[i], &status) == 0) {
+            mtime = status.st_mtim;
+        }
+        if (pathRacy[i] || mtime.tv_sec != pathTimes[i].tv_sec || mtime.tv_nsec != pathTimes[i].tv_nsec) {
+            changed = 1;
+        }
+        pathTimes[i] = mtime;
+        // as with git's index, a time within a second of now isn't trusted
+        pathRacy[i] = now.tv_sec - mtime.tv_sec <= 1;
+    }
+    return changed;
+}
+
+//+
+// Function: pathOpenAll
+//
+// Purpose: Opens every directory of path[] and records its time, as the
+//      first command looked up would.
+//
+// Parameters: (none)
+//
+// Returns: (none)
+//-
+
+void pathOpenAll() {
+    pathDirsChanged(MAX_PATH_DIRS - 1);
+}
+
+//+
+// Function: cacheCwdChanged
+//
+// Purpose: Called after a change of directory. Relative directories in path[]
+//      now name other directories, so they are reopened, and the cache is
+//      emptied.
+//
+// Parameters: (none)
+//
+// Returns: (none)
+//-
+
+void cacheCwdChanged() {
+    for (int i = 0; pathOpened && path[i] != NULL; i++) {
+        if (path[i][0] != '/' && pathFds[i] >= 0) {
+            close(pathFds[i]);
+            pathFds[i] = -1;
+        }
+    }
+    cacheClear();
+}
+
+//+
+// Function: searchPath
+//
+// Purpose: Searches for an executable file that matches name in the
+//      directories listed in the path array, relative to the open
+//      directories so no path strings are built.
+//
+// Parameters:
+//   name (command name)
+//   dir (set to the index of the directory the file is in)
+//
+// Returns:
+//   1 = found an executable file
+//   0 = not found, or the file found is not executable
+//-
+
+int searchPath(const char *name, int *dir){
+    struct stat status;
+    int currentDirectory = 0;
+    // Loop through the directories in the 'path' array to find the executable
+    while (path[currentDirectory] != NULL) {
+        // Check the status of the file
+        if (pathFds[currentDirectory] >= 0 && fstatat(pathFds[currentDirectory], name, &status, 0) == 0) {
+            if (S_ISREG(status.st_mode)) {
+                if (status.st_mode&S_IXUSR) {
+                    // The file is a regular file and is executable
+                    *dir = currentDirectory;
+                    return 1;
+                }
+                else {
+                    // The file is not executable
+                    printf("Error: File found is not executable.\n");
+                    return 0;
+                }
+            }
+        }
+        currentDirectory++;
+    }
+    return 0;
+}
+
+//+
+// Function: findProgram
+//
+// Purpose: Finds the file to run for a command. Commands already run are
+//      taken from the cache after checking, with one fstat each, that the
+//      directories they depend on haven't changed. Others are searched for
+//      in the path and added to the cache.
+//
+// Parameters:
+//   name (command name)
+//
+// Returns: the file to execute, owned by the cache, or NULL if there is no
+//      executable file for the command
+//-
+
+const char * findProgram(const char *name){
+    int lastDir = 0;
+    while (path[lastDir + 1] != NULL) {
+        lastDir++;
+    }
+    uint32_t slot = hashName(name) & (CACHE_SLOTS - 1);
+    while (cache[slot].name != NULL && strcmp(cache[slot].name, name) != 0) {
+        slot = (slot + 1) & (CACHE_SLOTS - 1);
+    }
+    if (cache[slot].name != NULL) {
+        if (!pathDirsChanged(cache[slot].dir)) {
+            cache[slot].hits++;
+            return cache[slot].file;
+        }
+        // the times of every directory are checked again before searching
+        cacheClear();
+    }
+    if (pathDirsChanged(lastDir)) {
+        cacheClear();
+    }
+
+    int dir;
+    if (!searchPath(name, &dir)) {
+        return NULL;
+    }
+    if (cacheCount >= CACHE_SLOTS / 2) {
+        cacheClear();
+    }
+    slot = hashName(name) & (CACHE_SLOTS - 1);
+    while (cache[slot].name != NULL) {
+        slot = (slot + 1) & (CACHE_SLOTS - 1);
+    }
+    // Create the complete command path
+    char *file = malloc(strlen(path[dir]) + strlen("/") + strlen(name) + 1);
+    char *copy = strdup(name);
+    if (file == NULL || copy == NULL) {
+        perror("findProgram");
+        exit(1);
+    }
+    sprintf(file, "%s/%s", path[dir], name);
+    cache[slot].name = copy;
+    cache[slot].file = file;
+    cache[slot].dir = dir;
+    cache[slot].hits = 1;
+    cacheCount++;
+    return file;
+}
+
+//+
+// Function: doProgram
+//
+// Purpose: Finds the executable file that matches input through the command cache.
+//      If executable is found, it is started in a child process with spawnProgram,
+//      by posix_spawn or by fork and execv (takes path of file to execute and the arguements),
+//      and the shell waits for it to finish.
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns:
+//   1 = found and executed the file
+//   0 = could not find and execute the file
+//-
+
+int doProgram(char *args[], int nargs){
+    // Find the executable
+    const char *cmd_path = findProgram(args[0]);
+    // If cmd_path is NULL, no executable was found
+    if (cmd_path == NULL) {
+        return 0;
+    }
+    // Start a child process
+    int64_t startNs = nowNs();
+    pid_t processID = spawnProgram(cmd_path, args, spawnMethod, -1, -1);
+    if (processID == -1) {
+        // Child process could not be created, or the file could not be executed
+        perror(cmd_path);
+        return 1;
+    }
+    reapChild(processID, args[0], startNs);
+    return 1;
+}
+
+////////////////////////////// Jobs ///////////////////////////////////
+
+// Most background jobs at once
+#define MAXJOBS 64
+
+// A pipeline running in the background
+struct job{
+    // job number shown to the user, 0 for a free slot
+    int id;
+    // its processes, each set to 0 when it has been reaped
+    pid_t *pids;
+    int numPids;
+    // processes not yet reaped
+    int running;
+    // wait status of the last command of the pipeline
+    int status;
+    // what its processes have used, added up as they are reaped
+    struct usage usage;
+    // when it was started, from nowNs
+    int64_t startNs;
+    // the command line, for jobs and the done message
+    char *command;
+};
+
+// The background jobs. The SIGCHLD handler reaps their processes, so the
+// rest of the shell changes the table with SIGCHLD blocked
+struct job jobs[MAXJOBS];
+// just SIGCHLD, for blocking it
+sigset_t childMask;
+
+//+
+// Function: reapJobs
+//
+// Purpose: SIGCHLD handler. Reaps whichever processes of the background jobs
+//      have finished. Only the jobs' own processes are waited for, never
+//      any child, so the shell's waits for commands in the foreground are
+//      left alone.
+//
+// Parameters:
+//   sig (SIGCHLD)
+//
+// Returns: (none)
+//-
+
+void reapJobs(int sig) {
+    int savedErrno = errno;
+    for (int j = 0; j < MAXJOBS; j++) {
+        struct job *job = &jobs[j];
+        for (int i = 0; job->id != 0 && i < job->numPids; i++) {
+            int status;
+            struct rusage ru;
+            if (job->pids[i] > 0 && wait4(job->pids[i], &status, WNOHANG, &ru) > 0) {
+                // only arithmetic and clock_gettime, safe in a handler
+                struct usage u;
+                usageFromRusage(&u, &ru, 0);
+                usageAdd(&job->usage, &u);
+                job->usage.wallNs = nowNs() - job->startNs;
+                job->pids[i] = 0;
+                job->running--;
+                if (i == job->numPids - 1) {
+                    job->status = status;
+                }
+            }
+        }
+    }
+    errno = savedErrno;
+}
+
+//+
+// Function: jobsInit
+//
+// Purpose: Installs the SIGCHLD handler. Slow calls such as reading the next
+//      command are restarted after it runs.
+//
+// Parameters: (none)
+//
+// Returns: (none)
+//-
+
+void jobsInit() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = reapJobs;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+    sigemptyset(&childMask);
+    sigaddset(&childMask, SIGCHLD);
+}
+
+//+
+// Function: addJob
+//
+// Purpose: Records a pipeline started in the background and prints its job
+//      number and the process id of its last command. SIGCHLD must be
+//      blocked from before the processes were started, so none can be
+//      missed.
+//
+// Parameters:
+//   pids, numPids (the processes of the pipeline)
+//   command (the command line)
+//   startNs (when the pipeline was started, from nowNs)
+//
+// Returns: (none)
+//-
+
+void addJob(pid_t pids[], int numPids, const char *command, int64_t startNs) {
+    int id = 1;
+    for (int j = 0; j < MAXJOBS; j++) {
+        if (jobs[j].id >= id) {
+            id = jobs[j].id + 1;
+        }
+    }
+    for (int j = 0; j < MAXJOBS; j++) {
+        if (jobs[j].id == 0) {
+            struct job *job = &jobs[j];
+            job->pids = malloc(numPids * sizeof(pid_t));
+            job->command = strdup(command);
+            if (job->pids == NULL || job->command == NULL) {
+                perror("addJob");
+                exit(1);
+            }
+            memcpy(job->pids, pids, numPids * sizeof(pid_t));
+            job->numPids = job->running = numPids;
+            job->status = 0;
+            memset(&job->usage, 0, sizeof(struct usage));
+            job->startNs = startNs;
+            job->id = id;
+            printf("[%d] %d\n", id, pids[numPids - 1]);
+            return;
+        }
+    }
+    // no room, so wait for it as if it were in the foreground
+    printf("Error: Too many jobs, waiting for this one.\n");
+    for (int i = 0; i < numPids; i++) {
+        reapChild(pids[i], command, startNs);
+    }
+}
+
+//+
+// Function: reportJob
+//
+// Purpose: Prints a job's state, and frees it if it has finished, recording
+//      what it used under the name of its first command. SIGCHLD must be
+//      blocked.
+//
+// Parameters:
+//   job (the job)
+//
+// Returns: (none)
+//-
+
+void reportJob(struct job *job) {
+    if (job->running > 0) {
+        printf("[%d]  Running\t\t%s\n", job->id, job->command);
+        return;
+    }
+    if (WIFEXITED(job->status) && WEXITSTATUS(job->status) != 0) {
+        printf("[%d]  Exit %d\t\t%s\n", job->id, WEXITSTATUS(job->status), job->command);
+    } else if (WIFSIGNALED(job->status)) {
+        printf("[%d]  Killed (%s)\t%s\n", job->id, strsignal(WTERMSIG(job->status)), job->command);
+    } else {
+        printf("[%d]  Done\t\t%s\n", job->id, job->command);
+    }
+    // the command line is thrown away, so it can be cut at the first word
+    job->command[strcspn(job->command, " ")] = '\0';
+    recordUsage(job->command, &job->usage);
+    free(job->command);
+    free(job->pids);
+    job->id = 0;
+}
+
+//+
+// Function: reportDoneJobs
+//
+// Purpose: Prints and frees the jobs that have finished, before a prompt.
+//
+// Parameters: (none)
+//
+// Returns: (none)
+//-
+
+void reportDoneJobs() {
+    sigset_t oldMask;
+    sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+    for (int j = 0; j < MAXJOBS; j++) {
+        if (jobs[j].id != 0 && jobs[j].running == 0) {
+            reportJob(&jobs[j]);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+}
+
+////////////////////////////// Internal Command Handling (Step 3) ///////////////////////////////////
+
+///////////////////////////////
+// Command Handling Functions //
+///////////////////////////////
+
+// TODO: a function for each command handling function
+// goes here. Also make sure a comment block prefaces
+// each of the command handling functions.
+
+// Define command handling function pointer type
+typedef void(*commandFunc)(char * args[], int nargs);
+
+//+
+// Function: exitFunc
+//
+// Purpose: Exits the shell
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void exitFunc(char *args[], int nargs) {
+    // Exits the system
+    exit(0);
+}
+
+//+
+// Function: pwdFunc
+//
+// Purpose: Retrieves and prints the current working directory.
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void pwdFunc(char *args[], int nargs) {
+    // Get the current working directory.
+    char *cwd = getcwd(NULL, 0);
+    // Check if getcwd() returned NULL (indicating an error).
+    if (cwd == NULL) {
+        printf("Error: Could not retrive working directory.\n");
+    }
+    // If getcwd() was successful, print the current working directory and free the allocated memory.
+    else {
+        printf("%s\n", cwd);
+        free(cwd);
+    }
+}
+
+//+
+// Function: cdFunc
+//
+// Purpose: Changes the current working directory based on input. If only cd is entered with no second argument,
+//          it changes the current directory to one before/above the current. If another arguement is provided
+//          after cd it changes the current directory to the specified directory.
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void cdFunc(char *args[], int nargs) {
+    // New character pointer varible for storing start of string of directory
+    char *newDirectory;
+    // Check if user would like to return back a directory (the current directory is changed to the home directory), if only a single word is input (without a space)
+    if (nargs == 1) {
+        // Retrieve a pointer to the password file entry of a user
+        struct passwd *pw = getpwuid(getuid());
+        // Ensure the result is not NULL and print an error if the pw_dir field of the password struct cannout be used to retrive the home directory
+        if (pw == NULL) {
+            printf("Error: Unable to retrieve home directory.\n");
+            return;
+        }
+        // Set new directory pointer varible to current directory if there are no errors
+        newDirectory = pw->pw_dir;
+    }
+    // Check if user would like to move into a specified directory, if two words are input (separated by space)
+    else {
+        // Set new directory to the specified directory as the second argument of input (second word after the space), if that directory exists
+        newDirectory = args[1];
+    }
+    // Print an error if the specified directory does not exist
+    if (chdir(newDirectory) != 0) {
+        printf("Error: Unable to locate the specified directory.\n");
+        return;
+    }
+    // "." in the path is now another directory
+    cacheCwdChanged();
+}
+
+//+
+// Function: lsFunc
+//
+// Purpose: This function lists the contents of the current working directory, or of the directory
+//          given, sorted by name ignoring case. Options can be given separately or together: -a shows
+//          hidden files (files that begin with .), -U lists in directory order as entries are read,
+//          and -l shows the mode, links, owner, group, size and time of each entry.
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void lsFunc(char *args[], int nargs) {
+    // Listing flags, default is sorted names without hidden files
+    int flags = 0;
+    char *directory = ".";
+    for (int i = 1; i < nargs; i++) {
+        if (args[i][0] != '-' || args[i][1] == '\0') {
+            if (strcmp(directory, ".") != 0) {
+                printf("Error: ls takes one directory.\n");
+                return;
+            }
+            directory = args[i];
+            continue;
+        }
+        for (char *option = args[i] + 1; *option != '\0'; option++) {
+            if (*option == 'a') {
+                flags |= LIST_ALL;
+            } else if (*option == 'U') {
+                flags |= LIST_UNSORTED;
+            } else if (*option == 'l') {
+                flags |= LIST_LONG;
+            } else {
+                printf("Error: Invalid option '-%c' (should be -a, -U or -l).\n", *option);
+                return;
+            }
+        }
+    }
+    fflush(stdout);
+    if (listDirectory(directory, flags, stdout) != 0) {
+        perror(directory);
+    }
+}
+
+//+
+// Function: findFunc
+//
+// Purpose: Prints the paths of the entries under each starting path, and the paths themselves,
+//          that match every predicate given. The tree is walked by walkTrees on a pool of
+//          threads, so paths come out as they are found rather than in directory order.
+//          -size n is in 512 byte blocks unless it ends in c (bytes), k, M or G, and sizes
+//          are rounded up to whole units; +n means more than n and -n less than n.
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void findFunc(char *args[], int nargs) {
+    struct walkOptions options;
+    memset(&options, 0, sizeof(options));
+    options.mode = WALK_FIND;
+    options.numThreads = walkDefaultThreads();
+    // the starting paths come before the first predicate
+    int numRoots = 1;
+    while (numRoots < nargs && args[numRoots][0] != '-') {
+        numRoots++;
+    }
+    for (int i = numRoots; i < nargs; i += 2) {
+        char *value = i + 1 < nargs ? args[i + 1] : NULL;
+        char *end = NULL;
+        if (value == NULL) {
+            printf("Error: find %s needs a value.\n", args[i]);
+            return;
+        } else if (strcmp(args[i], "-name") == 0) {
+            options.namePattern = value;
+        } else if (strcmp(args[i], "-type") == 0 && strchr("fdl", value[0]) != NULL && value[1] == '\0') {
+            options.type = value[0];
+        } else if (strcmp(args[i], "-size") == 0) {
+            options.sizeCompare = value[0] == '+' ? SIZE_MORE : value[0] == '-' ? SIZE_LESS : SIZE_EQUAL;
+            options.size = strtoull(value + (value[0] == '+' || value[0] == '-'), &end, 10);
+            const char *units = "ckMG";
+            uint64_t unitSizes[] = {1, 1024, 1024 * 1024, 1024 * 1024 * 1024};
+            if (*end == '\0') {
+                options.sizeUnit = 512;
+            } else if (strchr(units, *end) != NULL && end[1] == '\0') {
+                options.sizeUnit = unitSizes[strchr(units, *end) - units];
+            } else {
+                printf("Error: Invalid size '%s'.\n", value);
+                return;
+            }
+        } else if (strcmp(args[i], "-j") == 0 && atoi(value) > 0) {
+            options.numThreads = atoi(value);
+        } else {
+            printf("Error: Invalid find option '%s %s'.\n", args[i], value);
+            return;
+        }
+    }
+    char *dot[] = {"."};
+    fflush(stdout);
+    walkTrees(numRoots > 1 ? &args[1] : dot, numRoots > 1 ? numRoots - 1 : 1, &options);
+}
+
+//+
+// Function: duFunc
+//
+// Purpose: Prints the disk usage in KiB of each directory under each path (default .), or
+//          with -s only of each path. A directory is printed as soon as everything under it
+//          has been counted. Files with several hard links are counted once.
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void duFunc(char *args[], int nargs) {
+    struct walkOptions options;
+    memset(&options, 0, sizeof(options));
+    options.mode = WALK_DU;
+    options.numThreads = walkDefaultThreads();
+    int first = 1;
+    while (first < nargs && args[first][0] == '-') {
+        if (strcmp(args[first], "-s") == 0) {
+            options.summarize = 1;
+        } else if (strcmp(args[first], "-j") == 0 && first + 1 < nargs && atoi(args[first + 1]) > 0) {
+            options.numThreads = atoi(args[++first]);
+        } else {
+            printf("Error: Invalid du option '%s'.\n", args[first]);
+            return;
+        }
+        first++;
+    }
+    char *dot[] = {"."};
+    fflush(stdout);
+    walkTrees(first < nargs ? &args[first] : dot, first < nargs ? nargs - first : 1, &options);
+}
+
+//+
+// Function: hashFunc
+//
+// Purpose: Shows or changes the command cache. With no arguments, lists each
+//          cached command with the number of times it has been run and the
+//          file it runs. hash -r empties the cache, and hash name... looks
+//          each name up in the path and adds it to the cache.
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void hashFunc(char *args[], int nargs) {
+    if (nargs > 1 && strcmp(args[1], "-r") == 0) {
+        cacheClear();
+        return;
+    }
+    if (nargs > 1) {
+        for (int i = 1; i < nargs; i++) {
+            if (findProgram(args[i]) == NULL) {
+                printf("Error: Command '%s' not found.\n", args[i]);
+            }
+        }
+        return;
+    }
+    if (cacheCount == 0) {
+        printf("hash: cache is empty\n");
+        return;
+    }
+    printf("hits\tcommand\n");
+    for (int i = 0; i < CACHE_SLOTS; i++) {
+        if (cache[i].name != NULL) {
+            printf("%4lu\t%s\n", cache[i].hits, cache[i].file);
+        }
+    }
+}
+
+// Bytes moved by each splice, tee or sendfile call
+#define RELAY_CHUNK (1 << 20)
+
+//+
+// Function: relay
+//
+// Purpose: Copies in to out until the end of in. The data stays in the
+//      kernel where it can: splice when either end is a pipe, or sendfile
+//      from a regular file. Otherwise, or if the kernel refuses, for example
+//      for a terminal, it is copied through a buffer.
+//
+// Parameters:
+//   in, out (file descriptors to copy from and to)
+//
+// Returns:
+//   0 = copied everything
+//   -1 = an error, with errno set
+//-
+
+int relay(int in, int out) {
+    struct stat inStatus, outStatus;
+    if (fstat(in, &inStatus) != 0 || fstat(out, &outStatus) != 0) {
+        return -1;
+    }
+    int useSplice = S_ISFIFO(inStatus.st_mode) || S_ISFIFO(outStatus.st_mode);
+    int useSendfile = !useSplice && S_ISREG(inStatus.st_mode);
+    while (useSplice || useSendfile) {
+        ssize_t n;
+        if (useSplice) {
+            n = splice(in, NULL, out, NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else {
+            n = sendfile(out, in, NULL, RELAY_CHUNK);
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // nothing has been moved yet, try the next way
+            useSendfile = useSplice && S_ISREG(inStatus.st_mode);
+            useSplice = 0;
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+    }
+
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(in, buffer, sizeof(buffer))) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t written = write(out, buffer + done, n - done);
+            if (written < 0 && errno != EINTR) {
+                return -1;
+            }
+            done += written > 0 ? written : 0;
+        }
+    }
+    return 0;
+}
+
+//+
+// Function: catFunc
+//
+// Purpose: Copies each file named, or standard input if there are none, to
+//          standard output with relay, so in a pipeline the data goes from the
+//          file to the pipe without passing through the shell.
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void catFunc(char *args[], int nargs) {
+    fflush(stdout);
+    if (nargs == 1 && relay(STDIN_FILENO, STDOUT_FILENO) != 0) {
+        perror("cat");
+    }
+    for (int i = 1; i < nargs; i++) {
+        int fd = open(args[i], O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(args[i]);
+            continue;
+        }
+        if (relay(fd, STDOUT_FILENO) != 0) {
+            perror(args[i]);
+        }
+        close(fd);
+    }
+}
+
+//+
+// Function: teeFunc
+//
+// Purpose: Copies standard input to standard output and to a file, which is
+//          appended to with -a. When the input and output are both pipes, tee(2)
+//          copies the input into the output pipe without using it up, and
+//          splice then moves the same bytes to the file, so nothing is copied
+//          through the shell.
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void teeFunc(char *args[], int nargs) {
+    int append = nargs > 1 && strcmp(args[1], "-a") == 0;
+    if (nargs > 2 + append) {
+        printf("Error: tee takes one file.\n");
+        return;
+    }
+    fflush(stdout);
+    if (nargs == 1 + append) {
+        if (relay(STDIN_FILENO, STDOUT_FILENO) != 0) {
+            perror("tee");
+        }
+        return;
+    }
+    char *fileName = args[1 + append];
+    int fd = open(fileName, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+    if (fd < 0) {
+        perror(fileName);
+        return;
+    }
+
+    struct stat inStatus, outStatus;
+    int zeroCopy = fstat(STDIN_FILENO, &inStatus) == 0 && fstat(STDOUT_FILENO, &outStatus) == 0
+        && S_ISFIFO(inStatus.st_mode) && S_ISFIFO(outStatus.st_mode);
+    while (zeroCopy) {
+        ssize_t n = tee(STDIN_FILENO, STDOUT_FILENO, RELAY_CHUNK, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EINVAL) {
+            // the kernel can't, nothing has been copied yet
+            zeroCopy = 0;
+            break;
+        }
+        if (n <= 0) {
+            if (n < 0) {
+                perror("tee");
+            }
+            close(fd);
+            return;
+        }
+        // the bytes copied to the output are still in the input pipe
+        while (n > 0) {
+            ssize_t moved = splice(STDIN_FILENO, NULL, fd, NULL, n, SPLICE_F_MOVE);
+            if (moved < 0 && errno == EINTR) {
+                continue;
+            }
+            if (moved <= 0) {
+                perror(fileName);
+                close(fd);
+                return;
+            }
+            n -= moved;
+        }
+    }
+
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, buffer, sizeof(buffer))) != 0) {
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 || write(STDOUT_FILENO, buffer, n) != n || write(fd, buffer, n) != n) {
+            perror("tee");
+            break;
+        }
+    }
+    close(fd);
+}
+
+//+
+// Function: jobsFunc
+//
+// Purpose: Lists the background jobs, and frees those that have finished.
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void jobsFunc(char *args[], int nargs) {
+    sigset_t oldMask;
+    sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+    for (int j = 0; j < MAXJOBS; j++) {
+        if (jobs[j].id != 0) {
+            reportJob(&jobs[j]);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+}
+
+//+
+// Function: waitFunc
+//
+// Purpose: Waits for the background jobs given by number (with or without a
+//          leading %), or for all of them if none are given, and reports them.
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void waitFunc(char *args[], int nargs) {
+    sigset_t oldMask;
+    sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+    for (int j = 0; j < MAXJOBS; j++) {
+        int wanted = jobs[j].id != 0 && nargs == 1;
+        for (int i = 1; i < nargs && jobs[j].id != 0; i++) {
+            wanted |= atoi(args[i][0] == '%' ? args[i] + 1 : args[i]) == jobs[j].id;
+        }
+        if (!wanted) {
+            continue;
+        }
+        // the handler reaps while sigsuspend has SIGCHLD unblocked
+        while (jobs[j].running > 0) {
+            sigsuspend(&oldMask);
+        }
+        reportJob(&jobs[j]);
+    }
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+}
+
+//+
+// Function: parallelFunc
+//
+// Purpose: parallel [-j N] cmd [args...] ::: input... runs cmd args input once
+//          for each input, with N running at once (default one per CPU). With no
+//          ::: the inputs are the lines of standard input, so it can be fed
+//          by a pipeline. When all have finished the wall time is printed next
+//          to the user and system CPU time of the commands, so the speedup
+//          can be seen.
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void parallelFunc(char *args[], int nargs) {
+    int maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1;
+    if (nargs > 2 && strcmp(args[1], "-j") == 0) {
+        maxJobs = atoi(args[2]);
+        first = 3;
+    }
+    int separator = first;
+    while (separator < nargs && strcmp(args[separator], ":::") != 0) {
+        separator++;
+    }
+    if (maxJobs < 1 || separator == first) {
+        printf("Error: usage is parallel [-j N] cmd [args...] [::: input...]\n");
+        return;
+    }
+    const char *file = findProgram(args[first]);
+    if (file == NULL) {
+        printf("Error: Command '%s' not found.\n", args[first]);
+        return;
+    }
+    // inputs are read from the descriptor, not the shell's buffered commands
+    FILE *input = NULL;
+    if (separator == nargs && (input = fdopen(fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0), "r")) == NULL) {
+        perror("parallel");
+        return;
+    }
+    // the command, its arguments, one input and the null
+    int cmdArgs = separator - first;
+    char **jobArgs = malloc((cmdArgs + 2) * sizeof(char *));
+    pid_t *running = malloc(maxJobs * sizeof(pid_t));
+    int64_t *startTimes = malloc(maxJobs * sizeof(int64_t));
+    if (jobArgs == NULL || running == NULL || startTimes == NULL) {
+        perror("parallel");
+        exit(1);
+    }
+    memcpy(jobArgs, &args[first], cmdArgs * sizeof(char *));
+    jobArgs[cmdArgs + 1] = NULL;
+
+    struct timespec start, end;
+    struct rusage usage;
+    int64_t cpuNs = 0;
+    int numRunning = 0;
+    int started = 0;
+    int failed = 0;
+    int next = separator + 1;
+    char *line = NULL;
+    size_t lineSize = 0;
+    int moreInput = 1;
+    sigset_t oldMask;
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+    while (moreInput || numRunning > 0) {
+        // keep maxJobs running while there is input
+        while (moreInput && numRunning < maxJobs) {
+            if (separator < nargs) {
+                moreInput = next < nargs;
+                jobArgs[cmdArgs] = moreInput ? args[next++] : NULL;
+            } else {
+                ssize_t len = getline(&line, &lineSize, input);
+                moreInput = len > 0;
+                if (moreInput && line[len - 1] == '\n') {
+                    line[len - 1] = '\0';
+                }
+                jobArgs[cmdArgs] = line;
+            }
+            if (!moreInput) {
+                break;
+            }
+            pid_t pid = spawnProgram(file, jobArgs, spawnMethod, -1, -1);
+            if (pid < 0) {
+                perror(file);
+                failed++;
+                continue;
+            }
+            startTimes[numRunning] = nowNs();
+            running[numRunning++] = pid;
+            started++;
+        }
+        // reap whichever have finished, or sleep until one does
+        int reaped = 0;
+        for (int i = 0; i < numRunning; i++) {
+            int status;
+            if (wait4(running[i], &status, WNOHANG, &usage) > 0) {
+                struct usage u;
+                usageFromRusage(&u, &usage, nowNs() - startTimes[i]);
+                recordUsage(jobArgs[0], &u);
+                cpuNs += u.userNs + u.sysNs;
+                failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+                startTimes[i] = startTimes[numRunning - 1];
+                running[i--] = running[--numRunning];
+                reaped++;
+            }
+        }
+        if (reaped == 0 && numRunning > 0) {
+            sigsuspend(&oldMask);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("parallel: %d jobs (%d failed), %d at once, %.3f s wall, %.3f s CPU, %.2fx\n",
+           started, failed, maxJobs, wall, cpuNs / 1e9, wall > 0 ? cpuNs / 1e9 / wall : 0.0);
+    if (input != NULL) {
+        fclose(input);
+    }
+    free(line);
+    free(jobArgs);
+    free(running);
+    free(startTimes);
+}
+
+//+
+// Function: timeFunc
+//
+// Purpose: Runs the rest of the command line, a pipeline too, and prints to
+//      standard error what it used: wall time, user and system CPU, the
+//      largest resident set of its processes, page faults and context
+//      switches.
+//
+// Parameters:
+//   args (Array containing "time" and the command line to time)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void timeFunc(char *args[], int nargs) {
+    memset(&lineUsage, 0, sizeof(struct usage));
+    int64_t startNs = nowNs();
+    runCommandLine(&args[1], nargs - 1);
+    lineUsage.wallNs = nowNs() - startNs;
+    fflush(stdout);
+    fprintf(stderr, "real\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\n", lineUsage.wallNs / 1e9,
+            lineUsage.userNs / 1e9, lineUsage.sysNs / 1e9);
+    fprintf(stderr, "maxrss\t%ld KiB\nfaults\t%ld minor, %ld major\nswitches\t%ld voluntary, %ld involuntary\n",
+            lineUsage.maxRss, lineUsage.minorFaults, lineUsage.majorFaults,
+            lineUsage.voluntarySwitches, lineUsage.involuntarySwitches);
+}
+
+// Associate a command name with a command handling function
+struct cmdStruct{
+   char *cmdName;
+   commandFunc cmdFunc;
+};
+
+// Prototypes for command handling functions
+// TODO: add prototype for each comamand function
+void exitFunc(char *args[], int nargs);
+void pwdFunc(char *args[], int nargs);
+void lsFunc(char *args[], int nargs);
+void cdFunc(char *args[], int nargs);
+void hashFunc(char *args[], int nargs);
+void findFunc(char *args[], int nargs);
+void duFunc(char *args[], int nargs);
+void catFunc(char *args[], int nargs);
+void teeFunc(char *args[], int nargs);
+void jobsFunc(char *args[], int nargs);
+void waitFunc(char *args[], int nargs);
+void parallelFunc(char *args[], int nargs);
+void timeFunc(char *args[], int nargs);
+
+// List commands and functions
+// Must be terminated by {NULL, NULL} 
+// Looked up through builtinTable, built from this list by builtinInit.
+struct cmdStruct commands[] = {
+   // TODO: add entry for each command
+   {"exit", exitFunc},
+   {"pwd", pwdFunc},
+   {"ls", lsFunc},
+   {"cd", cdFunc},
+   {"hash", hashFunc},
+   {"find", findFunc},
+   {"du", duFunc},
+   {"cat", catFunc},
+   {"tee", teeFunc},
+   {"jobs", jobsFunc},
+   {"wait", waitFunc},
+   {"parallel", parallelFunc},
+   {"time", timeFunc},
+   {NULL, NULL}     // Terminator
+};
+
+// Number of slots in builtinTable, a power of two at least twice the number
+// of commands
+#define BUILTIN_SLOTS 32
+
+// The commands hashed by name, open addressing with linear probing
+struct cmdStruct *builtinTable[BUILTIN_SLOTS];
+
+//+
+// Function: builtinInit
+//
+// Purpose: Builds builtinTable from the commands list.
+//
+// Parameters: (none)
+//
+// Returns: (none)
+//-
+
+void builtinInit() {
+    for (int i = 0; commands[i].cmdName != NULL; i++) {
+        uint32_t slot = hashName(commands[i].cmdName) & (BUILTIN_SLOTS - 1);
+        while (builtinTable[slot] != NULL) {
+            slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+        }
+        builtinTable[slot] = &commands[i];
+    }
+}
+
+//+
+// Function: findBuiltin
+//
+// Purpose: Looks a command name up in builtinTable.
+//
+// Parameters:
+//   name (command name)
+//
+// Returns: the command, NULL if name is not an internal command
+//-
+
+struct cmdStruct * findBuiltin(const char *name) {
+    uint32_t slot = hashName(name) & (BUILTIN_SLOTS - 1);
+    while (builtinTable[slot] != NULL) {
+        if (strcmp(builtinTable[slot]->cmdName, name) == 0) {
+            return builtinTable[slot];
+        }
+        slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+    }
+    return NULL;
+}
+
+//+
+// Function: runMeasured
+//
+// Purpose: Runs an internal command in the shell and records what it used,
+//      the change in the shell's own usage, all threads included.
+//
+// Parameters:
+//   command (the internal command)
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns: (none)
+//-
+
+void runMeasured(struct cmdStruct *command, char *args[], int nargs) {
+    struct rusage before, after;
+    struct usage u, start;
+    getrusage(RUSAGE_SELF, &before);
+    int64_t startNs = nowNs();
+    command->cmdFunc(args, nargs);
+    int64_t wallNs = nowNs() - startNs;
+    getrusage(RUSAGE_SELF, &after);
+    usageFromRusage(&u, &after, wallNs);
+    usageFromRusage(&start, &before, 0);
+    u.userNs -= start.userNs;
+    u.sysNs -= start.sysNs;
+    u.minorFaults -= start.minorFaults;
+    u.majorFaults -= start.majorFaults;
+    u.voluntarySwitches -= start.voluntarySwitches;
+    u.involuntarySwitches -= start.involuntarySwitches;
+    recordUsage(command->cmdName, &u);
+}
+
+//+
+// Function: doInternalCommand
+//
+// Purpose: Checks if the specified command input is an valid internal command by looking the input 
+//          up in the table of predefined commands and their associated functions. If the input matches a predifned
+//          command the corresponding function is called with the given arguments. 
+//
+// Parameters:
+//   args (Array containing the command and its arguments)
+//   nargs (Number of arguments in args)
+//
+// Returns:
+//   1: If args[0] is an internal command and its corresponding function is executed.
+//   0: If args[0] is not an internal command.
+//-
+
+int doInternalCommand(char * args[], int nargs){
+    // TODO: function contents (step 3)
+    struct cmdStruct *command = findBuiltin(args[0]);
+    if (command != NULL) {
+        runMeasured(command, args, nargs);
+        return 1;
+    }
+    return 0;
+}
+////////////////////////////// Pipelines and Redirection ///////////////////////////////////
+
+// Bytes a pipe between commands can hold, so commands moving a lot of data
+// switch less often. Asked for, but pipes keep their default size if it is
+// more than an ordinary user may have
+#define PIPE_SIZE (1 << 20)
+
+// One command of a pipeline, with its redirections
+struct stage{
+    // the command and its arguments, ending with NULL
+    char **args;
+    int nargs;
+    // files for < and for > or >>, NULL if not redirected
+    char *inFile;
+    char *outFile;
+    int append;
+};
+
+//+
+// Function: isPipeline
+//
+// Purpose: Checks whether a command line has pipes or redirections.
+//
+// Parameters:
+//   args (Array containing the words of the command line)
+//   nargs (Number of words in args)
+//
+// Returns:
+//   1 = there is a |, <, >, >> or & operator
+//   0 = the command line is a single command
+//-
+
+int isPipeline(char *args[], int nargs) {
+    for (int i = 0; i < nargs; i++) {
+        if (isOperator(args[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//+
+// Function: parsePipeline
+//
+// Purpose: Splits a command line into the commands of a pipeline. The words
+//      are moved down in args over the operators and their file names, and
+//      each command's words are ended with NULL, so every stage's args point
+//      into args. A last word of & runs the pipeline in the background.
+//
+// Parameters:
+//   args (Array containing the words of the command line, ending with NULL)
+//   nargs (Number of words in args)
+//   stages (set to the commands, nargs entries fit)
+//   background (set to 1 if the pipeline ends with &, else 0)
+//
+// Returns: the number of commands, 0 if the pipeline is malformed
+//-
+
+int parsePipeline(char *args[], int nargs, struct stage stages[], int *background) {
+    *background = args[nargs - 1] == backgroundWord;
+    nargs -= *background;
+    int numStages = 0;
+    int w = 0;
+    int ok = 1;
+    memset(&stages[0], 0, sizeof(struct stage));
+    stages[0].args = args;
+    for (int i = 0; i < nargs && ok; i++) {
+        struct stage *st = &stages[numStages];
+        if (args[i] == pipeWord) {
+            // a command can't be empty
+            ok = st->nargs > 0;
+            args[w++] = NULL;
+            numStages++;
+            memset(&stages[numStages], 0, sizeof(struct stage));
+            stages[numStages].args = &args[w];
+        } else if (args[i] == inWord || args[i] == outWord || args[i] == appendWord) {
+            // the file name is the next word
+            ok = i + 1 < nargs && !isOperator(args[i + 1]);
+            if (ok && args[i] == inWord) {
+                st->inFile = args[i + 1];
+            } else if (ok) {
+                st->outFile = args[i + 1];
+                st->append = args[i] == appendWord;
+            }
+            i++;
+        } else if (args[i] == backgroundWord) {
+            // & only goes at the end
+            ok = 0;
+        } else {
+            args[w++] = args[i];
+            st->nargs++;
+        }
+    }
+    args[w] = NULL;
+    if (!ok || stages[numStages].nargs == 0) {
+        printf("Error: Invalid pipeline.\n");
+        return 0;
+    }
+    return numStages + 1;
+}
+
+//+
+// Function: openRedirects
+//
+// Purpose: Opens the files a command is redirected to, in place of the
+//      pipes or the shell's own input and output. A descriptor that is
+//      replaced is closed.
+//
+// Parameters:
+//   st (the command)
+//   inFd, outFd (the command's input and output, -1 for the shell's)
+//
+// Returns:
+//   0 = the files were opened
+//   -1 = a file could not be opened, after printing why
+//-
+
+int openRedirects(struct stage *st, int *inFd, int *outFd) {
+    if (st->inFile != NULL) {
+        int fd = open(st->inFile, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(st->inFile);
+            return -1;
+        }
+        if (*inFd >= 0) {
+            close(*inFd);
+        }
+        *inFd = fd;
+    }
+    if (st->outFile != NULL) {
+        int fd = open(st->outFile, O_WRONLY | O_CREAT | O_CLOEXEC | (st->append ? O_APPEND : O_TRUNC), 0666);
+        if (fd < 0) {
+            perror(st->outFile);
+            return -1;
+        }
+        if (*outFd >= 0) {
+            close(*outFd);
+        }
+        *outFd = fd;
+    }
+    return 0;
+}
+
+//+
+// Function: runBuiltin
+//
+// Purpose: Runs an internal command in the shell with its input and output
+//      redirected, putting the shell's back afterwards. Used for a builtin
+//      on its own, so cd and hash still change the shell.
+//
+// Parameters:
+//   command (the internal command)
+//   st (its arguments)
+//   inFd, outFd (its input and output, -1 for the shell's)
+//
+// Returns: (none)
+//-
+
+void runBuiltin(struct cmdStruct *command, struct stage *st, int inFd, int outFd) {
+    int savedIn = -1;
+    int savedOut = -1;
+    fflush(stdout);
+    if (inFd >= 0) {
+        savedIn = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+        dup2(inFd, STDIN_FILENO);
+    }
+    if (outFd >= 0) {
+        savedOut = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+        dup2(outFd, STDOUT_FILENO);
+    }
+    runMeasured(command, st->args, st->nargs);
+    fflush(stdout);
+    if (savedIn >= 0) {
+        dup2(savedIn, STDIN_FILENO);
+        close(savedIn);
+    }
+    if (savedOut >= 0) {
+        dup2(savedOut, STDOUT_FILENO);
+        close(savedOut);
+    }
+}
+
+//+
+// Function: forkBuiltin
+//
+// Purpose: Runs an internal command of a pipeline in a child shell, which
+//      needs fork rather than posix_spawn, so it runs at the same time as
+//      the other commands.
+//
+// Parameters:
+//   command (the internal command)
+//   st (its arguments)
+//   inFd, outFd (its input and output, -1 for the shell's)
+//
+// Returns: the process id of the child, -1 if it could not be created
+//-
+
+pid_t forkBuiltin(struct cmdStruct *command, struct stage *st, int inFd, int outFd) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if ((inFd >= 0 && dup2(inFd, STDIN_FILENO) < 0) || (outFd >= 0 && dup2(outFd, STDOUT_FILENO) < 0)) {
+            perror("dup2");
+            _exit(1);
+        }
+        // let go of the pipes of the other commands, so they see the
+        // end of their input and output when they should
+        closefrom(STDERR_FILENO + 1);
+        // the path directories were closed too, reopen them when needed
+        pathOpened = 0;
+        // the shell blocked SIGCHLD while starting the pipeline
+        sigprocmask(SIG_UNBLOCK, &childMask, NULL);
+        command->cmdFunc(st->args, st->nargs);
+        fflush(stdout);
+        _exit(0);
+    }
+    return pid;
+}
+
+//+
+// Function: doPipeline
+//
+// Purpose: Runs a command line with pipes, redirections or a final &. The
+//      commands are all started, each reading the pipe from the one before
+//      and writing the pipe to the one after, and then the shell waits for
+//      all of them, or for a background job records them in the jobs table.
+//      A command that can't be started, or whose files can't be opened, is
+//      skipped, and the commands on either side of it see its pipes closed.
+//      The shell takes no part in moving the data.
+//
+// Parameters:
+//   args (Array containing the words of the command line, ending with NULL)
+//   nargs (Number of words in args)
+//
+// Returns: (none)
+//-
+
+void doPipeline(char *args[], int nargs) {
+    int numPids = 0;
+    int background;
+    // the command line for the jobs table, before parsing splits it up
+    size_t lineSize = 1;
+    for (int i = 0; i < nargs; i++) {
+        lineSize += strlen(args[i]) + 1;
+    }
+    char *commandLine = malloc(lineSize);
+    struct stage *stages = malloc(nargs * sizeof(struct stage));
+    pid_t *pids = malloc(nargs * sizeof(pid_t));
+    // the command name of each process, for its usage
+    char **names = malloc(nargs * sizeof(char *));
+    if (commandLine == NULL || stages == NULL || pids == NULL || names == NULL) {
+        perror("doPipeline");
+        exit(1);
+    }
+    char *end = commandLine;
+    for (int i = 0; i < nargs && args[i] != backgroundWord; i++) {
+        end = stpcpy(end, i > 0 ? " " : "");
+        end = stpcpy(end, args[i]);
+    }
+    int numStages = parsePipeline(args, nargs, stages, &background);
+    // read end of the pipe from the command before, -1 for the shell's input
+    int prevFd = -1;
+    sigset_t oldMask;
+
+    // a background job's processes mustn't be reaped before they are recorded
+    if (background) {
+        sigprocmask(SIG_BLOCK, &childMask, &oldMask);
+    }
+    fflush(stdout);
+    int64_t startNs = nowNs();
+    for (int i = 0; i < numStages; i++) {
+        struct stage *st = &stages[i];
+        int pipeFds[2] = {-1, -1};
+        if (i < numStages - 1) {
+            if (pipe2(pipeFds, O_CLOEXEC) != 0) {
+                perror("pipe");
+                break;
+            }
+            fcntl(pipeFds[1], F_SETPIPE_SZ, PIPE_SIZE);
+        }
+        int inFd = prevFd;
+        int outFd = pipeFds[1];
+        prevFd = pipeFds[0];
+        if (openRedirects(st, &inFd, &outFd) == 0) {
+            struct cmdStruct *command = findBuiltin(st->args[0]);
+            const char *file;
+            pid_t pid = -1;
+            if (command != NULL && numStages == 1 && !background) {
+                runBuiltin(command, st, inFd, outFd);
+            } else if (command != NULL) {
+                pid = forkBuiltin(command, st, inFd, outFd);
+                if (pid < 0) {
+                    perror("fork");
+                }
+            } else if ((file = findProgram(st->args[0])) == NULL) {
+                printf("Error: Command '%s' not found.\n", st->args[0]);
+                fflush(stdout);
+            } else if ((pid = spawnProgram(file, st->args, spawnMethod, inFd, outFd)) < 0) {
+                perror(file);
+            }
+            if (pid > 0) {
+                names[numPids] = st->args[0];
+                pids[numPids++] = pid;
+            }
+        }
+        if (inFd >= 0) {
+            close(inFd);
+        }
+        if (outFd >= 0) {
+            close(outFd);
+        }
+    }
+    if (prevFd >= 0) {
+        close(prevFd);
+    }
+    if (background && numPids > 0) {
+        addJob(pids, numPids, commandLine, startNs);
+    }
+    if (background) {
+        sigprocmask(SIG_SETMASK, &oldMask, NULL);
+    }
+    // reap the whole pipeline
+    for (int i = 0; i < numPids && !background; i++) {
+        reapChild(pids[i], names[i], startNs);
+    }
+    free(commandLine);
+    free(stages);
+    free(pids);
+    free(names);
+}
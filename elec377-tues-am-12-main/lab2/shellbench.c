@@ -0,0 +1,296 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "spawn.h"
+#include "server.h"
+
+//+
+// File:    shellbench.c
+//
+// Purpose: Measures how many commands a second scripted use of the shell
+//      gets, starting a shell for each command against sending it to the
+//      shell's server (shell -s). A command line, pwd by default, is run
+//      over and over three ways:
+//
+//         launch   a new shell for each command, reading it from its input
+//         connect  a new session of the server for each command
+//         session  one session of the server for all the commands
+//
+//      and each way reports commands per second, and for the first two the
+//      median and 99th percentile time of a command. The benchmark starts
+//      its own server on a socket of its own. The output of the commands
+//      is thrown away.
+//-
+
+// default number of runs of each way
+#define DEFAULT_RUNS 1000
+
+// most time to wait for the server to start, in milliseconds
+#define START_WAIT_MS 5000
+
+//+
+// Function: nowNs
+//
+// Purpose: Returns the monotonic clock in nanoseconds.
+//
+// Parameters: (none)
+//
+// Returns: the time
+//-
+
+uint64_t nowNs(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//+
+// Function: compareNs
+//
+// Purpose: qsort comparison of times.
+//
+// Parameters:
+//   a, b (pointers to the times)
+//
+// Returns: negative, zero or positive as a is before, with or after b
+//-
+
+int compareNs(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+//+
+// Function: commandFile
+//
+// Purpose: Makes an in-memory file holding a command line copies times.
+//
+// Parameters:
+//   command (the command line, without a newline)
+//   copies (times it is repeated)
+//
+// Returns: the file, at its start
+//-
+
+int commandFile(const char *command, int copies){
+    int fd = memfd_create("shellbench", MFD_CLOEXEC);
+    for (int i = 0; fd >= 0 && i < copies; i++){
+        dprintf(fd, "%s\n", command);
+    }
+    if (fd < 0 || lseek(fd, 0, SEEK_SET) != 0){
+        perror("memfd_create");
+        exit(1);
+    }
+    return fd;
+}
+
+//+
+// Function: runOnce
+//
+// Purpose: Runs the command line in commandFd once, with a new shell or a
+//      new session of the server.
+//
+// Parameters:
+//   shell (path of the shell, NULL to use the server)
+//   socketPath (the server's socket)
+//   commandFd (the command line, read from its start)
+//   devNull (where the output goes)
+//
+// Returns: (none, exits if the command could not be run)
+//-
+
+void runOnce(char *shell, const char *socketPath, int commandFd, int devNull){
+    lseek(commandFd, 0, SEEK_SET);
+    if (shell != NULL){
+        char *args[] = {"shell", NULL};
+        int status;
+        pid_t pid = spawnProgram(shell, args, SPAWN_POSIX, commandFd, devNull);
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+            fprintf(stderr, "%s did not run\n", shell);
+            exit(1);
+        }
+        return;
+    }
+    int sock = serverConnect(socketPath);
+    if (sock < 0 || serverExchange(sock, commandFd, devNull) != 0){
+        perror(socketPath);
+        exit(1);
+    }
+    close(sock);
+}
+
+//+
+// Function: runEach
+//
+// Purpose: Runs the command runs times, one shell or session each, and
+//      prints the results.
+//
+// Parameters:
+//   name (name of the way, for the report)
+//   shell (path of the shell, NULL to use the server)
+//   socketPath (the server's socket)
+//   command (the command line)
+//   runs (number of runs)
+//   devNull (where the output goes)
+//
+// Returns: (none)
+//-
+
+void runEach(const char *name, char *shell, const char *socketPath, const char *command, int runs, int devNull){
+    uint64_t *runNs = malloc(runs * sizeof(uint64_t));
+    if (runNs == NULL){
+        perror("runEach");
+        exit(1);
+    }
+    int commandFd = commandFile(command, 1);
+
+    uint64_t start = nowNs();
+    for (int i = 0; i < runs; i++){
+        uint64_t before = nowNs();
+        runOnce(shell, socketPath, commandFd, devNull);
+        runNs[i] = nowNs() - before;
+    }
+    double seconds = (nowNs() - start) / 1e9;
+
+    qsort(runNs, runs, sizeof(uint64_t), compareNs);
+    printf("%-8s %8.0f cmds/s  run p50 %7.1f us p99 %7.1f us\n", name, runs / seconds,
+           runNs[runs / 2] / 1e3, runNs[runs * 99 / 100] / 1e3);
+    fflush(stdout);
+    close(commandFd);
+    free(runNs);
+}
+
+//+
+// Function: runSession
+//
+// Purpose: Runs the command runs times in one session of the server, and
+//      prints the results.
+//
+// Parameters:
+//   socketPath (the server's socket)
+//   command (the command line)
+//   runs (number of runs)
+//   devNull (where the output goes)
+//
+// Returns: (none)
+//-
+
+void runSession(const char *socketPath, const char *command, int runs, int devNull){
+    int commandFd = commandFile(command, runs);
+    uint64_t start = nowNs();
+    runOnce(NULL, socketPath, commandFd, devNull);
+    double seconds = (nowNs() - start) / 1e9;
+    printf("%-8s %8.0f cmds/s\n", "session", runs / seconds);
+    close(commandFd);
+}
+
+//+
+// Function: startServer
+//
+// Purpose: Starts the shell as a server on socketPath, and waits until it
+//      takes connections.
+//
+// Parameters:
+//   shell (path of the shell)
+//   socketPath (socket for the server)
+//
+// Returns: the process id of the server
+//-
+
+pid_t startServer(char *shell, char *socketPath){
+    char *args[] = {"shell", "-s", socketPath, NULL};
+    pid_t pid = spawnProgram(shell, args, SPAWN_POSIX, -1, -1);
+    if (pid < 0){
+        perror(shell);
+        exit(1);
+    }
+    for (int waited = 0; waited < START_WAIT_MS; waited++){
+        int sock = serverConnect(socketPath);
+        if (sock >= 0){
+            close(sock);
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid){
+            break;
+        }
+        usleep(1000);
+    }
+    fprintf(stderr, "%s: server did not start\n", shell);
+    kill(pid, SIGTERM);
+    exit(1);
+}
+
+//+
+// Function: usage
+//
+// Purpose: Prints the options and exits.
+//
+// Parameters:
+//   name (program name)
+//
+// Returns: (does not return)
+//-
+
+void usage(const char *name){
+    fprintf(stderr, "usage: %s [-n runs] [-c command] [shell]\n", name);
+    fprintf(stderr, "    -n runs of each way (default %d)\n", DEFAULT_RUNS);
+    fprintf(stderr, "    -c command line to run (default pwd)\n");
+    fprintf(stderr, "    shell defaults to ./shell\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]){
+    int runs = DEFAULT_RUNS;
+    char *command = "pwd";
+    char *shell = "./shell";
+    char socketPath[64];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:")) != -1){
+        switch (opt){
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'c':
+            command = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (runs < 1){
+        usage(argv[0]);
+    }
+    if (optind < argc){
+        shell = argv[optind];
+    }
+
+    int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devNull < 0){
+        perror("/dev/null");
+        exit(1);
+    }
+    snprintf(socketPath, sizeof(socketPath), "/tmp/shellbench.%d.sock", getpid());
+    pid_t server = startServer(shell, socketPath);
+
+    printf("%d runs of '%s'\n", runs, command);
+    runEach("launch", shell, socketPath, command, runs, devNull);
+    runEach("connect", NULL, socketPath, command, runs, devNull);
+    runSession(socketPath, command, runs, devNull);
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    unlink(socketPath);
+    return 0;
+}
@@ -0,0 +1,80 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "server.h"
+
+//+
+// File:    shellc.c
+//
+// Purpose: Client for the shell's server mode (shell -s socket). Runs a
+//      command line in a new session and copies its output to standard
+//      output as it arrives:
+//
+//         shellc [-s socket] command...
+//
+//      The words of the command are joined with spaces into one command
+//      line, so shellc 'ls | wc -l' hands the whole pipeline to the shell.
+//      With no command, the command lines are read from standard input
+//      and all run in the one session, so a cd carries on to the lines
+//      after it.
+//-
+
+//+
+// Function: usage
+//
+// Purpose: Prints the options and exits.
+//
+// Parameters:
+//   name (program name)
+//
+// Returns: (does not return)
+//-
+
+void usage(const char *name){
+    fprintf(stderr, "usage: %s [-s socket] [command...]\n", name);
+    fprintf(stderr, "    -s socket the server listens on (default %s)\n", SERVER_SOCKET);
+    exit(1);
+}
+
+int main(int argc, char *argv[]){
+    char *socketPath = SERVER_SOCKET;
+    int inFd = STDIN_FILENO;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+s:")) != -1){
+        switch (opt){
+        case 's':
+            socketPath = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc){
+        // the command line, sent from an in-memory file
+        inFd = memfd_create("shellc", MFD_CLOEXEC);
+        for (int i = optind; inFd >= 0 && i < argc; i++){
+            dprintf(inFd, "%s%s", argv[i], i < argc - 1 ? " " : "\n");
+        }
+        if (inFd < 0 || lseek(inFd, 0, SEEK_SET) != 0){
+            perror("memfd_create");
+            exit(1);
+        }
+    }
+
+    int sock = serverConnect(socketPath);
+    if (sock < 0){
+        perror(socketPath);
+        exit(1);
+    }
+    if (serverExchange(sock, inFd, STDOUT_FILENO) != 0){
+        perror(socketPath);
+        exit(1);
+    }
+    close(sock);
+    return 0;
+}
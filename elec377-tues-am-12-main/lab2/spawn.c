@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <signal.h>
+
+#include "spawn.h"
+
+//+
+// File:    spawn.c
+//
+// Purpose: Starting external programs, see spawn.h.
+//-
+
+//+
+// Function: spawnProgram
+//
+// Purpose: Starts file with the arguments args, which must end with NULL,
+//      and the shell's environment. The child starts with no signals
+//      blocked, whatever the shell has blocked. With SPAWN_POSIX a file that can't be
+//      executed is reported here, with SPAWN_FORK the child reports it and
+//      exits with status 127.
+//
+// Parameters:
+//   file (path of the program)
+//   args (the arguments, args[0] is the command name)
+//   method (SPAWN_POSIX or SPAWN_FORK)
+//   inFd, outFd (made the child's standard input and output, -1 to keep
+//      the shell's)
+//
+// Returns: the process id of the child, -1 with errno set if it could not
+//      be started
+//-
+
+pid_t spawnProgram(const char *file, char *args[], int method, int inFd, int outFd){
+    pid_t pid;
+    sigset_t noSignals;
+
+    sigemptyset(&noSignals);
+    if (method == SPAWN_POSIX) {
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigmask(&attr, &noSignals);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (inFd >= 0 && inFd != STDIN_FILENO) {
+            posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+        }
+        if (outFd >= 0 && outFd != STDOUT_FILENO) {
+            posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+        }
+        int err = posix_spawn(&pid, file, &actions, &attr, args, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+        if (err != 0) {
+            errno = err;
+            return -1;
+        }
+        return pid;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        // This code will be executed in the child process
+        sigprocmask(SIG_SETMASK, &noSignals, NULL);
+        if ((inFd >= 0 && dup2(inFd, STDIN_FILENO) < 0) || (outFd >= 0 && dup2(outFd, STDOUT_FILENO) < 0)) {
+            perror("dup2");
+            _exit(127);
+        }
+        execv(file, args);
+        // Only reached if the file could not be executed
+        perror(file);
+        _exit(127);
+    }
+    return pid;
+}
+
+//+
+// Function: spawnMethodName
+//
+// Purpose: Names a way of starting programs, for messages.
+//
+// Parameters:
+//   method (SPAWN_POSIX or SPAWN_FORK)
+//
+// Returns: the name
+//-
+
+const char * spawnMethodName(int method){
+    return method == SPAWN_POSIX ? "posix_spawn" : "fork";
+}
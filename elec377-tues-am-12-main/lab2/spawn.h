@@ -0,0 +1,25 @@
+//+
+// File:    spawn.h
+//
+// Purpose: Starts external programs for the shell. The fast path is
+//      posix_spawn, which glibc implements with clone(CLONE_VM | CLONE_VFORK)
+//      so the child shares the shell's memory until it calls exec, and
+//      launch time doesn't grow with the size of the shell. Plain fork and
+//      execv is kept for children that must run shell code before exec.
+//-
+
+#ifndef SPAWN_H
+#define SPAWN_H
+
+#include <sys/types.h>
+
+// Ways of starting a program
+#define SPAWN_POSIX 0
+#define SPAWN_FORK 1
+
+extern char **environ;
+
+pid_t spawnProgram(const char *file, char *args[], int method, int inFd, int outFd);
+const char * spawnMethodName(int method);
+
+#endif
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "spawn.h"
+
+//+
+// File:    spawnbench.c
+//
+// Purpose: Measures how fast the shell can start programs. A program,
+//      hello by default, is run over and over with posix_spawn and with
+//      fork and execv, waiting for each to exit, and each way reports
+//      commands per second, and the median and 99th percentile times of the
+//      spawn call alone and of the whole run.
+//
+//      fork has to copy the page tables of the parent, so its cost grows
+//      with the parent's memory. -m gives the sizes, in MiB, the benchmark
+//      grows to (touching every page) before each set of runs, to stand in
+//      for a large shell.
+//
+//      The programs' output goes to /dev/null.
+//-
+
+// default number of runs of each way at each size
+#define DEFAULT_RUNS 2000
+
+//+
+// Function: nowNs
+//
+// Purpose: Returns the monotonic clock in nanoseconds.
+//
+// Parameters: (none)
+//
+// Returns: the time
+//-
+
+uint64_t nowNs(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//+
+// Function: compareNs
+//
+// Purpose: qsort comparison of times.
+//
+// Parameters:
+//   a, b (pointers to the times)
+//
+// Returns: negative, zero or positive as a is before, with or after b
+//-
+
+int compareNs(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+//+
+// Function: runSpawns
+//
+// Purpose: Runs the program runs times one way and prints the results.
+//
+// Parameters:
+//   out (where the results go)
+//   file, args (the program and its arguments)
+//   method (SPAWN_POSIX or SPAWN_FORK)
+//   runs (number of runs)
+//   sizeMb (memory in use, for the report)
+//
+// Returns: (none)
+//-
+
+void runSpawns(FILE *out, const char *file, char *args[], int method, int runs, long sizeMb){
+    uint64_t *spawnNs = malloc(runs * sizeof(uint64_t));
+    uint64_t *totalNs = malloc(runs * sizeof(uint64_t));
+    if (spawnNs == NULL || totalNs == NULL){
+        perror("runSpawns");
+        exit(1);
+    }
+
+    uint64_t start = nowNs();
+    for (int i = 0; i < runs; i++){
+        uint64_t before = nowNs();
+        pid_t pid = spawnProgram(file, args, method, -1, -1);
+        uint64_t spawned = nowNs();
+        if (pid < 0){
+            perror(file);
+            exit(1);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 127){
+            fprintf(stderr, "%s did not run\n", file);
+            exit(1);
+        }
+        spawnNs[i] = spawned - before;
+        totalNs[i] = nowNs() - before;
+    }
+    double seconds = (nowNs() - start) / 1e9;
+
+    qsort(spawnNs, runs, sizeof(uint64_t), compareNs);
+    qsort(totalNs, runs, sizeof(uint64_t), compareNs);
+    fprintf(out, "%6ld MiB %-12s %8.0f cmds/s  spawn p50 %7.1f us p99 %7.1f us  run p50 %7.1f us p99 %7.1f us\n",
+            sizeMb, spawnMethodName(method), runs / seconds,
+            spawnNs[runs / 2] / 1e3, spawnNs[runs * 99 / 100] / 1e3,
+            totalNs[runs / 2] / 1e3, totalNs[runs * 99 / 100] / 1e3);
+    fflush(out);
+    free(spawnNs);
+    free(totalNs);
+}
+
+//+
+// Function: usage
+//
+// Purpose: Prints the options and exits.
+//
+// Parameters:
+//   name (program name)
+//
+// Returns: (does not return)
+//-
+
+void usage(const char *name){
+    fprintf(stderr, "usage: %s [-n runs] [-m MiB,MiB,...] [program [args...]]\n", name);
+    fprintf(stderr, "    -n runs of each way at each size (default %d)\n", DEFAULT_RUNS);
+    fprintf(stderr, "    -m sizes to grow the benchmark to before running (default 0)\n");
+    fprintf(stderr, "    program defaults to ./hello\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]){
+    int runs = DEFAULT_RUNS;
+    char *sizes = "0";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1){
+        switch (opt){
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'm':
+            sizes = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (runs < 1){
+        usage(argv[0]);
+    }
+    char *helloArgs[] = {"hello", NULL};
+    char *file = "./hello";
+    char **args = helloArgs;
+    if (optind < argc){
+        file = argv[optind];
+        args = argv + optind;
+    }
+
+    // results go to the original stdout, the programs' output to /dev/null
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    int devNull = open("/dev/null", O_WRONLY);
+    if (out == NULL || devNull < 0 || dup2(devNull, STDOUT_FILENO) < 0){
+        perror("/dev/null");
+        exit(1);
+    }
+    close(devNull);
+
+    char *memory = NULL;
+    long grown = 0;
+    for (char *size = strtok(sizes, ","); size != NULL; size = strtok(NULL, ",")){
+        long sizeMb = atol(size);
+        if (sizeMb > grown){
+            // touch every page so fork has page tables to copy
+            memory = realloc(memory, sizeMb << 20);
+            if (memory == NULL){
+                perror("realloc");
+                exit(1);
+            }
+            memset(memory + (grown << 20), 1, (sizeMb - grown) << 20);
+            grown = sizeMb;
+        }
+        runSpawns(out, file, args, SPAWN_POSIX, runs, grown);
+        runSpawns(out, file, args, SPAWN_FORK, runs, grown);
+    }
+    free(memory);
+    return 0;
+}
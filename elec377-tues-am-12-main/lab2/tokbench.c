@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tokenize.h"
+
+//+
+// File:    tokbench.c
+//
+// Purpose: Measures how fast splitCommandLine splits long command lines,
+//      the kind generated with thousands of file arguments. A line of
+//      plain, quoted and escaped words separated by spaces and tabs, with
+//      a few operators, is split many times and the best pass is reported
+//      in words per second and MB/s. For scale, the same line with plain
+//      words only is also split with strtok into a preallocated array, as
+//      the shell's first splitter did.
+//-
+
+// default words in the line, and passes over it
+#define DEFAULT_WORDS 50000
+#define DEFAULT_PASSES 50
+
+//+
+// Function: nowNs
+//
+// Purpose: Returns the monotonic clock in nanoseconds.
+//
+// Parameters: (none)
+//
+// Returns: the time
+//-
+
+uint64_t nowNs(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//+
+// Function: makeLine
+//
+// Purpose: Builds a command line of numWords words like file names. With
+//      mixed set, some are quoted or escaped, some separators are tabs, and
+//      there is an operator every thousand words.
+//
+// Parameters:
+//   numWords (words in the line)
+//   mixed (use quoting and operators)
+//   len (set to the length of the line)
+//
+// Returns: the line, null terminated
+//-
+
+char * makeLine(long numWords, int mixed, size_t *len){
+    // longest word below plus separators
+    char *line = malloc(numWords * 40 + 1);
+    char *p = line;
+    if (line == NULL){
+        perror("makeLine");
+        exit(1);
+    }
+    for (long i = 0; i < numWords; i++){
+        long r = mixed ? lrand48() % 10 : 0;
+        if (r == 0 || r > 4){
+            p += sprintf(p, "dir%ld/file%ld.dat", i % 97, i);
+        } else if (r == 1){
+            p += sprintf(p, "'my file %ld.txt'", i);
+        } else if (r == 2){
+            p += sprintf(p, "\"say \\\"%ld\\\"\"", i);
+        } else if (r == 3){
+            p += sprintf(p, "name\\ with\\ spaces%ld", i);
+        } else {
+            p += sprintf(p, "--option=%ld", i);
+        }
+        if (mixed && i % 1000 == 999){
+            p += sprintf(p, " | ");
+        } else {
+            *p++ = mixed && r == 4 ? '\t' : ' ';
+        }
+    }
+    *p = '\0';
+    *len = p - line;
+    return line;
+}
+
+//+
+// Function: usage
+//
+// Purpose: Prints the options and exits.
+//
+// Parameters:
+//   name (program name)
+//
+// Returns: (does not return)
+//-
+
+void usage(const char *name){
+    fprintf(stderr, "usage: %s [-w words] [-p passes]\n", name);
+    fprintf(stderr, "    -w words in the line (default %d)\n", DEFAULT_WORDS);
+    fprintf(stderr, "    -p passes over it, the best is reported (default %d)\n", DEFAULT_PASSES);
+    exit(1);
+}
+
+int main(int argc, char *argv[]){
+    long numWords = DEFAULT_WORDS;
+    int passes = DEFAULT_PASSES;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:p:")) != -1){
+        switch (opt){
+        case 'w':
+            numWords = atol(optarg);
+            break;
+        case 'p':
+            passes = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (numWords < 1 || passes < 1){
+        usage(argv[0]);
+    }
+
+    size_t len;
+    char *line = makeLine(numWords, 1, &len);
+    struct arena arena = {NULL, 0, 0};
+    char **args;
+    long count = 0;
+    uint64_t best = UINT64_MAX;
+    for (int pass = 0; pass < passes; pass++){
+        uint64_t start = nowNs();
+        count = splitCommandLine(line, len, &arena, &args);
+        uint64_t took = nowNs() - start;
+        best = took < best ? took : best;
+    }
+    if (count < 0){
+        fprintf(stderr, "the line could not be split (%ld), try fewer words\n", count);
+        exit(1);
+    }
+    printf("%-18s %9ld words %8.2f MB %12.0f words/s %8.1f MB/s\n", "splitCommandLine", count,
+           len / 1e6, count / (best / 1e9), len * 1e3 / best);
+
+    // strtok needs a fresh copy each pass, which is timed too
+    size_t plainLen;
+    char *plain = makeLine(numWords, 0, &plainLen);
+    char *copy = malloc(plainLen + 1);
+    char **words = malloc((numWords + 1) * sizeof(char *));
+    if (copy == NULL || words == NULL){
+        perror("main");
+        exit(1);
+    }
+    best = UINT64_MAX;
+    for (int pass = 0; pass < passes; pass++){
+        uint64_t start = nowNs();
+        memcpy(copy, plain, plainLen + 1);
+        char *save;
+        count = 0;
+        for (char *w = strtok_r(copy, " ", &save); w != NULL; w = strtok_r(NULL, " ", &save)){
+            words[count++] = w;
+        }
+        uint64_t took = nowNs() - start;
+        best = took < best ? took : best;
+    }
+    printf("%-18s %9ld words %8.2f MB %12.0f words/s %8.1f MB/s\n", "strtok (plain)", count,
+           plainLen / 1e6, count / (best / 1e9), plainLen * 1e3 / best);
+
+    free(arena.base);
+    free(line);
+    free(plain);
+    free(copy);
+    free(words);
+    return 0;
+}
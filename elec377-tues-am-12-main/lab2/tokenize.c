@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tokenize.h"
+
+//+
+// File:    tokenize.c
+//
+// Purpose: Splitting command lines into words, see tokenize.h.
+//-
+
+char pipeWord[] = "|";
+char inWord[] = "<";
+char outWord[] = ">";
+char appendWord[] = ">>";
+char backgroundWord[] = "&";
+
+// What each byte is to the splitter outside quotes, so the bytes of a plain
+// word are copied with one table lookup each
+#define CHAR_PLAIN 0
+#define CHAR_SPECIAL 1
+static const unsigned char charClass[256] = {
+    ['\t'] = CHAR_SPECIAL, ['\n'] = CHAR_SPECIAL, ['\r'] = CHAR_SPECIAL, [' '] = CHAR_SPECIAL,
+    ['|'] = CHAR_SPECIAL, ['<'] = CHAR_SPECIAL, ['>'] = CHAR_SPECIAL, ['&'] = CHAR_SPECIAL,
+    ['\''] = CHAR_SPECIAL, ['"'] = CHAR_SPECIAL, ['\\'] = CHAR_SPECIAL,
+};
+
+//+
+// Function: arenaReset
+//
+// Purpose: Empties the arena and makes sure size bytes fit in it. Memory
+//      handed out before is no longer valid.
+//
+// Parameters:
+//   a (the arena)
+//   size (bytes needed before the next reset)
+//
+// Returns: (none)
+//-
+
+void arenaReset(struct arena *a, size_t size){
+    a->used = 0;
+    if (size <= a->size) {
+        return;
+    }
+    // grow by at least double, so a run of longer lines doesn't realloc each time
+    size_t newSize = a->size * 2 > size ? a->size * 2 : size;
+    free(a->base);
+    if ((a->base = malloc(newSize)) == NULL) {
+        perror("arenaReset");
+        exit(1);
+    }
+    a->size = newSize;
+}
+
+//+
+// Function: arenaAlloc
+//
+// Purpose: Takes size bytes, aligned for any type, from the arena. The
+//      caller must have reserved enough with arenaReset.
+//
+// Parameters:
+//   a (the arena)
+//   size (bytes wanted)
+//
+// Returns: the memory
+//-
+
+void * arenaAlloc(struct arena *a, size_t size){
+    size_t start = (a->used + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+    if (start + size > a->size) {
+        fprintf(stderr, "arenaAlloc: arena of %zu bytes is full\n", a->size);
+        exit(1);
+    }
+    a->used = start + size;
+    return a->base + start;
+}
+
+//+
+// Function: isOperator
+//
+// Purpose: Checks whether a word is one of the operator words.
+//
+// Parameters:
+//   word (the word)
+//
+// Returns: 1 if it is an operator, else 0
+//-
+
+int isOperator(const char *word){
+    return word == pipeWord || word == inWord || word == outWord || word == appendWord || word == backgroundWord;
+}
+
+//+
+// Function: splitCommandLine
+//
+// Purpose: Splits len bytes of line into words, in one pass over the line.
+//      The words and the array pointing to them, which ends with NULL, are
+//      taken from the arena, which is reset first. A newline ends the line.
+//
+// Parameters:
+//   line, len (the command line, which need not be null terminated)
+//   a (arena to hold the words)
+//   args (set to the words)
+//
+// Returns: the number of words, SPLIT_UNTERMINATED if a quote isn't
+//      closed, or SPLIT_TOO_LONG if the words would not fit in ARG_MAX
+//-
+
+long splitCommandLine(const char *line, size_t len, struct arena *a, char ***args){
+    static long argMax = 0;
+    if (argMax == 0) {
+        argMax = sysconf(_SC_ARG_MAX);
+    }
+    if ((long) len > argMax) {
+        return SPLIT_TOO_LONG;
+    }
+    // Every word but an operator takes at least one byte of the line and
+    // one separator or the end, so the words take at most len + 1 bytes with
+    // their nulls, and there are at most len + 1 of them, plus the NULL
+    size_t maxWords = len + 2;
+    arenaReset(a, maxWords * sizeof(char *) + len + 1 + 2 * _Alignof(max_align_t));
+    char **words = arenaAlloc(a, maxWords * sizeof(char *));
+    char *out = arenaAlloc(a, len + 1);
+    long numWords = 0;
+    size_t wordBytes = 0;
+    // the word being built starts here, NULL between words
+    char *word = NULL;
+    char quote = '\0';
+    const char *end = line + len;
+
+    for (const char *p = line; p < end; p++) {
+        if (quote == '\0' && charClass[(unsigned char) *p] == CHAR_PLAIN) {
+            // copy the run of plain bytes
+            if (word == NULL) {
+                word = out;
+            }
+            const char *run = p;
+            do {
+                p++;
+            } while (p < end && charClass[(unsigned char) *p] == CHAR_PLAIN);
+            memcpy(out, run, p - run);
+            out += p - run;
+            if (p == end) {
+                break;
+            }
+        }
+        char c = *p;
+        if (quote == '\'') {
+            if (c == '\'') {
+                quote = '\0';
+            } else {
+                *out++ = c;
+            }
+            continue;
+        }
+        if (quote == '"') {
+            if (c == '"') {
+                quote = '\0';
+            } else if (c == '\\' && p + 1 < end && (p[1] == '"' || p[1] == '\\')) {
+                *out++ = *++p;
+            } else {
+                *out++ = c;
+            }
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '|' || c == '<' || c == '>' || c == '&') {
+            // end the word being built
+            if (word != NULL) {
+                *out++ = '\0';
+                wordBytes += out - word;
+                words[numWords++] = word;
+                word = NULL;
+            }
+            if (c == '\n') {
+                break;
+            }
+            if (c == '|') {
+                words[numWords++] = pipeWord;
+            } else if (c == '<') {
+                words[numWords++] = inWord;
+            } else if (c == '&') {
+                words[numWords++] = backgroundWord;
+            } else if (c == '>' && p + 1 < end && p[1] == '>') {
+                words[numWords++] = appendWord;
+                p++;
+            } else if (c == '>') {
+                words[numWords++] = outWord;
+            }
+            continue;
+        }
+        if (word == NULL) {
+            word = out;
+        }
+        if (c == '\'' || c == '"') {
+            quote = c;
+        } else if (c == '\\' && p + 1 < end && p[1] != '\n') {
+            *out++ = *++p;
+        } else {
+            *out++ = c;
+        }
+    }
+    if (quote != '\0') {
+        return SPLIT_UNTERMINATED;
+    }
+    if (word != NULL) {
+        *out++ = '\0';
+        wordBytes += out - word;
+        words[numWords++] = word;
+    }
+    words[numWords] = NULL;
+    // what exec would be given, the strings and the pointers to them
+    if ((long) (wordBytes + (numWords + 1) * sizeof(char *)) > argMax) {
+        return SPLIT_TOO_LONG;
+    }
+    *args = words;
+    return numWords;
+}
@@ -0,0 +1,47 @@
+//+
+// File:    tokenize.h
+//
+// Purpose: Splits command lines into words for the shell in one pass.
+//      Words are separated by spaces and tabs, and may be quoted with
+//      single quotes (nothing inside is special), double quotes (a
+//      backslash escapes " and \) or escaped with a backslash. Outside
+//      quotes |, <, >, >> and & are operators even without spaces around
+//      them, and come back as the operator words below, so a quoted "|" is
+//      an ordinary word.
+//
+//      The words and the array pointing to them are carved out of an arena
+//      that is emptied for each command line, so splitting does no
+//      allocation once the arena has grown to the longest line seen. The
+//      only limit is ARG_MAX, what exec would accept.
+//-
+
+#ifndef TOKENIZE_H
+#define TOKENIZE_H
+
+#include <stddef.h>
+
+// A bump allocator, emptied all at once
+struct arena{
+    char *base;
+    size_t size;
+    size_t used;
+};
+
+// Operator words. They are told apart from quoted words that look the
+// same by their address
+extern char pipeWord[];
+extern char inWord[];
+extern char outWord[];
+extern char appendWord[];
+extern char backgroundWord[];
+
+// Results of splitCommandLine besides a word count
+#define SPLIT_UNTERMINATED -1
+#define SPLIT_TOO_LONG -2
+
+void arenaReset(struct arena *a, size_t size);
+void * arenaAlloc(struct arena *a, size_t size);
+int isOperator(const char *word);
+long splitCommandLine(const char *line, size_t len, struct arena *a, char ***args);
+
+#endif
@@ -0,0 +1,706 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+
+#include "walk.h"
+
+//+
+// File:    walk.c
+//
+// Purpose: Parallel directory tree walks for find and du, see walk.h.
+//-
+
+// bytes asked of each getdents64 call
+#define DIR_BUFFER (1 << 16)
+// bytes of output a thread collects before writing them
+#define OUT_BUFFER (1 << 16)
+// a thread writes what it has collected at least this often, in ns
+#define OUT_INTERVAL 10000000
+// most threads
+#define MAX_THREADS 64
+// shards of the inode set, each with its own lock
+#define INODE_SHARDS 64
+// keep the deques on separate cache lines
+#define CACHE_LINE 64
+
+// What getdents64 fills the buffer with
+struct linuxDirent64{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// A directory found by the walk
+struct dirNode{
+    char *path;
+    struct dirNode *parent;
+    // its own read plus the subdirectories not yet finished
+    atomic_int pending;
+    // du, 512 byte blocks used under it so far
+    atomic_uint_fast64_t blocks;
+};
+
+// A directory to read, with its descriptor if it has been opened
+struct task{
+    int fd;
+    struct dirNode *node;
+};
+
+// A thread's directories, the thread takes from the back and thieves take
+// from the front
+struct deque{
+    _Alignas(CACHE_LINE) pthread_mutex_t mutex;
+    struct task *tasks;
+    int front;
+    int count;
+    int size;
+};
+
+// Devices and inodes of files with several links, counted once by du
+struct inodeShard{
+    _Alignas(CACHE_LINE) pthread_mutex_t mutex;
+    // pairs of device and inode + 1, 0 for an empty slot
+    uint64_t *slots;
+    size_t size;
+    size_t count;
+};
+
+struct walk;
+
+struct worker{
+    struct walk *walk;
+    int index;
+    struct deque deque;
+    unsigned int seed;
+    char *dirBuffer;
+    char *out;
+    size_t outUsed;
+    uint64_t lastFlush;
+};
+
+struct walk{
+    const struct walkOptions *options;
+    struct worker *workers;
+    int numWorkers;
+    // tasks pushed and not yet finished, and those still on a deque
+    atomic_long pending;
+    atomic_long queued;
+    // threads with nothing to do wait on idle
+    pthread_mutex_t idleMutex;
+    pthread_cond_t idle;
+    atomic_int sleepers;
+    // descriptors held by queued tasks, beyond fdBudget tasks are queued
+    // unopened and opened by path
+    atomic_int openFds;
+    int fdBudget;
+    // one thread writes its output at a time, so lines aren't split
+    pthread_mutex_t outMutex;
+    struct inodeShard inodes[INODE_SHARDS];
+};
+
+//+
+// Function: nowNs
+//
+// Purpose: Returns the coarse monotonic clock in nanoseconds.
+//-
+
+static uint64_t nowNs(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//+
+// Function: walkDefaultThreads
+//
+// Purpose: Chooses the number of threads: two per CPU, as much of the time
+//      goes waiting on the disk, and at least 4.
+//
+// Returns: the number of threads
+//-
+
+int walkDefaultThreads(void){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long threads = cpus * 2 < 4 ? 4 : cpus * 2;
+    return threads > MAX_THREADS ? MAX_THREADS : threads;
+}
+
+//+
+// Function: flushOutput
+//
+// Purpose: Writes what the thread has collected to standard output.
+//-
+
+static void flushOutput(struct worker *w){
+    size_t done = 0;
+    pthread_mutex_lock(&w->walk->outMutex);
+    while (done < w->outUsed){
+        ssize_t n = write(STDOUT_FILENO, w->out + done, w->outUsed - done);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n < 0){
+            break;
+        }
+        done += n;
+    }
+    pthread_mutex_unlock(&w->walk->outMutex);
+    w->outUsed = 0;
+    w->lastFlush = nowNs();
+}
+
+//+
+// Function: emit
+//
+// Purpose: Adds a line of output, prefix, a slash if name is given, name,
+//      and a newline, to the thread's buffer, writing the buffer first if
+//      the line won't fit.
+//-
+
+static void emit(struct worker *w, const char *prefix, const char *name){
+    size_t prefixLen = strlen(prefix);
+    size_t nameLen = name != NULL ? strlen(name) : 0;
+    size_t len = prefixLen + (name != NULL) + nameLen + 1;
+    if (w->outUsed + len > OUT_BUFFER){
+        flushOutput(w);
+    }
+    if (len > OUT_BUFFER){
+        // longer than the whole buffer, write it in pieces
+        pthread_mutex_lock(&w->walk->outMutex);
+        dprintf(STDOUT_FILENO, "%s%s%s\n", prefix, name != NULL ? "/" : "", name != NULL ? name : "");
+        pthread_mutex_unlock(&w->walk->outMutex);
+        return;
+    }
+    char *p = w->out + w->outUsed;
+    memcpy(p, prefix, prefixLen);
+    p += prefixLen;
+    if (name != NULL){
+        *p++ = '/';
+        memcpy(p, name, nameLen);
+        p += nameLen;
+    }
+    *p = '\n';
+    w->outUsed += len;
+}
+
+//+
+// Function: inodeFirstSeen
+//
+// Purpose: Adds a file to the set of files with several links.
+//
+// Returns: 1 if the file wasn't in the set, 0 if it was
+//-
+
+static int inodeFirstSeen(struct walk *walk, dev_t dev, ino_t ino){
+    uint64_t key = (uint64_t) ino + 1;
+    uint64_t hash = (key ^ (uint64_t) dev * 0x9e3779b97f4a7c15ull) * 0xff51afd7ed558ccdull;
+    struct inodeShard *shard = &walk->inodes[hash % INODE_SHARDS];
+    int added = 1;
+
+    pthread_mutex_lock(&shard->mutex);
+    if (shard->count * 2 >= shard->size){
+        // grow, and put the pairs back in
+        size_t newSize = shard->size ? shard->size * 2 : 1024;
+        uint64_t *slots = calloc(newSize * 2, sizeof(uint64_t));
+        if (slots == NULL){
+            perror("du");
+            exit(1);
+        }
+        for (size_t i = 0; i < shard->size; i++){
+            if (shard->slots[2 * i + 1] != 0){
+                uint64_t h = (shard->slots[2 * i + 1] ^ shard->slots[2 * i] * 0x9e3779b97f4a7c15ull) * 0xff51afd7ed558ccdull;
+                size_t j = (h >> 32) & (newSize - 1);
+                while (slots[2 * j + 1] != 0){
+                    j = (j + 1) & (newSize - 1);
+                }
+                slots[2 * j] = shard->slots[2 * i];
+                slots[2 * j + 1] = shard->slots[2 * i + 1];
+            }
+        }
+        free(shard->slots);
+        shard->slots = slots;
+        shard->size = newSize;
+    }
+    size_t i = (hash >> 32) & (shard->size - 1);
+    while (shard->slots[2 * i + 1] != 0){
+        if (shard->slots[2 * i] == (uint64_t) dev && shard->slots[2 * i + 1] == key){
+            added = 0;
+            break;
+        }
+        i = (i + 1) & (shard->size - 1);
+    }
+    if (added){
+        shard->slots[2 * i] = dev;
+        shard->slots[2 * i + 1] = key;
+        shard->count++;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    return added;
+}
+
+//+
+// Function: pushTask
+//
+// Purpose: Puts a directory on the thread's deque, and wakes a thread if
+//      any are waiting for work.
+//-
+
+static void pushTask(struct worker *w, struct task task){
+    struct walk *walk = w->walk;
+    struct deque *d = &w->deque;
+
+    atomic_fetch_add(&walk->pending, 1);
+    pthread_mutex_lock(&d->mutex);
+    if (d->count == d->size){
+        int newSize = d->size ? d->size * 2 : 256;
+        struct task *tasks = malloc(newSize * sizeof(struct task));
+        if (tasks == NULL){
+            perror("walk");
+            exit(1);
+        }
+        for (int i = 0; i < d->count; i++){
+            tasks[i] = d->tasks[(d->front + i) % d->size];
+        }
+        free(d->tasks);
+        d->tasks = tasks;
+        d->front = 0;
+        d->size = newSize;
+    }
+    d->tasks[(d->front + d->count) % d->size] = task;
+    d->count++;
+    pthread_mutex_unlock(&d->mutex);
+
+    atomic_fetch_add(&walk->queued, 1);
+    if (atomic_load(&walk->sleepers) > 0){
+        pthread_mutex_lock(&walk->idleMutex);
+        pthread_cond_signal(&walk->idle);
+        pthread_mutex_unlock(&walk->idleMutex);
+    }
+}
+
+//+
+// Function: takeTask
+//
+// Purpose: Takes a directory from the back of the thread's own deque, the
+//      one it found last, or else from the front of another thread's,
+//      trying them all from a random one.
+//
+// Returns: 1 if a task was taken, 0 if every deque was empty
+//-
+
+static int takeTask(struct worker *w, struct task *task){
+    struct walk *walk = w->walk;
+    int start = rand_r(&w->seed) % walk->numWorkers;
+
+    for (int k = -1; k < walk->numWorkers; k++){
+        // own deque first
+        int victim = k < 0 ? w->index : (start + k) % walk->numWorkers;
+        struct deque *d = &walk->workers[victim].deque;
+        if (k >= 0 && victim == w->index){
+            continue;
+        }
+        pthread_mutex_lock(&d->mutex);
+        if (d->count > 0){
+            if (victim == w->index){
+                *task = d->tasks[(d->front + d->count - 1) % d->size];
+            } else {
+                *task = d->tasks[d->front];
+                d->front = (d->front + 1) % d->size;
+            }
+            d->count--;
+            pthread_mutex_unlock(&d->mutex);
+            atomic_fetch_sub(&walk->queued, 1);
+            return 1;
+        }
+        pthread_mutex_unlock(&d->mutex);
+    }
+    return 0;
+}
+
+//+
+// Function: newNode
+//
+// Purpose: Makes the node of a directory named name in parent, or of a
+//      root when parent is NULL and name is the root's path.
+//-
+
+static struct dirNode * newNode(struct dirNode *parent, const char *name){
+    struct dirNode *node = malloc(sizeof(struct dirNode));
+    if (node == NULL){
+        perror("walk");
+        exit(1);
+    }
+    if (parent == NULL){
+        node->path = strdup(name);
+    } else {
+        size_t len = strlen(parent->path);
+        int slash = len > 0 && parent->path[len - 1] != '/';
+        node->path = malloc(len + slash + strlen(name) + 1);
+        if (node->path != NULL){
+            sprintf(node->path, "%s%s%s", parent->path, slash ? "/" : "", name);
+        }
+        atomic_fetch_add(&parent->pending, 1);
+    }
+    if (node->path == NULL){
+        perror("walk");
+        exit(1);
+    }
+    node->parent = parent;
+    atomic_init(&node->pending, 1);
+    atomic_init(&node->blocks, 0);
+    return node;
+}
+
+//+
+// Function: finishNode
+//
+// Purpose: Called when a directory has been read, or one of its
+//      subdirectories finished. When nothing under it is left, du prints
+//      its total, which is added to its parent, and its parent is told.
+//-
+
+static void finishNode(struct worker *w, struct dirNode *node){
+    while (node != NULL && atomic_fetch_sub(&node->pending, 1) == 1){
+        struct dirNode *parent = node->parent;
+        uint64_t blocks = atomic_load(&node->blocks);
+        if (w->walk->options->mode == WALK_DU){
+            if (!w->walk->options->summarize || parent == NULL){
+                char size[32];
+                snprintf(size, sizeof(size), "%llu\t", (unsigned long long) (blocks + 1) / 2);
+                // the size goes first, so print it as the prefix and the path after
+                size_t sizeLen = strlen(size);
+                char *line = malloc(sizeLen + strlen(node->path) + 1);
+                if (line != NULL){
+                    sprintf(line, "%s%s", size, node->path);
+                    emit(w, line, NULL);
+                    free(line);
+                }
+            }
+            if (parent != NULL){
+                atomic_fetch_add(&parent->blocks, blocks);
+            }
+        }
+        free(node->path);
+        free(node);
+        node = parent;
+    }
+}
+
+//+
+// Function: findMatches
+//
+// Purpose: Tests an entry against the find options.
+//
+// Parameters:
+//   options (the predicates)
+//   name (the entry's name)
+//   type (its d_type)
+//   size (its size in bytes, only used with a size predicate)
+//
+// Returns: 1 if it matches, else 0
+//-
+
+static int findMatches(const struct walkOptions *options, const char *name, int type, uint64_t size){
+    if (options->namePattern != NULL && fnmatch(options->namePattern, name, 0) != 0){
+        return 0;
+    }
+    if ((options->type == 'f' && type != DT_REG) || (options->type == 'd' && type != DT_DIR)
+            || (options->type == 'l' && type != DT_LNK)){
+        return 0;
+    }
+    if (options->sizeCompare != SIZE_ANY){
+        uint64_t units = (size + options->sizeUnit - 1) / options->sizeUnit;
+        if ((options->sizeCompare == SIZE_LESS && units >= options->size)
+                || (options->sizeCompare == SIZE_EQUAL && units != options->size)
+                || (options->sizeCompare == SIZE_MORE && units <= options->size)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//+
+// Function: modeType
+//
+// Purpose: Converts a st_mode file type to a d_type.
+//-
+
+static int modeType(mode_t mode){
+    return S_ISREG(mode) ? DT_REG : S_ISDIR(mode) ? DT_DIR : S_ISLNK(mode) ? DT_LNK : DT_UNKNOWN;
+}
+
+//+
+// Function: readDir
+//
+// Purpose: Reads one directory, testing or counting each entry and queuing
+//      each subdirectory. Subdirectories are opened here, relative to this
+//      directory, unless too many descriptors are held by queued tasks.
+//-
+
+static void readDir(struct worker *w, struct task task){
+    const struct walkOptions *options = w->walk->options;
+    struct walk *walk = w->walk;
+    struct dirNode *node = task.node;
+    int fd = task.fd;
+    const char *tool = options->mode == WALK_DU ? "du" : "find";
+
+    if (fd < 0 && (fd = open(node->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0){
+        fprintf(stderr, "%s: %s: %s\n", tool, node->path, strerror(errno));
+        finishNode(w, node);
+        return;
+    }
+    struct stat st;
+    if (options->mode == WALK_DU && fstat(fd, &st) == 0){
+        atomic_fetch_add(&node->blocks, st.st_blocks);
+    }
+
+    long got;
+    while ((got = syscall(SYS_getdents64, fd, w->dirBuffer, DIR_BUFFER)) > 0){
+        for (long pos = 0; pos < got; ){
+            struct linuxDirent64 *d = (struct linuxDirent64 *) (w->dirBuffer + pos);
+            pos += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))){
+                continue;
+            }
+            int type = d->d_type;
+            int needStat = options->mode == WALK_DU || type == DT_UNKNOWN || options->sizeCompare != SIZE_ANY;
+            if (needStat){
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0){
+                    fprintf(stderr, "%s: %s/%s: %s\n", tool, node->path, name, strerror(errno));
+                    continue;
+                }
+                type = modeType(st.st_mode);
+            }
+            if (options->mode == WALK_FIND && findMatches(options, name, type, needStat ? st.st_size : 0)){
+                emit(w, node->path, name);
+            }
+            if (type != DT_DIR){
+                if (options->mode == WALK_DU && (st.st_nlink < 2 || inodeFirstSeen(walk, st.st_dev, st.st_ino))){
+                    atomic_fetch_add(&node->blocks, st.st_blocks);
+                }
+                continue;
+            }
+            struct task child = {-1, newNode(node, name)};
+            if (atomic_load(&walk->openFds) < walk->fdBudget){
+                child.fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (child.fd < 0){
+                    fprintf(stderr, "%s: %s: %s\n", tool, child.node->path, strerror(errno));
+                    finishNode(w, child.node);
+                    continue;
+                }
+                atomic_fetch_add(&walk->openFds, 1);
+            }
+            pushTask(w, child);
+        }
+    }
+    if (got < 0){
+        fprintf(stderr, "%s: %s: %s\n", tool, node->path, strerror(errno));
+    }
+    close(fd);
+    if (task.fd >= 0){
+        atomic_fetch_sub(&walk->openFds, 1);
+    }
+    finishNode(w, node);
+}
+
+//+
+// Function: workerMain
+//
+// Purpose: Thread body. Reads directories until every task is finished,
+//      sleeping when there is nothing to take but others are still reading
+//      directories that may add more.
+//-
+
+static void * workerMain(void *arg){
+    struct worker *w = arg;
+    struct walk *walk = w->walk;
+    struct task task;
+
+    while (1){
+        if (takeTask(w, &task)){
+            readDir(w, task);
+            if (w->outUsed > 0 && nowNs() - w->lastFlush > OUT_INTERVAL){
+                flushOutput(w);
+            }
+            if (atomic_fetch_sub(&walk->pending, 1) == 1){
+                // the last task, wake everyone to leave
+                pthread_mutex_lock(&walk->idleMutex);
+                pthread_cond_broadcast(&walk->idle);
+                pthread_mutex_unlock(&walk->idleMutex);
+            }
+            continue;
+        }
+        if (w->outUsed > 0){
+            flushOutput(w);
+        }
+        pthread_mutex_lock(&walk->idleMutex);
+        atomic_fetch_add(&walk->sleepers, 1);
+        while (atomic_load(&walk->queued) == 0 && atomic_load(&walk->pending) > 0){
+            pthread_cond_wait(&walk->idle, &walk->idleMutex);
+        }
+        atomic_fetch_sub(&walk->sleepers, 1);
+        pthread_mutex_unlock(&walk->idleMutex);
+        if (atomic_load(&walk->pending) == 0){
+            return NULL;
+        }
+    }
+}
+
+//+
+// Function: walkRoot
+//
+// Purpose: Starts the walk of one root. A directory is queued, anything
+//      else is tested or counted on its own.
+//
+// Returns: 0, or -1 if the root doesn't exist
+//-
+
+static int walkRoot(struct worker *w, char *root){
+    const struct walkOptions *options = w->walk->options;
+    struct stat st;
+
+    if (fstatat(AT_FDCWD, root, &st, AT_SYMLINK_NOFOLLOW) != 0){
+        fprintf(stderr, "%s: %s: %s\n", options->mode == WALK_DU ? "du" : "find", root, strerror(errno));
+        return -1;
+    }
+    // the name a pattern is matched against, the last part of the path
+    char *name = root;
+    size_t len = strlen(root);
+    while (len > 1 && root[len - 1] == '/'){
+        root[--len] = '\0';
+    }
+    if (strrchr(root, '/') != NULL && len > 1){
+        name = strrchr(root, '/') + 1;
+    }
+    if (options->mode == WALK_FIND && findMatches(options, name, modeType(st.st_mode), st.st_size)){
+        emit(w, root, NULL);
+    }
+    if (!S_ISDIR(st.st_mode)){
+        if (options->mode == WALK_DU){
+            char line[64];
+            snprintf(line, sizeof(line), "%llu\t", (unsigned long long) (st.st_blocks + 1) / 2);
+            size_t lineLen = strlen(line);
+            char *full = malloc(lineLen + len + 1);
+            if (full != NULL){
+                sprintf(full, "%s%s", line, root);
+                emit(w, full, NULL);
+                free(full);
+            }
+        }
+        return 0;
+    }
+    struct task task = {-1, newNode(NULL, root)};
+    pushTask(w, task);
+    return 0;
+}
+
+//+
+// Function: walkTrees
+//
+// Purpose: Walks each root with a pool of options->numThreads threads,
+//      printing to standard output as the walk goes.
+//
+// Parameters:
+//   roots, numRoots (the starting points)
+//   options (find predicates or du options, and the number of threads)
+//
+// Returns: 0, or -1 if a root could not be walked
+//-
+
+int walkTrees(char *roots[], int numRoots, const struct walkOptions *options){
+    struct walk walk;
+    struct rlimit limit;
+    int result = 0;
+
+    memset(&walk, 0, sizeof(walk));
+    walk.options = options;
+    walk.numWorkers = options->numThreads < 1 ? 1 : options->numThreads > MAX_THREADS ? MAX_THREADS : options->numThreads;
+    // leave half the descriptors for the rest of the shell
+    walk.fdBudget = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < 2048 ? limit.rlim_cur / 2 : 1024;
+    pthread_mutex_init(&walk.idleMutex, NULL);
+    pthread_cond_init(&walk.idle, NULL);
+    pthread_mutex_init(&walk.outMutex, NULL);
+    for (int i = 0; i < INODE_SHARDS; i++){
+        pthread_mutex_init(&walk.inodes[i].mutex, NULL);
+    }
+    walk.workers = aligned_alloc(CACHE_LINE, ((walk.numWorkers * sizeof(struct worker) + CACHE_LINE - 1) / CACHE_LINE) * CACHE_LINE);
+    if (walk.workers == NULL){
+        perror("walkTrees");
+        exit(1);
+    }
+    for (int i = 0; i < walk.numWorkers; i++){
+        struct worker *w = &walk.workers[i];
+        memset(w, 0, sizeof(struct worker));
+        w->walk = &walk;
+        w->index = i;
+        w->seed = i + 1;
+        pthread_mutex_init(&w->deque.mutex, NULL);
+        w->dirBuffer = malloc(DIR_BUFFER);
+        w->out = malloc(OUT_BUFFER);
+        if (w->dirBuffer == NULL || w->out == NULL){
+            perror("walkTrees");
+            exit(1);
+        }
+    }
+
+    // the roots go on the first thread's deque, the others steal them
+    for (int i = 0; i < numRoots; i++){
+        if (walkRoot(&walk.workers[0], roots[i]) != 0){
+            result = -1;
+        }
+    }
+    pthread_t *threads = malloc(walk.numWorkers * sizeof(pthread_t));
+    if (threads == NULL){
+        perror("walkTrees");
+        exit(1);
+    }
+    int started = 1;
+    for (int i = 1; i < walk.numWorkers; i++){
+        if (pthread_create(&threads[i], NULL, workerMain, &walk.workers[i]) != 0){
+            break;
+        }
+        started++;
+    }
+    // this thread is worker 0
+    workerMain(&walk.workers[0]);
+    for (int i = 1; i < started; i++){
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < walk.numWorkers; i++){
+        struct worker *w = &walk.workers[i];
+        if (w->outUsed > 0){
+            flushOutput(w);
+        }
+        free(w->deque.tasks);
+        free(w->dirBuffer);
+        free(w->out);
+        pthread_mutex_destroy(&w->deque.mutex);
+    }
+    for (int i = 0; i < INODE_SHARDS; i++){
+        free(walk.inodes[i].slots);
+        pthread_mutex_destroy(&walk.inodes[i].mutex);
+    }
+    free(threads);
+    free(walk.workers);
+    pthread_mutex_destroy(&walk.idleMutex);
+    pthread_cond_destroy(&walk.idle);
+    pthread_mutex_destroy(&walk.outMutex);
+    return result;
+}
@@ -0,0 +1,54 @@
+//+
+// File:    walk.h
+//
+// Purpose: Walks directory trees in parallel for the shell's find and du
+//      builtins. Each directory is a task on a pool of threads. A thread
+//      keeps the directories it finds on its own deque and works through
+//      them depth first, and a thread with nothing to do steals from the
+//      far end of another's deque, so a deep or lopsided tree keeps every
+//      thread busy and many directory reads in flight.
+//
+//      Directories are opened with openat relative to their parent's open
+//      descriptor and entries are examined with fstatat, so no path is
+//      walked twice. Only directory paths are built as strings.
+//
+//      find prints each match as it is found. du prints each directory's
+//      total as soon as everything under it has been counted, and counts a
+//      file with several hard links once, by device and inode.
+//-
+
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdint.h>
+
+// What a walk does
+#define WALK_FIND 0
+#define WALK_DU 1
+
+// find -size comparisons
+#define SIZE_ANY 0
+#define SIZE_LESS 1
+#define SIZE_EQUAL 2
+#define SIZE_MORE 3
+
+struct walkOptions{
+    int mode;
+    // threads in the pool
+    int numThreads;
+    // find, a pattern for the name (NULL for any), a type character
+    // ('f', 'd' or 'l', 0 for any), and a size in units of sizeUnit bytes,
+    // with sizes rounded up to whole units as find does
+    const char *namePattern;
+    char type;
+    int sizeCompare;
+    uint64_t size;
+    uint64_t sizeUnit;
+    // du, only print the total of each root
+    int summarize;
+};
+
+int walkDefaultThreads(void);
+int walkTrees(char *roots[], int numRoots, const struct walkOptions *options);
+
+#endif
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "ingest.h"
+
+//+
+// File:    ingest.c
+//
+// Purpose: Integer ingestion for the producers, see ingest.h.
+//-
+
+//+
+// Function: findNewline
+//
+// Purpose:  Finds the first newline from p up to end, comparing 16 bytes at
+//           a time with SSE2. Never reads at or past end.
+//
+// Returns:  pointer to the newline, NULL if there is none
+//-
+
+static inline const char * findNewline(const char *p, const char *end){
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 16){
+        __m128i block = _mm_loadu_si128((const __m128i *) p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        if (mask != 0){
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end){
+        if (*p == '\n'){
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
+
+//+
+// Function: atoiLine
+//
+// Purpose:  Converts the line from s up to end the way atoi does, which in
+//           glibc is (int) strtol(s, NULL, 10): skip white space, take an
+//           optional sign and then digits, saturate at LONG_MIN or LONG_MAX
+//           on overflow, and truncate to int. A nul byte ends the string.
+//-
+
+static inline int atoiLine(const char *s, const char *end){
+    int negative = 0;
+    uint64_t value = 0;
+
+    while (s < end && (*s == ' ' || (*s >= '\t' && *s <= '\r'))){
+        s++;
+    }
+    if (s < end && (*s == '-' || *s == '+')){
+        negative = *s++ == '-';
+    }
+    const char *digits = s;
+    while (s < end && (unsigned) (*s - '0') < 10){
+        value = value * 10 + (*s++ - '0');
+    }
+    if (s - digits > 18){
+        // may have overflowed, convert again saturating
+        uint64_t limit = negative ? (uint64_t) LONG_MAX + 1 : (uint64_t) LONG_MAX;
+        value = 0;
+        for (const char *d = digits; d < s; d++){
+            unsigned digit = *d - '0';
+            if (value > (limit - digit) / 10){
+                value = limit;
+            } else {
+                value = value * 10 + digit;
+            }
+        }
+    }
+    return (int) (negative ? -value : value);
+}
+
+//+
+// Function: scanInts
+//
+// Purpose:  Converts the lines in data to values, as fgets into a LINE_LEN
+//           buffer would split them and atoi would convert them. A line ends
+//           after a newline or after LINE_LEN - 1 bytes. A last line with
+//           no newline is only converted when atEof is set, otherwise it is
+//           left for the next call along with the rest of the data.
+//
+// Parameters:
+//   data, len (bytes to convert)
+//   atEof (no more bytes follow data)
+//   values, maxValues (where to put the values, and how many fit)
+//   used (set to the number of bytes converted)
+//
+// Returns:  the number of values converted
+//-
+
+size_t scanInts(const char *data, size_t len, int atEof, int *values, size_t maxValues, size_t *used){
+    const char *p = data;
+    const char *end = data + len;
+    size_t count = 0;
+
+    while (count < maxValues && p < end){
+        const char *limit = end - p > LINE_LEN - 1 ? p + LINE_LEN - 1 : end;
+        const char *newline = findNewline(p, limit);
+        const char *lineEnd;
+        if (newline != NULL){
+            lineEnd = newline + 1;
+        } else if (limit - p == LINE_LEN - 1 || atEof){
+            // fgets stops when its buffer is full, or at the end of the file
+            lineEnd = limit;
+        } else {
+            // incomplete line, wait for more data
+            break;
+        }
+        values[count++] = atoiLine(p, lineEnd);
+        p = lineEnd;
+    }
+    *used = p - data;
+    return count;
+}
+
+//+
+// Function: intReaderOpen
+//
+// Purpose:  Opens fileName for reading with the given mode. INGEST_MMAP
+//           falls back to INGEST_READ when the file isn't a regular file.
+//
+// Returns:  0 on success, -1 with errno set on failure
+//-
+
+int intReaderOpen(struct intReader *r, const char *fileName, int mode){
+    struct stat st;
+
+    memset(r, 0, sizeof(struct intReader));
+    if (mode == INGEST_STDIO){
+        if ((r->file = fopen(fileName, "r")) == NULL){
+            return -1;
+        }
+        r->fd = fileno(r->file);
+    } else if ((r->fd = open(fileName, O_RDONLY)) < 0){
+        return -1;
+    }
+    // reads from a regular file never wait on a writer
+    r->canBlock = fstat(r->fd, &st) == 0 && !S_ISREG(st.st_mode);
+    if (mode == INGEST_MMAP && r->canBlock){
+        mode = INGEST_READ;
+    }
+    r->mode = mode;
+
+    if (mode == INGEST_MMAP){
+        r->eof = 1;
+        if (st.st_size > 0){
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+            if (map == MAP_FAILED){
+                close(r->fd);
+                return -1;
+            }
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            r->buf = map;
+            r->len = r->mapLen = st.st_size;
+        }
+    } else if (mode == INGEST_READ){
+        if ((r->chunk = malloc(CHUNK_SIZE)) == NULL){
+            close(r->fd);
+            return -1;
+        }
+        r->buf = r->chunk;
+    }
+    return 0;
+}
+
+//+
+// Function: readMore
+//
+// Purpose:  Moves the part of a line left in the INGEST_READ chunk to the
+//           front and reads more after it, setting eof at the end of the
+//           file.
+//-
+
+static void readMore(struct intReader *r){
+    while (1){
+        size_t pending = r->len - r->pos;
+        memmove(r->chunk, r->chunk + r->pos, pending);
+        r->pos = 0;
+        r->len = pending;
+        ssize_t got = read(r->fd, r->chunk + pending, CHUNK_SIZE - pending);
+        if (got < 0 && errno == EINTR){
+            continue;
+        }
+        if (got <= 0){
+            r->eof = 1;
+        } else {
+            r->len += got;
+        }
+        return;
+    }
+}
+
+//+
+// Function: intReaderRead
+//
+// Purpose:  Reads up to maxValues values, one per line. Waits for input if
+//           there is no complete line buffered. INGEST_STDIO reads one line
+//           at a time with fgets and atoi.
+//
+// Returns:  the number of values read, -1 at the end of the file
+//-
+
+int intReaderRead(struct intReader *r, int *values, int maxValues){
+    if (r->mode == INGEST_STDIO){
+        // one line per call, as the producer originally read
+        char line[LINE_LEN];
+        if (!fgets(line, LINE_LEN, r->file)){
+            return -1;
+        }
+        values[0] = atoi(line);
+        return 1;
+    }
+
+    while (1){
+        size_t used;
+        size_t count = scanInts(r->buf + r->pos, r->len - r->pos, r->eof, values, maxValues, &used);
+        r->pos += used;
+        if (count > 0){
+            return count;
+        }
+        if (r->eof){
+            return -1;
+        }
+        readMore(r);
+    }
+}
+
+//+
+// Function: intReaderLine
+//
+// Purpose:  Reads the next line, with its newline, for producers that move
+//           whole lines rather than values. Lines longer than maxLen bytes,
+//           which must be no more than CHUNK_SIZE, are returned in maxLen
+//           pieces, and maxLen must be the same on every call. line points
+//           into the reader's buffer, and is only good until the next call.
+//
+// Returns:  the length of the line, -1 at the end of the file
+//-
+
+int intReaderLine(struct intReader *r, const char **line, size_t maxLen){
+    if (r->mode == INGEST_STDIO){
+        if (r->chunk == NULL && (r->chunk = malloc(maxLen + 1)) == NULL){
+            return -1;
+        }
+        // as fgets would split it, but counting the bytes, as a line may
+        // hold nul bytes
+        size_t len = 0;
+        int c;
+        while (len < maxLen && (c = getc_unlocked(r->file)) != EOF){
+            r->chunk[len++] = c;
+            if (c == '\n'){
+                break;
+            }
+        }
+        if (len == 0){
+            return -1;
+        }
+        *line = r->chunk;
+        return len;
+    }
+
+    while (1){
+        const char *start = r->buf + r->pos;
+        size_t avail = r->len - r->pos;
+        const char *limit = avail > maxLen ? start + maxLen : start + avail;
+        const char *newline = findNewline(start, limit);
+        size_t len;
+        if (newline != NULL){
+            len = newline + 1 - start;
+        } else if (avail >= maxLen || (r->eof && avail > 0)){
+            len = limit - start;
+        } else if (r->eof){
+            return -1;
+        } else {
+            readMore(r);
+            continue;
+        }
+        r->pos += len;
+        *line = start;
+        return len;
+    }
+}
+
+//+
+// Function: intReaderWouldBlock
+//
+// Purpose:  Checks whether the next intReaderRead could have to wait on the
+//           writer of a pipe or terminal.
+//
+// Returns:  1 if it could wait, 0 if it will return right away
+//-
+
+int intReaderWouldBlock(struct intReader *r){
+    struct pollfd inPoll = {r->fd, POLLIN, 0};
+
+    if (!r->canBlock || r->eof){
+        return 0;
+    }
+    if (r->mode != INGEST_STDIO && findNewline(r->buf + r->pos, r->buf + r->len) != NULL){
+        return 0;
+    }
+    return poll(&inPoll, 1, 0) == 0;
+}
+
+//+
+// Function: intReaderClose
+//
+// Purpose:  Closes the file and frees the buffers of the reader.
+//-
+
+void intReaderClose(struct intReader *r){
+    if (r->mode == INGEST_STDIO){
+        fclose(r->file);
+        // allocated by intReaderLine
+        free(r->chunk);
+        return;
+    }
+    if (r->mapLen > 0){
+        munmap((void *) r->buf, r->mapLen);
+    }
+    free(r->chunk);
+    close(r->fd);
+}
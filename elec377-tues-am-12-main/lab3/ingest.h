@@ -0,0 +1,59 @@
+//+
+// File:    ingest.h
+//
+// Purpose: Reads the newline separated integers of a producer input file.
+//      The values and line numbers are exactly what reading the file with
+//      fgets into a 1024 byte buffer and converting each line with atoi
+//      gives, including negative numbers, malformed lines, and lines longer
+//      than the buffer (which fgets returns in 1023 byte pieces).
+//
+//      The fast path maps regular files with mmap, or streams other files
+//      in large chunks with read, and finds the line ends with SSE2.
+//
+//      The same reader can return whole lines instead, for record mode.
+//-
+
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// size of the fgets buffer being matched, a line is at most LINE_LEN - 1 bytes
+#define LINE_LEN 1024
+// bytes read at a time when a file can't be mapped
+#define CHUNK_SIZE (1 << 20)
+
+// Ways of reading a file
+#define INGEST_STDIO 0
+#define INGEST_MMAP 1
+#define INGEST_READ 2
+
+struct intReader{
+    int mode;
+    int fd;
+    // the input is a pipe or terminal, so a read may wait on the writer
+    int canBlock;
+    // no more data after what is in buf
+    int eof;
+    // INGEST_STDIO
+    FILE *file;
+    // INGEST_MMAP and INGEST_READ, bytes pos to len of buf are not parsed yet
+    const char *buf;
+    size_t len;
+    size_t pos;
+    // INGEST_READ buffer, or the line buffer of intReaderLine with
+    // INGEST_STDIO
+    char *chunk;
+    // INGEST_MMAP, the mapping to unmap
+    size_t mapLen;
+};
+
+size_t scanInts(const char *data, size_t len, int atEof, int *values, size_t maxValues, size_t *used);
+int intReaderOpen(struct intReader *r, const char *fileName, int mode);
+int intReaderRead(struct intReader *r, int *values, int maxValues);
+int intReaderLine(struct intReader *r, const char **line, size_t maxLen);
+int intReaderWouldBlock(struct intReader *r);
+void intReaderClose(struct intReader *r);
+
+#endif
@@ -1,11 +1,111 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <sched.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ingest.h"
+#include "placement.h"
+
+//+
+// Buffer backends
+//
+// The bounded buffer between the producers and the consumers is reached
+// through a table of operations so that the backend can be chosen on the
+// command line (-b). Every backend embeds struct boundedBuffer as its first
+// member, and keeps the same end of stream rule: a consumer only gives up
+// once the buffer is empty and numProdRunning has dropped to zero.
+//
+//    mutex    -> one mutex and the empty/full condition variables (default)
+//    lockfree -> bounded multi-producer/multi-consumer ring with a sequence
+//                number per slot, head and tail on separate cache lines
+//    steal    -> a deque per consumer, idle consumers steal from their peers
+//
+// Any of them can also be split into shards (-k), or into priority lanes
+// (-L), see Sharded Buffers.
+//-
+
+#define CACHE_LINE 64
+
+struct bufferOps;
+
+// A value in the buffer
+struct item{
+    int value;
+    // producer and line number the value came from
+    int prodNum;
+    int lineNo;
+    // with -r the value is the offset of a record in the producer's slab,
+    // and this is the length of its line
+    int len;
+    // time the value was put in the buffer, used by the benchmark
+    uint64_t stamp;
+};
+
+// State shared by every backend
+struct boundedBuffer{
+    // operations for this backend
+    const struct bufferOps *ops;
+    // capacity of the buffer
+    int numSlots;
+    // number of running producers
+    atomic_int numProdRunning;
+    // how often and how long producers waited on full and consumers
+    // waited on empty, only updated when a thread actually waits
+    atomic_long fullWaits;
+    atomic_long fullWaitNs;
+    atomic_long emptyWaits;
+    atomic_long emptyWaitNs;
+    // with futex waiting, waits that ended while spinning and waits that
+    // parked
+    atomic_long spinWakes;
+    atomic_long parks;
+    // consumers the elastic pool has asked to leave (-E), each one is taken
+    // by a consumer that finds the buffer empty
+    atomic_int retiring;
+    // sharded buffer this buffer is a shard of (-k), told before a
+    // producer waits on a full shard. NULL if it isn't a shard
+    struct boundedBuffer *owner;
+};
+
+struct bufferOps{
+    char *name;
+    // allocate a buffer with the given number of slots, for numProducers
+    // producers and numConsumers consumers, each numbered from 0
+    struct boundedBuffer *(*create)(int numSlots, int numProducers, int numConsumers);
+    // add count values, waiting while the buffer is full. lineNo is the
+    // line number of the first value
+    void (*put)(struct boundedBuffer *buf, int threadNum, int lineNo, const struct item *items, int count);
+    // remove up to maxCount values, waiting while the buffer is empty.
+    // Returns the number removed, 0 once the buffer is empty and there are
+    // no producers left. location is the slot of the first value
+    int (*get)(struct boundedBuffer *buf, int threadNum, struct item *items, int maxCount, int *location);
+    // called by each producer once it has added its last value
+    void (*producerDone)(struct boundedBuffer *buf, int threadNum);
+    // remove up to maxCount values without waiting. Returns the number
+    // removed, 0 if the buffer is empty for now, -1 once it is empty and
+    // there are no producers left
+    int (*tryGet)(struct boundedBuffer *buf, int threadNum, struct item *items, int maxCount, int *location);
+    // number of values in the buffer right now
+    int (*occupancy)(struct boundedBuffer *buf);
+    // ask one consumer to leave, get returns 0 to it once it finds the
+    // buffer empty
+    void (*retire)(struct boundedBuffer *buf);
+};
 
 // Parameter strucutre for threads
 struct threadParm{
@@ -13,178 +113,4054 @@ struct threadParm{
     char fileName[20];
     // thread num for debug messages
     int threadNum;
+    // buffer shared by the producers and consumers
+    struct boundedBuffer *buf;
+    // benchmark producers read this in memory stream instead of a file
+    const int *stream;
+    long streamLen;
+    // benchmark consumers, and consumers with lanes, record enqueue to
+    // dequeue latency here, with a histogram for each of MAX_LANES classes
+    struct latHist *latency;
+    // number of values the thread moved
+    long numMoved;
+    // trace ring for this thread, NULL unless tracing
+    struct traceRing *trace;
+    // merge stage the consumers hand their values to, NULL to write them
+    struct mergeStage *merge;
+    // consumer threads started for this slot, from the second one on the
+    // output file is added to rather than replaced
+    int starts;
+    // set by a consumer thread as it leaves, so it can be joined
+    atomic_int exited;
+    // transform stage the thread works for
+    struct stage *stage;
 };
 
 // Global Vars
 // the current test number
 int testNum = 0;
+// most values a producer publishes at once (-n)
+int prodBatch = 1;
+// most values a consumer removes at once (-m)
+int consBatch = 1;
+// longest a producer holds a partial batch, in microseconds (-f)
+long flushUsec = 1000;
+// how producers read their files (-i)
+int ingestMode = INGEST_MMAP;
+// consumers write 4 byte little-endian records instead of text (-F)
+int binaryOutput = 0;
+// consumers also copy their output to stdout (-e)
+int echoOutput = 0;
+// how producers choose a consumer's deque with the steal backend (-d),
+// 0 for round robin
+int stealDispatch = 0;
+// merge the consumers' output into one ordered stream (-M), 0 for none
+int mergeMode = 0;
+// most values the merge holds back waiting for their turn (-w)
+int mergeWindow = 4096;
+// move whole lines through the buffer instead of values (-r)
+int recordMode = 0;
+// bytes of each producer's record slab (-R)
+long slabBytes = 1 << 20;
+// run the producers and consumers in one event loop instead of threads (-X)
+int asyncMode = 0;
+// how threads sleep on a full or empty buffer (-W), 0 for condition variables
+int waitMode = 0;
+// futex waiters spin before parking, only with more than one CPU
+int waitSpin = 1;
+// split each buffer into this many shards, producer p putting into shard
+// p % numShards (-k)
+int numShards = 1;
+// priority classes, each with a lane of its own (-L), 1 for none
+int numLanes = 1;
+// most sweeps in a row a consumer takes from the higher lanes while the
+// bulk lane waits (-L ...@n)
+int laneStarve = 16;
+// CPUs the producer and consumer threads run on (-a)
+struct placement threadPlacement;
+// record lock and buffer events in the trace rings (-t)
+int tracing = 0;
+// events kept per thread when tracing, rounded up to a power of two (-T)
+long traceEvents = 65536;
+
+// function prototypes
+void simulate_interrupt(void);
+void cpu_relax(void);
+void cpu_pause(void);
+uint64_t nowNs(void);
+void recordWait(atomic_long *waits, atomic_long *waitNs, uint64_t start);
+int takeRetire(struct boundedBuffer *buf);
+void ownerWake(struct boundedBuffer *buf);
+int itemClass(const struct item *it);
+
+//////////////////////////////////// Trace ////////////////////////////////////
+
+//+
+// Trace
+//
+// The lock and buffer messages are not printed as they happen, since printf
+// takes the stdio lock and would serialize the threads more than the buffer
+// does. Instead each thread appends fixed size binary events to its own
+// preallocated ring, overwriting the oldest events when it wraps, and
+// traceDecode prints the messages in time order after the run. With tracing
+// off a TRACE costs one branch on a global that never changes during a run.
+//-
+
+// Event types, in the order of traceFormats
+#define TR_PROD_LOCK    0
+#define TR_PROD_FULL    1
+#define TR_PROD_SIGNAL  2
+#define TR_PROD_RELEASE 3
+#define TR_PROD_ADD     4
+#define TR_CONS_LOCK    5
+#define TR_CONS_EMPTY   6
+#define TR_CONS_SIGNAL  7
+#define TR_CONS_RELEASE 8
+#define TR_CONS_PULL    9
+#define TR_CONS_STEAL   10
+
+// Message for each event type. Every format takes the thread number, line
+// number, value and slot in that order, and uses the ones it needs.
+const char *traceFormats[] = {
+    "Producer thread %1$d obtaining lock for %2$d: %3$d\n",
+    "Producer thread %1$d waiting full\n",
+    "Producer thread %1$d signaling empty\n",
+    "Producer thread %1$d releasing lock\n",
+    "Producer thread %1$d adding %2$d: %3$d at position %4$d\n",
+    "Consumer thread %1$d aquiring lock\n",
+    "Consumer thread %1$d waiting on empty\n",
+    "Consumer thread %1$d signaling full\n",
+    "Consumer thread %1$d releasing lock\n",
+    "Consumer thread %1$d pulled %2$d: %3$d from position %4$d\n",
+    "Consumer thread %1$d stole %2$d values from consumer %3$d at position %4$d\n",
+};
+
+struct traceEvent{
+    uint64_t stamp;
+    uint16_t threadNum;
+    uint8_t type;
+    uint8_t pad;
+    int32_t slot;
+    int32_t lineNo;
+    int32_t value;
+};
+
+struct traceRing{
+    struct traceEvent *events;
+    // capacity - 1, the capacity is a power of two
+    size_t mask;
+    // number of events ever recorded
+    size_t next;
+};
+
+// ring of the calling thread
+__thread struct traceRing *myTrace;
+
+// record one event when tracing
+#define TRACE(type, threadNum, slot, lineNo, value) \
+    do { if (__builtin_expect(tracing, 0)) traceEvent(type, threadNum, slot, lineNo, value); } while (0)
+
+//+
+// Function: traceCreate
+//
+// Purpose:  Allocates a ring holding traceEvents events.
+//-
+
+struct traceRing * traceCreate(void){
+    struct traceRing *ring = calloc(1, sizeof(struct traceRing));
+    size_t capacity = 1;
+    while (capacity < traceEvents){
+        capacity <<= 1;
+    }
+    if (ring == NULL || (ring->events = calloc(capacity, sizeof(struct traceEvent))) == NULL){
+        perror("traceCreate");
+        exit(1);
+    }
+    ring->mask = capacity - 1;
+    return ring;
+}
+
+//+
+// Function: traceEvent
+//
+// Purpose:  Appends an event to the calling thread's ring. Threads without a
+//           ring are not traced.
+//-
+
+void traceEvent(int type, int threadNum, int slot, int lineNo, int value){
+    struct traceRing *ring = myTrace;
+    if (ring == NULL){
+        return;
+    }
+    struct traceEvent *ev = &ring->events[ring->next++ & ring->mask];
+    ev->stamp = nowNs();
+    ev->threadNum = threadNum;
+    ev->type = type;
+    ev->slot = slot;
+    ev->lineNo = lineNo;
+    ev->value = value;
+}
+
+//+
+// Function: compareEvents
+//
+// Purpose:  qsort comparison putting events in time order.
+//-
+
+int compareEvents(const void *a, const void *b){
+    const struct traceEvent *ea = a;
+    const struct traceEvent *eb = b;
+    return (ea->stamp > eb->stamp) - (ea->stamp < eb->stamp);
+}
+
+//+
+// Function: traceDecode
+//
+// Purpose:  Prints the events of numRings rings as messages in time order,
+//           and how many events were overwritten before they could be
+//           printed.
+//-
+
+void traceDecode(struct traceRing **rings, int numRings){
+    size_t total = 0;
+    size_t dropped = 0;
+    for (int i = 0; i < numRings; i++){
+        size_t kept = rings[i]->next <= rings[i]->mask + 1 ? rings[i]->next : rings[i]->mask + 1;
+        total += kept;
+        dropped += rings[i]->next - kept;
+    }
+    struct traceEvent *all = malloc(total * sizeof(struct traceEvent) + 1);
+    if (all == NULL){
+        perror("traceDecode");
+        exit(1);
+    }
+    // copy the kept events of each ring, oldest first
+    size_t n = 0;
+    for (int i = 0; i < numRings; i++){
+        size_t kept = rings[i]->next <= rings[i]->mask + 1 ? rings[i]->next : rings[i]->mask + 1;
+        for (size_t e = rings[i]->next - kept; e < rings[i]->next; e++){
+            all[n++] = rings[i]->events[e & rings[i]->mask];
+        }
+    }
+    qsort(all, total, sizeof(struct traceEvent), compareEvents);
+
+    printf("Trace: %zu events, %zu overwritten\n", total, dropped);
+    for (size_t i = 0; i < total; i++){
+        printf(traceFormats[all[i].type], all[i].threadNum, all[i].lineNo, all[i].value, all[i].slot);
+    }
+    free(all);
+}
+
+///////////////////////////////////// Wait /////////////////////////////////////
+
+//+
+// Wait points
+//
+// The backends that sleep on a condition (full, empty, idle) do it through
+// a wait point, so that how they sleep can be chosen with -W:
+//
+//    condvar -> pthread_cond_wait and pthread_cond_signal (default)
+//    futex   -> spin on a sequence number for a while, then park on it with
+//               a Linux futex. Every wake up bumps the sequence number, so
+//               a waiter that saw the old number under the mutex can't miss
+//               the wake up. How long to spin follows the recent waits:
+//               a wait that ends while spinning moves the budget toward
+//               twice its length, and a wait that has to park halves it,
+//               between WAIT_SPIN_MIN_NS and WAIT_SPIN_MAX_NS. With one CPU
+//               the thread being waited on can't run during a spin, so
+//               there is none.
+//
+// Like pthread_cond_wait, waitOn can return before the condition holds, so
+// it is always called in a loop that checks the condition again.
+//-
+
+#define WAIT_CONDVAR 0
+#define WAIT_FUTEX 1
+
+// shortest and longest a waiter spins before parking
+#define WAIT_SPIN_MIN_NS 250
+#define WAIT_SPIN_MAX_NS 50000
+
+struct waitPoint{
+    pthread_cond_t cond;
+    // bumped by every wake up, the futex word
+    atomic_uint seq;
+    // threads parked on the futex
+    atomic_int parked;
+    // how long the next waiter spins, in nanoseconds
+    atomic_long spinNs;
+};
+
+//+
+// Function: waitInit
+//
+// Purpose:  Initializes a wait point.
+//-
+
+void waitInit(struct waitPoint *wp){
+    pthread_cond_init(&wp->cond, NULL);
+    atomic_init(&wp->seq, 0);
+    atomic_init(&wp->parked, 0);
+    atomic_init(&wp->spinNs, WAIT_SPIN_MIN_NS);
+}
+
+//+
+// Function: waitOn
+//
+// Purpose:  Waits for a wake up on wp. Called and returns with mutex held.
+//           With futex waiting the wait is counted in buf as woken while
+//           spinning or as parked.
+//-
+
+void waitOn(struct waitPoint *wp, pthread_mutex_t *mutex, struct boundedBuffer *buf){
+    if (waitMode == WAIT_CONDVAR){
+        pthread_cond_wait(&wp->cond, mutex);
+        return;
+    }
+
+    // read under the mutex, so a wake up after the unlock changes it
+    unsigned int seq = atomic_load(&wp->seq);
+    long spinNs = waitSpin ? atomic_load_explicit(&wp->spinNs, memory_order_relaxed) : 0;
+    uint64_t start = nowNs();
+    int woken = 0;
+    pthread_mutex_unlock(mutex);
+
+    for (int i = 1; spinNs > 0; i++){
+        if (atomic_load_explicit(&wp->seq, memory_order_acquire) != seq){
+            woken = 1;
+            break;
+        }
+        cpu_pause();
+        // the clock is only read every so often
+        if (i % 64 == 0 && nowNs() - start > spinNs){
+            break;
+        }
+    }
+    // a lost update of the budget only makes the next spin a little off
+    if (woken){
+        atomic_fetch_add_explicit(&buf->spinWakes, 1, memory_order_relaxed);
+        long target = 2 * (long) (nowNs() - start);
+        spinNs += (target - spinNs) / 8;
+        spinNs = spinNs < WAIT_SPIN_MAX_NS ? spinNs : WAIT_SPIN_MAX_NS;
+    } else {
+        atomic_fetch_add_explicit(&buf->parks, 1, memory_order_relaxed);
+        atomic_fetch_add(&wp->parked, 1);
+        // returns right away if seq has already moved on
+        syscall(SYS_futex, &wp->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+        atomic_fetch_sub(&wp->parked, 1);
+        spinNs /= 2;
+    }
+    if (waitSpin){
+        spinNs = spinNs > WAIT_SPIN_MIN_NS ? spinNs : WAIT_SPIN_MIN_NS;
+        atomic_store_explicit(&wp->spinNs, spinNs, memory_order_relaxed);
+    }
+    pthread_mutex_lock(mutex);
+}
+
+//+
+// Function: waitWake
+//
+// Purpose:  Wakes one thread waiting on wp, or all of them. Called after
+//           the condition being waited for has changed.
+//-
+
+void waitWake(struct waitPoint *wp, int all){
+    if (waitMode == WAIT_CONDVAR){
+        if (all){
+            pthread_cond_broadcast(&wp->cond);
+        } else {
+            pthread_cond_signal(&wp->cond);
+        }
+        return;
+    }
+    atomic_fetch_add(&wp->seq, 1);
+    // a waiter that counted itself as parked after this load will find
+    // seq changed and not sleep
+    if (atomic_load(&wp->parked) > 0){
+        syscall(SYS_futex, &wp->seq, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, NULL, NULL, 0);
+    }
+}
+
+//////////////////////////////// Mutex Backend ////////////////////////////////
+
+struct mutexBuffer{
+    struct boundedBuffer base;
+    // mutexes
+    pthread_mutex_t mutex;
+    struct waitPoint empty;
+    struct waitPoint full;
+    //*********Begin Shared Variables*************
+    int numElements;
+    int head;
+    int tail;
+    struct item *buffer;
+    //*********End Shared Variables*************
+};
+
+//+
+// Function: mutexCreate
+//
+// Purpose:  Allocates a mutex protected buffer with numSlots entries.
+//-
+
+struct boundedBuffer * mutexCreate(int numSlots, int numProducers, int numConsumers){
+    struct mutexBuffer *mb = calloc(1, sizeof(struct mutexBuffer));
+    if (mb == NULL || (mb->buffer = calloc(numSlots, sizeof(struct item))) == NULL){
+        fprintf(stderr, "mutexCreate: can't allocate %d slots: %s\n", numSlots, strerror(errno));
+        exit(1);
+    }
+    pthread_mutex_init(&mb->mutex, NULL);
+    waitInit(&mb->empty);
+    waitInit(&mb->full);
+    mb->base.numSlots = numSlots;
+    return &mb->base;
+}
+
+//+
+// Function: mutexPut
+//
+// Purpose:  Adds a batch of values to the buffer in one critical section,
+//           waiting on full whenever there is no room.
+//-
+
+void mutexPut(struct boundedBuffer *buf, int threadNum, int lineNo, const struct item *items, int count){
+    struct mutexBuffer *mb = (struct mutexBuffer *) buf;
+    int added = 0;
+
+    // lock
+    pthread_mutex_lock(&mb->mutex);
+    TRACE(TR_PROD_LOCK, threadNum, mb->head, lineNo, items[0].value);
+
+    while (added < count){
+        //if full output to user and wait
+        if(mb->numElements == buf->numSlots){
+            TRACE(TR_PROD_FULL, threadNum, mb->head, lineNo + added, items[added].value);
+            uint64_t start = nowNs();
+            if (buf->owner != NULL){
+                // a consumer may be asleep on the sharded buffer
+                pthread_mutex_unlock(&mb->mutex);
+                ownerWake(buf);
+                pthread_mutex_lock(&mb->mutex);
+            }
+            while (mb->numElements == buf->numSlots){
+                waitOn(&mb->full, &mb->mutex, buf);
+            }
+            recordWait(&buf->fullWaits, &buf->fullWaitNs, start);
+        }
+
+        // add as many values as fit
+        int start = added;
+        while (added < count && mb->numElements < buf->numSlots){
+            mb->buffer[mb->head] = items[added++];
+            mb->head = (mb->head + 1) % buf->numSlots;
+            mb->numElements++;
+        }
+
+        //signal empty, waking one consumer per value added
+        waitWake(&mb->empty, added - start > 1);
+        TRACE(TR_PROD_SIGNAL, threadNum, mb->head, lineNo + added - 1, items[added - 1].value);
+    }
+
+    // release
+    pthread_mutex_unlock(&mb->mutex);
+    TRACE(TR_PROD_RELEASE, threadNum, -1, lineNo + count - 1, items[count - 1].value);
+}
+
+//+
+// Function: mutexTake
+//
+// Purpose:  Reads up to maxCount values from a buffer that isn't empty, and
+//           signals full. Called with the lock held.
+//
+// Returns:  the number of values read
+//-
+
+int mutexTake(struct mutexBuffer *mb, int threadNum, struct item *items, int maxCount, int *location){
+    int count = 0;
+
+    // read values from the buffer
+    *location = mb->tail;
+    while (count < maxCount && mb->numElements > 0){
+        items[count++] = mb->buffer[mb->tail];
+        mb->tail = (mb->tail + 1) % mb->base.numSlots;
+        //decrement the number of elements
+        mb->numElements--;
+    }
+
+    //signal if the consumer thread is signaling full
+    waitWake(&mb->full, count > 1);
+    TRACE(TR_CONS_SIGNAL, threadNum, mb->tail, 0, 0);
+    return count;
+}
+
+//+
+// Function: mutexGet
+//
+// Purpose:  Removes up to maxCount values from the buffer in one critical
+//           section, waiting on empty while there are producers that may
+//           still add to it.
+//-
+
+int mutexGet(struct boundedBuffer *buf, int threadNum, struct item *items, int maxCount, int *location){
+    struct mutexBuffer *mb = (struct mutexBuffer *) buf;
+    int count;
+
+    // lock
+    pthread_mutex_lock(&mb->mutex);
+    TRACE(TR_CONS_LOCK, threadNum, mb->tail, 0, 0);
+
+    //wait if empty and there are producers
+    if(buf->numProdRunning > 0 && mb->numElements == 0){
+        TRACE(TR_CONS_EMPTY, threadNum, mb->tail, 0, 0);
+        uint64_t start = nowNs();
+        while(buf->numProdRunning > 0 && mb->numElements == 0){
+            // an idle consumer is the one to retire
+            if (takeRetire(buf)){
+                pthread_mutex_unlock(&mb->mutex);
+                return 0;
+            }
+            waitOn(&mb->empty, &mb->mutex, buf);
+        }
+        recordWait(&buf->emptyWaits, &buf->emptyWaitNs, start);
+    }
+
+    // if the buffer is empty and no producers, then
+    // release the lock and report the end of the stream
+    if(mb->numElements == 0 && buf->numProdRunning == 0){
+         pthread_mutex_unlock(&mb->mutex);
+         return 0;
+    }
+
+    count = mutexTake(mb, threadNum, items, maxCount, location);
+
+    // release
+    pthread_mutex_unlock(&mb->mutex);
+    TRACE(TR_CONS_RELEASE, threadNum, -1, 0, 0);
+    return count;
+}
+
+//+
+// Function: mutexTryGet
+//
+// Purpose:  Removes up to maxCount values from the buffer in one critical
+//           section, without waiting when it is empty.
+//-
+
+int mutexTryGet(struct boundedBuffer *buf, int threadNum, struct item *items, int maxCount, int *location){
+    struct mutexBuffer *mb = (struct mutexBuffer *) buf;
+    int count;
+
+    pthread_mutex_lock(&mb->mutex);
+    if (mb->numElements == 0){
+        count = buf->numProdRunning == 0 ? -1 : 0;
+    } else {
+        count = mutexTake(mb, threadNum, items, maxCount, location);
+    }
+    pthread_mutex_unlock(&mb->mutex);
+    return count;
+}
+
+//+
+// Function: mutexProducerDone
+//
+// Purpose:  Decrements the number of running producers, and wakes every
+//           waiting consumer when the last one leaves.
+//-
+
+void mutexProducerDone(struct boundedBuffer *buf, int threadNum){
+    struct mutexBuffer *mb = (struct mutexBuffer *) buf;
+
+    //lock the critical section
+    pthread_mutex_lock(&mb->mutex);
+    // decrement the number of running producers
+    buf->numProdRunning--;
+    // broadcast signal if we are the last one = index of prod is 0.
+    if(buf->numProdRunning == 0){
+        waitWake(&mb->empty, 1);
+    }
+    pthread_mutex_unlock(&mb->mutex);
+}
+
+//+
+// Function: mutexOccupancy
+//
+// Purpose:  Returns the number of values in the buffer.
+//-
+
+int mutexOccupancy(struct boundedBuffer *buf){
+    struct mutexBuffer *mb = (struct mutexBuffer *) buf;
+
+    pthread_mutex_lock(&mb->mutex);
+    int count = mb->numElements;
+    pthread_mutex_unlock(&mb->mutex);
+    return count;
+}
+
+//+
+// Function: mutexRetire
+//
+// Purpose:  Asks one consumer to leave, waking the consumers waiting on
+//           empty so that one of them can.
+//-
+
+void mutexRetire(struct boundedBuffer *buf){
+    struct mutexBuffer *mb = (struct mutexBuffer *) buf;
+
+    pthread_mutex_lock(&mb->mutex);
+    atomic_fetch_add(&buf->retiring, 1);
+    waitWake(&mb->empty, 1);
+    pthread_mutex_unlock(&mb->mutex);
+}
+
+////////////////////////////// Lock-Free Backend //////////////////////////////
+
+// A slot is free for the enqueue at position pos when seq == pos, and
+// holds a value for the dequeue at position pos when seq == pos + 1.
+struct ringSlot{
+    atomic_size_t seq;
+    struct item item;
+};
+
+struct lockFreeBuffer{
+    struct boundedBuffer base;
+    struct ringSlot *slots;
+    // next position to enqueue, on its own cache line
+    _Alignas(CACHE_LINE) atomic_size_t head;
+    // next position to dequeue, on its own cache line
+    _Alignas(CACHE_LINE) atomic_size_t tail;
+    char pad[CACHE_LINE - sizeof(atomic_size_t)];
+};
+
+//+
+// Function: lockFreeCreate
+//
+// Purpose:  Allocates a lock-free ring with numSlots entries. Slot i
+//           starts out free for the enqueue at position i. The ring needs
+//           at least two slots, since with one slot a freed slot and a full
+//           slot would have the same sequence number.
+//-
+
+struct boundedBuffer * lockFreeCreate(int numSlots, int numProducers, int numConsumers){
+    if (numSlots < 2){
+        numSlots = 2;
+    }
+    struct lockFreeBuffer *lb = aligned_alloc(CACHE_LINE, sizeof(struct lockFreeBuffer));
+    if (lb == NULL){
+        perror("lockFreeCreate");
+        exit(1);
+    }
+    memset(lb, 0, sizeof(struct lockFreeBuffer));
+    lb->slots = calloc(numSlots, sizeof(struct ringSlot));
+    if (lb->slots == NULL){
+        fprintf(stderr, "lockFreeCreate: can't allocate %d slots: %s\n", numSlots, strerror(errno));
+        exit(1);
+    }
+    for (int i = 0; i < numSlots; i++){
+        atomic_init(&lb->slots[i].seq, i);
+    }
+    atomic_init(&lb->head, 0);
+    atomic_init(&lb->tail, 0);
+    lb->base.numSlots = numSlots;
+    return &lb->base;
+}
+
+//+
+// Function: lockFreePut
+//
+// Purpose:  Claims a run of head positions with one compare and swap, as
+//           many of the batch as there is room for, then publishes each
+//           value by advancing the sequence number of its slot. A slot in
+//           the run may still be being read by the consumer that claimed it
+//           on the previous lap, so the producer waits for its sequence
+//           number before writing. While the ring is full the producer
+//           spins and then yields.
+//-
+
+void lockFreePut(struct boundedBuffer *buf, int threadNum, int lineNo, const struct item *items, int count){
+    struct lockFreeBuffer *lb = (struct lockFreeBuffer *) buf;
+    int added = 0;
+    uint64_t waitStart = 0;
+
+    while (added < count){
+        size_t pos = atomic_load_explicit(&lb->head, memory_order_relaxed);
+        size_t run;
+        while(1){
+            // room is measured against the claimed tail, which is never
+            // ahead of a head that this compare and swap can succeed on
+            size_t tail = atomic_load_explicit(&lb->tail, memory_order_acquire);
+            intptr_t room = buf->numSlots - (intptr_t) (pos - tail);
+            if (room <= 0){
+                if (!waitStart){
+                    TRACE(TR_PROD_FULL, threadNum, pos % buf->numSlots, lineNo + added, items[added].value);
+                    waitStart = nowNs();
+                    ownerWake(buf);
+                }
+                cpu_relax();
+                pos = atomic_load_explicit(&lb->head, memory_order_relaxed);
+                continue;
+            }
+            run = room < count - added ? room : count - added;
+            if (atomic_compare_exchange_weak_explicit(&lb->head, &pos, pos + run,
+                    memory_order_relaxed, memory_order_relaxed)){
+                break;
+            }
+        }
+        if (waitStart){
+            recordWait(&buf->fullWaits, &buf->fullWaitNs, waitStart);
+            waitStart = 0;
+        }
+
+        for (size_t i = 0; i < run; i++){
+            struct ringSlot *slot = &lb->slots[(pos + i) % buf->numSlots];
+            while (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + i){
+                cpu_relax();
+            }
+            slot->item = items[added + i];
+            atomic_store_explicit(&slot->seq, pos + i + 1, memory_order_release);
+        }
+        TRACE(TR_PROD_ADD, threadNum, pos % buf->numSlots, lineNo + added, items[added].value);
+        added += run;
+    }
+}
+
+//+
+// Function: lockFreeRead
+//
+// Purpose:  Reads the run of positions from pos that a consumer claimed,
+//           each once its producer has published it, then frees the slots
+//           for the next lap.
+//-
+
+void lockFreeRead(struct lockFreeBuffer *lb, size_t pos, size_t run, struct item *items){
+    for (size_t i = 0; i < run; i++){
+        struct ringSlot *slot = &lb->slots[(pos + i) % lb->base.numSlots];
+        // the producer that claimed this position may not have written it yet
+        while (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + i + 1){
+            cpu_relax();
+        }
+        items[i] = slot->item;
+        atomic_store_explicit(&slot->seq, pos + i + lb->base.numSlots, memory_order_release);
+    }
+}
+
+//+
+// Function: lockFreeGet
+//
+// Purpose:  Claims a run of up to maxCount tail positions with one compare
+//           and swap, reads each value once its producer has published it,
+//           then frees the slots for the next lap. When the ring is empty and
+//           no producers are left it is checked once more, since a producer
+//           only leaves after its last value has been published.
+//-
+
+int lockFreeGet(struct boundedBuffer *buf, int threadNum, struct item *items, int maxCount, int *location){
+    struct lockFreeBuffer *lb = (struct lockFreeBuffer *) buf;
+    uint64_t waitStart = 0;
+    int drained = 0;
+    size_t pos = atomic_load_explicit(&lb->tail, memory_order_relaxed);
+    size_t run;
+
+    while(1){
+        size_t head = atomic_load_explicit(&lb->head, memory_order_acquire);
+        intptr_t avail = (intptr_t) (head - pos);
+        if (avail <= 0){
+            // empty, done if there are no producers and a second look agrees
+            if (atomic_load_explicit(&buf->numProdRunning, memory_order_acquire) == 0){
+                if (drained++){
+                    if (waitStart){
+                        recordWait(&buf->emptyWaits, &buf->emptyWaitNs, waitStart);
+                    }
+                    return 0;
+                }
+            } else if (takeRetire(buf)){
+                return 0;
+            } else {
+                if (!waitStart){
+                    TRACE(TR_CONS_EMPTY, threadNum, pos % buf->numSlots, 0, 0);
+                    waitStart = nowNs();
+                }
+                cpu_relax();
+            }
+            pos = atomic_load_explicit(&lb->tail, memory_order_relaxed);
+            continue;
+        }
+        run = avail < maxCount ? avail : maxCount;
+        if (atomic_compare_exchange_weak_explicit(&lb->tail, &pos, pos + run,
+                memory_order_relaxed, memory_order_relaxed)){
+            break;
+        }
+    }
+    if (waitStart){
+        recordWait(&buf->emptyWaits, &buf->emptyWaitNs, waitStart);
+    }
+    lockFreeRead(lb, pos, run, items);
+    *location = pos % buf->numSlots;
+    return run;
+}
+
+//+
+// Function: lockFreeTryGet
+//
+// Purpose:  Claims a run of up to maxCount tail positions like lockFreeGet,
+//           but returns right away when the ring is empty. The producer
+//           count is read before the head, so a count of zero means the
+//           head seen includes every value there will be.
+//-
+
+int lockFreeTryGet(struct boundedBuffer *buf, int threadNum, struct item *items, int maxCount, int *location){
+    struct lockFreeBuffer *lb = (struct lockFreeBuffer *) buf;
+    int running = atomic_load_explicit(&buf->numProdRunning, memory_order_acquire);
+    size_t pos = atomic_load_explicit(&lb->tail, memory_order_relaxed);
+    size_t run;
+
+    while(1){
+        size_t head = atomic_load_explicit(&lb->head, memory_order_acquire);
+        intptr_t avail = (intptr_t) (head - pos);
+        if (avail <= 0){
+            return running == 0 ? -1 : 0;
+        }
+        run = avail < maxCount ? avail : maxCount;
+        if (atomic_compare_exchange_weak_explicit(&lb->tail, &pos, pos + run,
+                memory_order_relaxed, memory_order_relaxed)){
+            break;
+        }
+    }
+    lockFreeRead(lb, pos, run, items);
+    *location = pos % buf->numSlots;
+    return run;
+}
+
+//+
+// Function: lockFreeProducerDone
+//
+// Purpose:  Decrements the number of running producers. The release
+//           ordering makes every value the producer added visible to a
+//           consumer that sees the new count.
+//-
+
+void lockFreeProducerDone(struct boundedBuffer *buf, int threadNum){
+    atomic_fetch_sub_explicit(&buf->numProdRunning, 1, memory_order_release);
+}
+
+//+
+// Function: lockFreeOccupancy
+//
+// Purpose:  Returns the number of claimed positions between tail and head,
+//           which can be off by the runs being claimed at the time.
+//-
+
+int lockFreeOccupancy(struct boundedBuffer *buf){
+    struct lockFreeBuffer *lb = (struct lockFreeBuffer *) buf;
+    size_t tail = atomic_load(&lb->tail);
+    intptr_t count = (intptr_t) (atomic_load(&lb->head) - tail);
+    return count > 0 ? count : 0;
+}
+
+//+
+// Function: lockFreeRetire
+//
+// Purpose:  Asks one consumer to leave. Consumers spin while the ring is
+//           empty, so there is no one to wake.
+//-
+
+void lockFreeRetire(struct boundedBuffer *buf){
+    atomic_fetch_add(&buf->retiring, 1);
+}
+
+//////////////////////////// Work-Stealing Backend ////////////////////////////
+
+//+
+// Work stealing
+//
+// Instead of one buffer that every consumer takes from, each consumer has a
+// deque of its own. Producers hand each batch to one deque, taking turns
+// (-d rr) or choosing by a hash of the value (-d hash), so consumers
+// mostly take the lock of their own deque. A consumer whose deque is empty
+// steals up to half of a peer's deque from the far end. When there is
+// nothing to take anywhere it sleeps on the idle condition, which producers
+// only signal when someone is asleep.
+//-
+
+// Ways producers choose a deque
+#define DISPATCH_RR 0
+#define DISPATCH_HASH 1
+
+struct stealDeque{
+    // on its own cache line, so consumers don't share lines
+    _Alignas(CACHE_LINE) pthread_mutex_t mutex;
+    struct waitPoint notFull;
+    // producers waiting on notFull
+    int fullWaiters;
+    // ring of values, the owner takes from front, thieves from the back
+    int front;
+    int count;
+    struct item *items;
+};
+
+struct stealBuffer{
+    struct boundedBuffer base;
+    // one deque per consumer, each with dequeSlots slots
+    int numDeques;
+    int dequeSlots;
+    struct stealDeque *deques;
+    // consumers with nothing to take wait on idle
+    pthread_mutex_t idleMutex;
+    struct waitPoint idle;
+    atomic_int sleepers;
+};
+
+// number of batches the calling producer has handed out, for -d rr
+__thread unsigned int rrCount;
+
+//+
+// Function: stealCreate
+//
+// Purpose:  Allocates a deque for each consumer, splitting numSlots
+//           between them. Every deque gets at least one slot.
+//-
+
+struct boundedBuffer * stealCreate(int numSlots, int numProducers, int numConsumers){
+    struct stealBuffer *sb = calloc(1, sizeof(struct stealBuffer));
+    if (sb == NULL){
+        perror("stealCreate");
+        exit(1);
+    }
+    sb->numDeques = numConsumers;
+    sb->dequeSlots = (numSlots + numConsumers - 1) / numConsumers;
+    sb->deques = aligned_alloc(CACHE_LINE, numConsumers * sizeof(struct stealDeque));
+    if (sb->deques == NULL){
+        perror("stealCreate");
+        exit(1);
+    }
+    memset(sb->deques, 0, numConsumers * sizeof(struct stealDeque));
+    for (int i = 0; i < numConsumers; i++){
+        struct stealDeque *dq = &sb->deques[i];
+        if ((dq->items = calloc(sb->dequeSlots, sizeof(struct item))) == NULL){
+            fprintf(stderr, "stealCreate: can't allocate %d slots: %s\n", numSlots, strerror(errno));
+            exit(1);
+        }
+        pthread_mutex_init(&dq->mutex, NULL);
+        waitInit(&dq->notFull);
+    }
+    pthread_mutex_init(&sb->idleMutex, NULL);
+    waitInit(&sb->idle);
+    sb->base.numSlots = sb->dequeSlots * numConsumers;
+    return &sb->base;
+}
+
+//+
+// Function: stealWake
+//
+// Purpose:  Wakes one sleeping consumer, if there are any, after values were
+//           pushed. The push is visible to any consumer that went to sleep
+//           before the load of sleepers, since a consumer checks the deques
+//           after counting itself as a sleeper. Must not be called with a
+//           deque locked.
+//-
+
+void stealWake(struct stealBuffer *sb){
+    if (atomic_load(&sb->sleepers) > 0){
+        pthread_mutex_lock(&sb->idleMutex);
+        waitWake(&sb->idle, 0);
+        pthread_mutex_unlock(&sb->idleMutex);
+    }
+}
+
+//+
+// Function: dequePush
+//
+// Purpose:  Adds count values to the back of deque d, then wakes a sleeping
+//           consumer. When the deque has no room the consumers are woken
+//           first, since they may all be asleep, and the producer waits on
+//           notFull.
+//-
+
+void dequePush(struct stealBuffer *sb, int d, int threadNum, int lineNo, const struct item *items, int count){
+    struct stealDeque *dq = &sb->deques[d];
+    int added = 0;
+
+    pthread_mutex_lock(&dq->mutex);
+    TRACE(TR_PROD_LOCK, threadNum, d * sb->dequeSlots, lineNo, items[0].value);
+    while (added < count){
+        if (dq->count == sb->dequeSlots){
+            TRACE(TR_PROD_FULL, threadNum, d * sb->dequeSlots, lineNo + added, items[added].value);
+            uint64_t start = nowNs();
+            pthread_mutex_unlock(&dq->mutex);
+            stealWake(sb);
+            ownerWake(&sb->base);
+            pthread_mutex_lock(&dq->mutex);
+            dq->fullWaiters++;
+            while (dq->count == sb->dequeSlots){
+                waitOn(&dq->notFull, &dq->mutex, &sb->base);
+            }
+            dq->fullWaiters--;
+            recordWait(&sb->base.fullWaits, &sb->base.fullWaitNs, start);
+        }
+        int pos = (dq->front + dq->count) % sb->dequeSlots;
+        TRACE(TR_PROD_ADD, threadNum, d * sb->dequeSlots + pos, lineNo + added, items[added].value);
+        while (added < count && dq->count < sb->dequeSlots){
+            dq->items[pos] = items[added++];
+            pos = (pos + 1) % sb->dequeSlots;
+            dq->count++;
+        }
+    }
+    pthread_mutex_unlock(&dq->mutex);
+    TRACE(TR_PROD_RELEASE, threadNum, -1, lineNo + count - 1, items[count - 1].value);
+    stealWake(sb);
+}
+
+//+
+// Function: stealPut
+//
+// Purpose:  Hands a batch of values to the consumers' deques. With -d rr
+//           the whole batch goes to the next deque in turn, starting from
+//           a different deque for each producer. With -d hash every value
+//           goes to the deque its hash picks, in runs of values that pick
+//           the same deque.
+//-
+
+void stealPut(struct boundedBuffer *buf, int threadNum, int lineNo, const struct item *items, int count){
+    struct stealBuffer *sb = (struct stealBuffer *) buf;
+
+    if (stealDispatch == DISPATCH_RR){
+        dequePush(sb, (threadNum + rrCount++) % sb->numDeques, threadNum, lineNo, items, count);
+        return;
+    }
+    int i = 0;
+    while (i < count){
+        int d = (uint32_t) items[i].value * 2654435761u % sb->numDeques;
+        int run = 1;
+        while (i + run < count && (uint32_t) items[i + run].value * 2654435761u % sb->numDeques == d){
+            run++;
+        }
+        dequePush(sb, d, threadNum, lineNo + i, items + i, run);
+        i += run;
+    }
+}
+
+//+
+// Function: dequeTake
+//
+// Purpose:  Removes up to maxCount values from deque d. The owner takes from
+//           the front. A thief takes from the back, at most half of what is
+//           there (rounded up), so the owner keeps the older values. The
+//           values keep their order either way.
+//
+// Returns:  the number of values removed
+//-
+
+int dequeTake(struct stealBuffer *sb, int d, int thief, struct item *items, int maxCount, int *location){
+    struct stealDeque *dq = &sb->deques[d];
+    int take;
+    int first;
+
+    pthread_mutex_lock(&dq->mutex);
+    if (dq->count == 0){
+        pthread_mutex_unlock(&dq->mutex);
+        return 0;
+    }
+    if (thief){
+        take = (dq->count + 1) / 2;
+        take = take < maxCount ? take : maxCount;
+        first = (dq->front + dq->count - take) % sb->dequeSlots;
+    } else {
+        take = dq->count < maxCount ? dq->count : maxCount;
+        first = dq->front;
+        dq->front = (dq->front + take) % sb->dequeSlots;
+    }
+    for (int i = 0; i < take; i++){
+        items[i] = dq->items[(first + i) % sb->dequeSlots];
+    }
+    dq->count -= take;
+    if (dq->fullWaiters > 0){
+        waitWake(&dq->notFull, 1);
+    }
+    pthread_mutex_unlock(&dq->mutex);
+    *location = d * sb->dequeSlots + first;
+    return take;
+}
+
+//+
+// Function: stealTake
+//
+// Purpose:  Takes values from the calling consumer's own deque, or failing
+//           that steals from the peers, starting with the next one along.
+//
+// Returns:  the number of values taken, 0 if every deque was empty
+//-
+
+int stealTake(struct stealBuffer *sb, int threadNum, struct item *items, int maxCount, int *location){
+    int self = threadNum % sb->numDeques;
+    int count = dequeTake(sb, self, 0, items, maxCount, location);
+
+    for (int k = 1; count == 0 && k < sb->numDeques; k++){
+        int victim = (self + k) % sb->numDeques;
+        if ((count = dequeTake(sb, victim, 1, items, maxCount, location)) > 0){
+            TRACE(TR_CONS_STEAL, threadNum, *location, count, victim);
+        }
+    }
+    return count;
+}
+
+//+
+// Function: stealGet
+//
+// Purpose:  Removes up to maxCount values, from the consumer's own deque or
+//           stolen from a peer, sleeping on idle while every deque is empty
+//           and there are producers that may still add to them.
+//-
+
+int stealGet(struct boundedBuffer *buf, int threadNum, struct item *items, int maxCount, int *location){
+    struct stealBuffer *sb = (struct stealBuffer *) buf;
+
+    while (1){
+        // a producer only leaves after its last push, so once none are
+        // running a sweep that finds nothing means the stream has ended
+        int running = atomic_load(&buf->numProdRunning);
+        int count = stealTake(sb, threadNum, items, maxCount, location);
+        if (count > 0){
+            return count;
+        }
+        if (running == 0 || takeRetire(buf)){
+            return 0;
+        }
+
+        // check again as a sleeper, so a push after the check wakes us
+        pthread_mutex_lock(&sb->idleMutex);
+        atomic_fetch_add(&sb->sleepers, 1);
+        int any = 0;
+        for (int d = 0; d < sb->numDeques && !any; d++){
+            pthread_mutex_lock(&sb->deques[d].mutex);
+            any = sb->deques[d].count > 0;
+            pthread_mutex_unlock(&sb->deques[d].mutex);
+        }
+        if (!any && buf->numProdRunning > 0 && buf->retiring == 0){
+            TRACE(TR_CONS_EMPTY, threadNum, threadNum * sb->dequeSlots, 0, 0);
+            uint64_t start = nowNs();
+            waitOn(&sb->idle, &sb->idleMutex, buf);
+            recordWait(&buf->emptyWaits, &buf->emptyWaitNs, start);
+        }
+        atomic_fetch_sub(&sb->sleepers, 1);
+        pthread_mutex_unlock(&sb->idleMutex);
+    }
+}
+
+//+
+// Function: stealTryGet
+//
+// Purpose:  Takes values from the consumer's own deque or a peer's, without
+//           waiting when they are all empty.
+//-
+
+int stealTryGet(struct boundedBuffer *buf, int threadNum, struct item *items, int maxCount, int *location){
+    int running = atomic_load(&buf->numProdRunning);
+    int count = stealTake((struct stealBuffer *) buf, threadNum, items, maxCount, location);
+    if (count > 0){
+        return count;
+    }
+    return running == 0 ? -1 : 0;
+}
+
+//+
+// Function: stealProducerDone
+//
+// Purpose:  Decrements the number of running producers, and wakes every
+//           sleeping consumer when the last one leaves.
+//-
+
+void stealProducerDone(struct boundedBuffer *buf, int threadNum){
+    struct stealBuffer *sb = (struct stealBuffer *) buf;
+
+    pthread_mutex_lock(&sb->idleMutex);
+    if (atomic_fetch_sub(&buf->numProdRunning, 1) == 1){
+        waitWake(&sb->idle, 1);
+    }
+    pthread_mutex_unlock(&sb->idleMutex);
+}
+
+//+
+// Function: stealOccupancy
+//
+// Purpose:  Returns the number of values in all the deques.
+//-
+
+int stealOccupancy(struct boundedBuffer *buf){
+    struct stealBuffer *sb = (struct stealBuffer *) buf;
+    int count = 0;
+
+    for (int d = 0; d < sb->numDeques; d++){
+        pthread_mutex_lock(&sb->deques[d].mutex);
+        count += sb->deques[d].count;
+        pthread_mutex_unlock(&sb->deques[d].mutex);
+    }
+    return count;
+}
+
+//+
+// Function: stealRetire
+//
+// Purpose:  Asks one consumer to leave, waking a sleeping consumer so that
+//           it can.
+//-
+
+void stealRetire(struct boundedBuffer *buf){
+    struct stealBuffer *sb = (struct stealBuffer *) buf;
+
+    pthread_mutex_lock(&sb->idleMutex);
+    atomic_fetch_add(&buf->retiring, 1);
+    waitWake(&sb->idle, 0);
+    pthread_mutex_unlock(&sb->idleMutex);
+}
+
+// List backends and their operations
+// Must be terminated by {NULL, ...}
+struct bufferOps backends[] = {
+    {"mutex", mutexCreate, mutexPut, mutexGet, mutexProducerDone, mutexTryGet, mutexOccupancy, mutexRetire},
+    {"lockfree", lockFreeCreate, lockFreePut, lockFreeGet, lockFreeProducerDone, lockFreeTryGet,
+     lockFreeOccupancy, lockFreeRetire},
+    {"steal", stealCreate, stealPut, stealGet, stealProducerDone, stealTryGet, stealOccupancy, stealRetire},
+    {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL}     // Terminator
+};
+
+//+
+// Function: findBackend
+//
+// Purpose:  Looks up a backend by name.
+//
+// Returns:  the operations for the backend, NULL if there is no such backend
+//-
+
+const struct bufferOps * findBackend(const char *name){
+    for (int i = 0; backends[i].name != NULL; i++){
+        if (strcmp(backends[i].name, name) == 0){
+            return &backends[i];
+        }
+    }
+    return NULL;
+}
+
+/////////////////////////////// Sharded Buffers ///////////////////////////////
+
+//+
+// Sharded buffers
+//
+// With -k K the buffer is split into K shards of the chosen backend, each
+// with its share of the slots. Producer p only puts into shard p % K, so a
+// shard's lock or head is shared by a fraction of the producers. Consumers
+// sweep every shard without waiting, starting from a different shard each
+// time so they spread out, and only sleep on the idle condition when the
+// sweep finds nothing. Producers signal idle when someone is asleep, the
+// same way the steal backend does.
+//
+// Priority lanes (-L) use the same wrapper with a shard per class, each
+// with the full number of slots. Producers put each value into the lane
+// of its class (see itemClass), and consumers sweep from the highest class
+// down. So that a busy higher lane can't starve the bulk lane (class 0),
+// after laneStarve sweeps in a row won by a higher lane a consumer tries
+// the bulk lane first.
+//-
+
+// most priority classes
+#define MAX_LANES 4
+
+struct shardBuffer{
+    struct boundedBuffer base;
+    int numShards;
+    struct boundedBuffer **shards;
+    // the shards are priority lanes, every producer putting into each
+    int byClass;
+    // consumers with nothing to take in any shard wait on idle
+    pthread_mutex_t idleMutex;
+    struct waitPoint idle;
+    atomic_int sleepers;
+};
+
+// number of sweeps the calling consumer has made, to rotate the first shard
+__thread unsigned int sweepCount;
+// sweeps in a row the calling consumer took from a lane above the bulk lane
+__thread int laneSkips;
+
+//+
+// Function: shardCreate
+//
+// Purpose:  Creates numShards buffers of the backend ops, splitting numSlots
+//           between them. Shard s is given the producers numbered s, s + K,
+//           ... as its own producers, numbered from 0. With byClass the
+//           shards are lanes, and each has numSlots and every producer.
+//-
+
+struct boundedBuffer * shardCreate(const struct bufferOps *ops, int numShards, int numSlots, int numProducers,
+                                   int numConsumers, int byClass){
+    struct shardBuffer *sh = calloc(1, sizeof(struct shardBuffer));
+    if (sh == NULL || (sh->shards = calloc(numShards, sizeof(struct boundedBuffer *))) == NULL){
+        perror("shardCreate");
+        exit(1);
+    }
+    int shardSlots = byClass ? numSlots : (numSlots + numShards - 1) / numShards;
+    sh->numShards = numShards;
+    sh->byClass = byClass;
+    for (int s = 0; s < numShards; s++){
+        int shardProducers = byClass ? numProducers : numProducers / numShards + (s < numProducers % numShards);
+        sh->shards[s] = ops->create(shardSlots, shardProducers > 0 ? shardProducers : 1, numConsumers);
+        sh->shards[s]->ops = ops;
+        sh->shards[s]->owner = &sh->base;
+        atomic_store(&sh->shards[s]->numProdRunning, shardProducers);
+    }
+    pthread_mutex_init(&sh->idleMutex, NULL);
+    waitInit(&sh->idle);
+    sh->base.numSlots = sh->shards[0]->numSlots * numShards;
+    return &sh->base;
+}
+
+//+
+// Function: shardWake
+//
+// Purpose:  Wakes one sleeping consumer, if there are any, after values were
+//           put. The fence pairs with the one in shardGet, so either the
+//           consumer's sweep sees the values or the load here sees it
+//           asleep.
+//-
+
+void shardWake(struct shardBuffer *sh){
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&sh->sleepers) > 0){
+        pthread_mutex_lock(&sh->idleMutex);
+        waitWake(&sh->idle, 0);
+        pthread_mutex_unlock(&sh->idleMutex);
+    }
+}
+
+//+
+// Function: ownerWake
+//
+// Purpose:  Wakes a consumer sleeping on the sharded buffer that buf is a
+//           shard of, if it is one. Called by a producer about to wait on a
+//           full shard, since the values it has added so far haven't been
+//           announced. Must not be called with a lock of buf held.
+//-
+
+void ownerWake(struct boundedBuffer *buf){
+    if (buf->owner != NULL){
+        shardWake((struct shardBuffer *) buf->owner);
+    }
+}
+
+//+
+// Function: shardPutIn
+//
+// Purpose:  Adds count values to one shard, at most a shard's worth at a
+//           time. threadNum is the producer's number in the shard.
+//-
+
+void shardPutIn(struct shardBuffer *sh, struct boundedBuffer *shard, int threadNum, int lineNo,
+                const struct item *items, int count){
+    while (count > 0){
+        int chunk = count < shard->numSlots ? count : shard->numSlots;
+        shard->ops->put(shard, threadNum, lineNo, items, chunk);
+        shardWake(sh);
+        items += chunk;
+        lineNo += chunk;
+        count -= chunk;
+    }
+}
+
+//+
+// Function: shardPut
+//
+// Purpose:  Adds count values to the producer's shard, or with lanes each
+//           run of values of one class to the lane of that class.
+//-
+
+void shardPut(struct boundedBuffer *buf, int threadNum, int lineNo, const struct item *items, int count){
+    struct shardBuffer *sh = (struct shardBuffer *) buf;
+
+    if (!sh->byClass){
+        shardPutIn(sh, sh->shards[threadNum % sh->numShards], threadNum / sh->numShards, lineNo, items, count);
+        return;
+    }
+    int i = 0;
+    while (i < count){
+        int lane = itemClass(&items[i]);
+        int run = 1;
+        while (i + run < count && itemClass(&items[i + run]) == lane){
+            run++;
+        }
+        shardPutIn(sh, sh->shards[lane], threadNum, lineNo + i, items + i, run);
+        i += run;
+    }
+}
+
+//+
+// Function: shardSweep
+//
+// Purpose:  Tries every shard once, starting from one that moves along with
+//           each sweep. Lanes are tried from the highest class down, but
+//           after laneStarve sweeps in a row taken from a higher lane the
+//           bulk lane is tried first.
+//
+// Returns:  the number of values taken, 0 if every shard was empty, -1 if
+//           every shard has also ended
+//-
+
+int shardSweep(struct shardBuffer *sh, int threadNum, struct item *items, int maxCount, int *location){
+    int first = (threadNum + sweepCount++) % sh->numShards;
+    int bulkFirst = laneSkips >= laneStarve;
+    int ended = 0;
+
+    for (int k = 0; k < sh->numShards; k++){
+        int s = (first + k) % sh->numShards;
+        if (sh->byClass){
+            s = bulkFirst ? (k == 0 ? 0 : sh->numShards - k) : sh->numShards - 1 - k;
+        }
+        struct boundedBuffer *shard = sh->shards[s];
+        int count = shard->ops->tryGet(shard, threadNum, items, maxCount, location);
+        if (count > 0){
+            *location += s * shard->numSlots;
+            if (sh->byClass){
+                laneSkips = s == 0 ? 0 : laneSkips + 1;
+            }
+            return count;
+        }
+        ended += count < 0;
+    }
+    return ended == sh->numShards ? -1 : 0;
+}
+
+//+
+// Function: shardGet
+//
+// Purpose:  Removes up to maxCount values from whichever shard has some,
+//           sleeping on idle while every shard is empty and there are
+//           producers that may still add to them.
+//-
+
+int shardGet(struct boundedBuffer *buf, int threadNum, struct item *items, int maxCount, int *location){
+    struct shardBuffer *sh = (struct shardBuffer *) buf;
+
+    while (1){
+        int count = shardSweep(sh, threadNum, items, maxCount, location);
+        if (count != 0){
+            return count > 0 ? count : 0;
+        }
+        if (takeRetire(buf)){
+            return 0;
+        }
+
+        // sweep again as a sleeper, so a put after the sweep wakes us
+        pthread_mutex_lock(&sh->idleMutex);
+        atomic_fetch_add(&sh->sleepers, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        count = shardSweep(sh, threadNum, items, maxCount, location);
+        if (count == 0 && buf->numProdRunning > 0 && buf->retiring == 0){
+            TRACE(TR_CONS_EMPTY, threadNum, -1, 0, 0);
+            uint64_t start = nowNs();
+            waitOn(&sh->idle, &sh->idleMutex, buf);
+            recordWait(&buf->emptyWaits, &buf->emptyWaitNs, start);
+        }
+        atomic_fetch_sub(&sh->sleepers, 1);
+        pthread_mutex_unlock(&sh->idleMutex);
+        if (count != 0){
+            return count > 0 ? count : 0;
+        }
+    }
+}
+
+//+
+// Function: shardTryGet
+//
+// Purpose:  Removes up to maxCount values from whichever shard has some,
+//           without waiting.
+//-
+
+int shardTryGet(struct boundedBuffer *buf, int threadNum, struct item *items, int maxCount, int *location){
+    return shardSweep((struct shardBuffer *) buf, threadNum, items, maxCount, location);
+}
+
+//+
+// Function: shardProducerDone
+//
+// Purpose:  Tells the producer's shard, or every lane, that it has
+//           finished, then wakes every sleeping consumer so they sweep
+//           again and can see shards that have ended.
+//-
+
+void shardProducerDone(struct boundedBuffer *buf, int threadNum){
+    struct shardBuffer *sh = (struct shardBuffer *) buf;
+
+    for (int s = 0; s < sh->numShards; s++){
+        struct boundedBuffer *shard = sh->shards[s];
+        if (sh->byClass){
+            shard->ops->producerDone(shard, threadNum);
+        } else if (s == threadNum % sh->numShards){
+            shard->ops->producerDone(shard, threadNum / sh->numShards);
+        }
+    }
+    pthread_mutex_lock(&sh->idleMutex);
+    atomic_fetch_sub(&buf->numProdRunning, 1);
+    waitWake(&sh->idle, 1);
+    pthread_mutex_unlock(&sh->idleMutex);
+}
+
+//+
+// Function: shardOccupancy
+//
+// Purpose:  Returns the number of values in all the shards.
+//-
+
+int shardOccupancy(struct boundedBuffer *buf){
+    struct shardBuffer *sh = (struct shardBuffer *) buf;
+    int count = 0;
+
+    for (int s = 0; s < sh->numShards; s++){
+        count += sh->shards[s]->ops->occupancy(sh->shards[s]);
+    }
+    return count;
+}
+
+//+
+// Function: shardRetire
+//
+// Purpose:  Asks one consumer to leave, waking a sleeping consumer so that
+//           it can.
+//-
+
+void shardRetire(struct boundedBuffer *buf){
+    struct shardBuffer *sh = (struct shardBuffer *) buf;
+
+    pthread_mutex_lock(&sh->idleMutex);
+    atomic_fetch_add(&buf->retiring, 1);
+    waitWake(&sh->idle, 0);
+    pthread_mutex_unlock(&sh->idleMutex);
+}
+
+// Operations of a sharded buffer, whatever the backend of its shards. The
+// shards are created by shardCreate, not through create
+const struct bufferOps shardOps = {"sharded", NULL, shardPut, shardGet, shardProducerDone, shardTryGet,
+                                   shardOccupancy, shardRetire};
+
+//+
+// Function: bufferCreate
+//
+// Purpose:  Creates a buffer of the given backend, split into numShards
+//           shards or numLanes lanes when there is more than one.
+//-
+
+struct boundedBuffer * bufferCreate(const struct bufferOps *ops, int numSlots, int numProducers, int numConsumers){
+    struct boundedBuffer *buf;
+
+    if (numLanes > 1){
+        buf = shardCreate(ops, numLanes, numSlots, numProducers, numConsumers, 1);
+        buf->ops = &shardOps;
+    } else if (numShards > 1){
+        buf = shardCreate(ops, numShards, numSlots, numProducers, numConsumers, 0);
+        buf->ops = &shardOps;
+    } else {
+        buf = ops->create(numSlots, numProducers, numConsumers);
+        buf->ops = ops;
+    }
+    return buf;
+}
+
+/////////////////////////////////// Latency ///////////////////////////////////
+
+//+
+// Latency histogram
+//
+// Latencies in nanoseconds are counted in buckets that are linear below 16ns
+// and then split each power of two into 16 equal buckets, so a percentile
+// read back from the histogram is within about 6% of the true value.
+//-
+
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct latHist{
+    uint64_t total;
+    uint64_t count[HIST_BUCKETS];
+};
+
+//+
+// Function: histAdd
+//
+// Purpose:  Counts one latency of ns nanoseconds.
+//-
+
+void histAdd(struct latHist *hist, uint64_t ns){
+    int bucket;
+    if (ns < HIST_SUB){
+        bucket = ns;
+    } else {
+        int exp = 63 - __builtin_clzll(ns);
+        bucket = (exp - 3) * HIST_SUB + ((ns >> (exp - 4)) & (HIST_SUB - 1));
+    }
+    hist->count[bucket]++;
+    hist->total++;
+}
+
+//+
+// Function: histMerge
+//
+// Purpose:  Adds the counts of src into dst.
+//-
+
+void histMerge(struct latHist *dst, const struct latHist *src){
+    for (int i = 0; i < HIST_BUCKETS; i++){
+        dst->count[i] += src->count[i];
+    }
+    dst->total += src->total;
+}
+
+//+
+// Function: histPercentile
+//
+// Purpose:  Returns the smallest latency of the bucket holding the q'th
+//           quantile (0 < q <= 1), 0 for an empty histogram.
+//-
+
+uint64_t histPercentile(const struct latHist *hist, double q){
+    uint64_t target = (uint64_t) (q * hist->total + 0.5);
+    uint64_t seen = 0;
+    if (target == 0){
+        target = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++){
+        seen += hist->count[i];
+        if (seen >= target){
+            if (i < HIST_SUB){
+                return i;
+            }
+            return (uint64_t) (HIST_SUB + i % HIST_SUB) << (i / HIST_SUB - 1);
+        }
+    }
+    return 0;
+}
+
+//+
+// Function: reportLanes
+//
+// Purpose:  Prints the number of values and the latency percentiles of each
+//           class, from numHists histograms per class laid out MAX_LANES
+//           to a consumer.
+//-
+
+void reportLanes(const struct latHist *hists, int numHists){
+    struct latHist *merged = calloc(1, sizeof(struct latHist));
+    if (merged == NULL){
+        perror("reportLanes");
+        exit(1);
+    }
+    for (int c = numLanes - 1; c >= 0; c--){
+        memset(merged, 0, sizeof(struct latHist));
+        for (int i = 0; i < numHists; i++){
+            histMerge(merged, &hists[i * MAX_LANES + c]);
+        }
+        printf("Main: class %d, %lu values, latency p50 %lu ns, p99 %lu ns, p999 %lu ns\n", c,
+               merged->total, histPercentile(merged, 0.50), histPercentile(merged, 0.99),
+               histPercentile(merged, 0.999));
+    }
+    free(merged);
+}
+
+/////////////////////////////////// Output ////////////////////////////////////
+
+//+
+// Output writer
+//
+// Each consumer formats its values into a large buffer of its own and
+// writes the buffer out in one block when it fills, instead of a printf and
+// an fprintf per value. Values are written as text lines, or with -F binary
+// as 4 byte little-endian records. Copying the values to stdout is only done
+// with -e.
+//-
+
+#define WRITE_BUFSIZE (1 << 16)
+// longest text or binary record
+#define MAX_RECORD 12
+
+struct outWriter{
+    int fd;
+    // also write the output to stdout
+    int echo;
+    // 4 byte records instead of text
+    int binary;
+    char *buf;
+    size_t len;
+};
+
+// "00" to "99", so itoa can convert two digits at a time
+const char digitPairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+//+
+// Function: writeAll
+//
+// Purpose:  Writes len bytes to fd, continuing after partial writes.
+//-
+
+void writeAll(int fd, const char *data, size_t len){
+    while (len > 0){
+        ssize_t done = write(fd, data, len);
+        if (done < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        data += done;
+        len -= done;
+    }
+}
+
+//+
+// Function: formatInt
+//
+// Purpose:  Writes value in decimal followed by a newline to out, which must
+//           have room for MAX_RECORD bytes.
+//
+// Returns:  the number of bytes written
+//-
+
+int formatInt(char *out, int value){
+    char digits[MAX_RECORD];
+    char *p = digits + sizeof(digits);
+    unsigned int u = value < 0 ? 0u - (unsigned int) value : (unsigned int) value;
+
+    *--p = '\n';
+    while (u >= 100){
+        unsigned int pair = (u % 100) * 2;
+        u /= 100;
+        *--p = digitPairs[pair + 1];
+        *--p = digitPairs[pair];
+    }
+    if (u >= 10){
+        *--p = digitPairs[u * 2 + 1];
+        *--p = digitPairs[u * 2];
+    } else {
+        *--p = '0' + u;
+    }
+    if (value < 0){
+        *--p = '-';
+    }
+    int len = digits + sizeof(digits) - p;
+    memcpy(out, p, len);
+    return len;
+}
+
+//+
+// Function: writerOpen
+//
+// Purpose:  Creates fileName, or with append adds to the end of it, and
+//           sets up a writer for it.
+//
+// Returns:  0 on success, -1 with errno set on failure
+//-
+
+int writerOpen(struct outWriter *w, const char *fileName, int binary, int echo, int append){
+    if ((w->fd = open(fileName, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0666)) < 0){
+        return -1;
+    }
+    if ((w->buf = malloc(WRITE_BUFSIZE)) == NULL){
+        close(w->fd);
+        return -1;
+    }
+    w->len = 0;
+    w->binary = binary;
+    w->echo = echo;
+    return 0;
+}
+
+//+
+// Function: writerFlush
+//
+// Purpose:  Writes out the buffered output.
+//-
+
+void writerFlush(struct outWriter *w){
+    if (w->len == 0){
+        return;
+    }
+    writeAll(w->fd, w->buf, w->len);
+    if (w->echo){
+        // keep the echo in order with what has been printed
+        fflush(stdout);
+        writeAll(STDOUT_FILENO, w->buf, w->len);
+    }
+    w->len = 0;
+}
+
+//+
+// Function: writerPut
+//
+// Purpose:  Adds one value to the output.
+//-
+
+void writerPut(struct outWriter *w, int value){
+    if (w->len > WRITE_BUFSIZE - MAX_RECORD){
+        writerFlush(w);
+    }
+    if (w->binary){
+        unsigned char *rec = (unsigned char *) w->buf + w->len;
+        uint32_t u = value;
+        rec[0] = u;
+        rec[1] = u >> 8;
+        rec[2] = u >> 16;
+        rec[3] = u >> 24;
+        w->len += 4;
+    } else {
+        w->len += formatInt(w->buf + w->len, value);
+    }
+}
+
+//+
+// Function: writerPutv
+//
+// Purpose:  Writes the count blocks of iov to the output, after anything
+//           already buffered, without copying them. The blocks have been
+//           written out when it returns.
+//-
+
+void writerPutv(struct outWriter *w, struct iovec *iov, int count){
+    writerFlush(w);
+    if (w->echo){
+        fflush(stdout);
+    }
+    for (int fd = w->fd; ; fd = STDOUT_FILENO){
+        struct iovec *next = iov;
+        int left = count;
+        while (left > 0){
+            ssize_t done = writev(fd, next, left);
+            if (done < 0){
+                if (errno == EINTR){
+                    continue;
+                }
+                perror("writev");
+                exit(1);
+            }
+            // skip the blocks written, and the written part of the next
+            while (left > 0 && (size_t) done >= next->iov_len){
+                done -= next->iov_len;
+                next++;
+                left--;
+            }
+            if (left > 0 && done > 0){
+                // finish the block here, leaving the caller's blocks as they were
+                writeAll(fd, (char *) next->iov_base + done, next->iov_len - done);
+                next++;
+                left--;
+            }
+        }
+        if (!w->echo || fd == STDOUT_FILENO){
+            break;
+        }
+    }
+}
+
+//+
+// Function: writerClose
+//
+// Purpose:  Writes out the rest of the output and closes the file.
+//-
+
+void writerClose(struct outWriter *w){
+    writerFlush(w);
+    close(w->fd);
+    free(w->buf);
+}
+
+/////////////////////////////////// Records ///////////////////////////////////
+
+//+
+// Records
+//
+// With -r the producers move whole lines, such as log records, instead of
+// the values atoi makes of them. Each producer has a slab of slabBytes
+// bytes that it copies its lines into, one after the other, wrapping around
+// at the end. Only a descriptor goes through the buffer: the producer in
+// prodNum, the offset of the record in value and its length in len. The
+// consumers write the lines straight from the slab with writev, and then
+// mark the records done.
+//
+// Each record starts with a header giving its size, so the producer can
+// reclaim space in the order it was used, stopping at the first record
+// that isn't done yet. A record never wraps: if it doesn't fit before the
+// end of the slab, the rest of the slab is skipped with a record that is
+// already done. A producer waits on space when the bytes still in flight
+// leave no room for its next record, so it is the bytes, not the buffer
+// slots, that hold back the producers.
+//-
+
+// longest record, longer lines are split
+#define MAX_RECORD_LEN (1 << 16)
+// smallest slab, a few of the longest records
+#define MIN_SLAB_BYTES (4 * MAX_RECORD_LEN)
+// largest slab, so an offset into it fits in the int value of an item
+#define MAX_SLAB_BYTES (1L << 30)
+// most slots given to the buffer when -s doesn't say, past which the slots
+// rather than the bytes hold back producers of very short records
+#define MAX_RECORD_SLOTS (1 << 22)
+// records start on this boundary
+#define RECORD_ALIGN 8
+
+struct recordHeader{
+    // set by the consumer once the record is written
+    atomic_uint done;
+    // bytes of slab used, the header and the padded line
+    uint32_t size;
+};
+
+struct recordSlab{
+    char *data;
+    size_t size;
+    // bytes ever used and reclaimed, head - tail are in flight. Only the
+    // producer moves them
+    size_t head;
+    size_t tail;
+    size_t peakBytes;
+    // the producer waits on space for consumers to finish records
+    pthread_mutex_t mutex;
+    struct waitPoint space;
+    atomic_int waiting;
+    atomic_long spaceWaits;
+    atomic_long spaceWaitNs;
+};
+
+// the slab of each producer in record mode, by producer number
+struct recordSlab *recordSlabs;
+
+//+
+// Function: slabsCreate
+//
+// Purpose:  Allocates a slab of size bytes for each producer.
+//-
+
+struct recordSlab * slabsCreate(int numProducers, size_t size){
+    struct recordSlab *slabs = calloc(numProducers, sizeof(struct recordSlab));
+    if (slabs == NULL){
+        perror("slabsCreate");
+        exit(1);
+    }
+    for (int i = 0; i < numProducers; i++){
+        // the headers are read and written as atomics
+        if ((slabs[i].data = aligned_alloc(CACHE_LINE, size)) == NULL){
+            perror("slabsCreate");
+            exit(1);
+        }
+        slabs[i].size = size;
+        pthread_mutex_init(&slabs[i].mutex, NULL);
+        waitInit(&slabs[i].space);
+    }
+    return slabs;
+}
+
+//+
+// Function: slabReclaim
+//
+// Purpose:  Frees the records at the tail of the slab that are done, up to
+//           the first one that isn't. Only called by the producer.
+//-
+
+void slabReclaim(struct recordSlab *slab){
+    while (slab->tail != slab->head){
+        struct recordHeader *hdr = (struct recordHeader *) (slab->data + slab->tail % slab->size);
+        if (!atomic_load_explicit(&hdr->done, memory_order_acquire)){
+            break;
+        }
+        slab->tail += hdr->size;
+    }
+}
+
+//+
+// Function: recordSize
+//
+// Purpose:  Returns the bytes of slab a line of len bytes takes.
+//-
+
+size_t recordSize(size_t len){
+    return sizeof(struct recordHeader) + (len + RECORD_ALIGN - 1) / RECORD_ALIGN * RECORD_ALIGN;
+}
+
+//+
+// Function: slabRoom
+//
+// Purpose:  Checks whether a line of len bytes fits in the slab, after
+//           reclaiming what it can. Only called by the producer.
+//
+// Returns:  1 if it fits, 0 if it would have to wait
+//-
+
+int slabRoom(struct recordSlab *slab, size_t len){
+    size_t need = recordSize(len);
+    size_t pos = slab->head % slab->size;
+    // the rest of the slab is skipped when the record doesn't fit
+    size_t skip = pos + need > slab->size ? slab->size - pos : 0;
+
+    slabReclaim(slab);
+    return slab->head - slab->tail + skip + need <= slab->size;
+}
+
+//+
+// Function: slabReserve
+//
+// Purpose:  Makes room for a line of len bytes at the head of the slab,
+//           waiting while too many bytes are in flight. The line is then
+//           copied in after the header. buf is where waits are counted.
+//
+// Returns:  the offset of the record
+//-
+
+size_t slabReserve(struct recordSlab *slab, size_t len, struct boundedBuffer *buf){
+    size_t need = recordSize(len);
+    uint64_t start = 0;
+
+    while (!slabRoom(slab, len)){
+        if (!start){
+            start = nowNs();
+        }
+        // check again as a waiter, so a record finished after the check
+        // wakes us
+        pthread_mutex_lock(&slab->mutex);
+        atomic_store(&slab->waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!slabRoom(slab, len)){
+            waitOn(&slab->space, &slab->mutex, buf);
+        }
+        atomic_store(&slab->waiting, 0);
+        pthread_mutex_unlock(&slab->mutex);
+    }
+    if (start){
+        recordWait(&slab->spaceWaits, &slab->spaceWaitNs, start);
+    }
+
+    size_t pos = slab->head % slab->size;
+    if (pos + need > slab->size){
+        struct recordHeader *hdr = (struct recordHeader *) (slab->data + pos);
+        hdr->size = slab->size - pos;
+        atomic_store_explicit(&hdr->done, 1, memory_order_relaxed);
+        slab->head += slab->size - pos;
+        pos = 0;
+    }
+    struct recordHeader *hdr = (struct recordHeader *) (slab->data + pos);
+    hdr->size = need;
+    atomic_store_explicit(&hdr->done, 0, memory_order_relaxed);
+    slab->head += need;
+    if (slab->head - slab->tail > slab->peakBytes){
+        slab->peakBytes = slab->head - slab->tail;
+    }
+    return pos;
+}
+
+//+
+// Function: slabRelease
+//
+// Purpose:  Marks the record at offset done, and wakes the producer if it
+//           is waiting for space. The fence pairs with the one in
+//           slabReserve, so either the producer sees the record done or
+//           this sees it waiting.
+//-
+
+void slabRelease(struct recordSlab *slab, size_t offset){
+    struct recordHeader *hdr = (struct recordHeader *) (slab->data + offset);
+
+    atomic_store_explicit(&hdr->done, 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&slab->waiting)){
+        pthread_mutex_lock(&slab->mutex);
+        waitWake(&slab->space, 0);
+        pthread_mutex_unlock(&slab->mutex);
+    }
+}
+
+//+
+// Function: recordWrite
+//
+// Purpose:  Writes the lines of count record descriptors straight from the
+//           slabs, then marks the records done.
+//-
+
+void recordWrite(struct outWriter *w, const struct item *items, int count){
+    struct iovec iov[IOV_MAX];
+
+    for (int first = 0; first < count; first += IOV_MAX){
+        int n = count - first < IOV_MAX ? count - first : IOV_MAX;
+        for (int i = 0; i < n; i++){
+            const struct item *it = &items[first + i];
+            iov[i].iov_base = recordSlabs[it->prodNum].data + it->value + sizeof(struct recordHeader);
+            iov[i].iov_len = it->len;
+        }
+        writerPutv(w, iov, n);
+        for (int i = 0; i < n; i++){
+            slabRelease(&recordSlabs[items[first + i].prodNum], items[first + i].value);
+        }
+    }
+}
+
+//+
+// Function: slabsReport
+//
+// Purpose:  Prints how full each slab got and how often its producer
+//           waited for space, then frees the slabs.
+//-
+
+void slabsReport(struct recordSlab *slabs, int numProducers){
+    for (int i = 0; i < numProducers; i++){
+        struct recordSlab *slab = &slabs[i];
+        printf("Main: producer %d slab peaked at %zu of %zu bytes, %ld waits for space (%.3f ms)\n",
+               i, slab->peakBytes, slab->size, (long) slab->spaceWaits, slab->spaceWaitNs / 1e6);
+        free(slab->data);
+        pthread_mutex_destroy(&slab->mutex);
+    }
+    free(slabs);
+}
+
+//////////////////////////////////// Merge ////////////////////////////////////
+
+//+
+// Merge stage
+//
+// With several consumers the order of the values depends on scheduling.
+// With -M the consumers hand their values to a merge stage instead of
+// writing them, and it writes one stream, out<test>.dat, in order:
+//
+//    producer -> each producer's values in line order, the producers
+//                interleaved as their values become ready
+//    global   -> k-way merge of the producers' line ordered streams by
+//                value, which is fully sorted when every input file is
+//
+// Values are tagged with their producer and line number when they are
+// produced. Values that arrive ahead of their turn are held in a min-heap
+// per producer, at most mergeWindow of them in all. When the window is
+// full the merge skips ahead past the missing line, and a value that
+// arrives after it was skipped is written as soon as it arrives.
+//-
+
+#define MERGE_PRODUCER 1
+#define MERGE_GLOBAL 2
+
+// Values held back for one producer, a min-heap on line number
+struct mergeHeap{
+    struct item *items;
+    int count;
+    // next line number to write
+    int nextLine;
+    // the producer has finished, and lastLine is its last line number
+    int done;
+    int lastLine;
+};
+
+struct mergeStage{
+    pthread_mutex_t mutex;
+    int mode;
+    int window;
+    int numProducers;
+    struct mergeHeap *heaps;
+    // values held in all the heaps
+    int held;
+    // values written after a line that came later
+    long late;
+    struct outWriter writer;
+};
+
+//+
+// Function: heapPush
+//
+// Purpose:  Adds an item to a merge heap.
+//-
+
+void heapPush(struct mergeHeap *h, const struct item *it){
+    int i = h->count++;
+    while (i > 0 && h->items[(i - 1) / 2].lineNo > it->lineNo){
+        h->items[i] = h->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->items[i] = *it;
+}
+
+//+
+// Function: heapPop
+//
+// Purpose:  Removes the item with the smallest line number from a merge heap.
+//-
+
+struct item heapPop(struct mergeHeap *h){
+    struct item top = h->items[0];
+    struct item last = h->items[--h->count];
+    int i = 0;
+    while (2 * i + 1 < h->count){
+        int child = 2 * i + 1;
+        if (child + 1 < h->count && h->items[child + 1].lineNo < h->items[child].lineNo){
+            child++;
+        }
+        if (last.lineNo <= h->items[child].lineNo){
+            break;
+        }
+        h->items[i] = h->items[child];
+        i = child;
+    }
+    h->items[i] = last;
+    return top;
+}
+
+//+
+// Function: mergeCreate
+//
+// Purpose:  Creates a merge stage writing fileName. Each heap may hold the
+//           whole window plus one batch from a consumer.
+//-
+
+struct mergeStage * mergeCreate(const char *fileName, int mode, int window, int numProducers){
+    struct mergeStage *m = calloc(1, sizeof(struct mergeStage));
+    if (m == NULL || (m->heaps = calloc(numProducers, sizeof(struct mergeHeap))) == NULL){
+        perror("mergeCreate");
+        exit(1);
+    }
+    for (int i = 0; i < numProducers; i++){
+        if ((m->heaps[i].items = malloc((window + consBatch) * sizeof(struct item))) == NULL){
+            perror("mergeCreate");
+            exit(1);
+        }
+        m->heaps[i].nextLine = 1;
+    }
+    if (writerOpen(&m->writer, fileName, binaryOutput, echoOutput, 0) != 0){
+        perror(fileName);
+        exit(1);
+    }
+    pthread_mutex_init(&m->mutex, NULL);
+    m->mode = mode;
+    m->window = window;
+    m->numProducers = numProducers;
+    return m;
+}
+
+//+
+// Function: mergeEmit
+//
+// Purpose:  Writes the next value of producer p and moves on to its next line.
+//-
+
+void mergeEmit(struct mergeStage *m, int p){
+    struct item it = heapPop(&m->heaps[p]);
+    m->heaps[p].nextLine = it.lineNo + 1;
+    m->held--;
+    writerPut(&m->writer, it.value);
+}
+
+//+
+// Function: mergeDrain
+//
+// Purpose:  Writes every value whose turn has come. force writes at least
+//           one value if any are held, skipping past missing lines.
+//
+// Returns:  1 if a value was written
+//-
+
+int mergeDrain(struct mergeStage *m, int force){
+    int wrote = 0;
+
+    if (m->mode == MERGE_PRODUCER){
+        int fullest = -1;
+        for (int p = 0; p < m->numProducers; p++){
+            struct mergeHeap *h = &m->heaps[p];
+            while (h->count > 0 && h->items[0].lineNo == h->nextLine){
+                mergeEmit(m, p);
+                wrote = 1;
+            }
+            if (h->count > 0 && (fullest < 0 || h->count > m->heaps[fullest].count)){
+                fullest = p;
+            }
+        }
+        if (force && !wrote && fullest >= 0){
+            // skip the gap of the producer holding the most values
+            mergeEmit(m, fullest);
+            return 1;
+        }
+        return wrote;
+    }
+
+    while (1){
+        // the smallest ready head, unless some producer's next line is missing
+        int best = -1;
+        int blocked = 0;
+        for (int p = 0; p < m->numProducers; p++){
+            struct mergeHeap *h = &m->heaps[p];
+            if (h->count > 0 && (h->items[0].lineNo == h->nextLine || force)){
+                if (best < 0 || h->items[0].value < m->heaps[best].items[0].value){
+                    best = p;
+                }
+            } else if (!(h->done && h->nextLine > h->lastLine)){
+                blocked = 1;
+            }
+        }
+        if (best < 0 || (blocked && !force)){
+            return wrote;
+        }
+        mergeEmit(m, best);
+        wrote = 1;
+        force = 0;
+    }
+}
+
+//+
+// Function: mergeAdd
+//
+// Purpose:  Hands count values from a consumer to the merge stage, and
+//           writes whatever is now ready.
+//-
+
+void mergeAdd(struct mergeStage *m, const struct item *items, int count){
+    pthread_mutex_lock(&m->mutex);
+    for (int i = 0; i < count; i++){
+        struct mergeHeap *h = &m->heaps[items[i].prodNum];
+        if (items[i].lineNo < h->nextLine){
+            // its turn was skipped when the window filled up
+            writerPut(&m->writer, items[i].value);
+            m->late++;
+            continue;
+        }
+        heapPush(h, &items[i]);
+        m->held++;
+    }
+    mergeDrain(m, 0);
+    while (m->held > m->window && mergeDrain(m, 1)){
+    }
+    pthread_mutex_unlock(&m->mutex);
+}
+
+//+
+// Function: mergeProducerDone
+//
+// Purpose:  Records the last line number of producer p, which may let the
+//           global merge move on.
+//-
+
+void mergeProducerDone(struct mergeStage *m, int p, int lastLine){
+    pthread_mutex_lock(&m->mutex);
+    m->heaps[p].done = 1;
+    m->heaps[p].lastLine = lastLine;
+    mergeDrain(m, 0);
+    pthread_mutex_unlock(&m->mutex);
+}
+
+//+
+// Function: mergeClose
+//
+// Purpose:  Writes anything still held, once every consumer has finished,
+//           closes the output and frees the stage.
+//-
+
+void mergeClose(struct mergeStage *m){
+    while (mergeDrain(m, 1)){
+    }
+    if (m->late > 0){
+        printf("Merge: %ld values written out of order, try a larger window\n", m->late);
+    }
+    writerClose(&m->writer);
+    for (int i = 0; i < m->numProducers; i++){
+        free(m->heaps[i].items);
+    }
+    free(m->heaps);
+    pthread_mutex_destroy(&m->mutex);
+    free(m);
+}
+
+//+
+// Function: producer
+//
+// Purpose:  This function reads from the file and writes to the buffer.
+//           The parameter is a pointer to a struct threadParam which
+//           gives the name of the output file and the number of the thread.
+//
+//           The file is read with the ingestMode reader (see ingest.h), which
+//           gives the same values as fgets and atoi. Values are collected in
+//           a local batch of up to prodBatch values and published with one
+//           put. A partial batch is published early when it is older than
+//           flushUsec, or when the next read could block because the input is
+//           a pipe or terminal with nothing ready.
+//-
+
+void * producer(void * parm){
+    struct threadParm *prodParm = (struct threadParm *) parm;
+    struct boundedBuffer *buf = prodParm->buf;
+    struct intReader reader;
+    int lineNo = 0;
+    struct item *batch;
+    int *values;
+    int numBatched = 0;
+    int count;
+    uint64_t batchStart = 0;
+
+    myTrace = prodParm->trace;
+    printf("Enter producer %d\n",prodParm->threadNum);
+
+    if (intReaderOpen(&reader, prodParm->fileName, ingestMode) != 0){
+        perror(prodParm->fileName);
+        printf("Exit because producer %d can't open file\n",prodParm->threadNum);
+        exit(1);
+    }
+    batch = calloc(prodBatch, sizeof(struct item));
+    values = calloc(prodBatch, sizeof(int));
+    if (batch == NULL || values == NULL){
+        perror("producer");
+        exit(1);
+    }
+
+    while(1){
+        // flush a partial batch rather than hold it back on a slow input
+        if (numBatched > 0 && (nowNs() - batchStart >= flushUsec * 1000
+                || intReaderWouldBlock(&reader))){
+            buf->ops->put(buf, prodParm->threadNum, lineNo - numBatched + 1, batch, numBatched);
+            numBatched = 0;
+        }
+        if ((count = intReaderRead(&reader, values, prodBatch - numBatched)) < 0){
+            break;
+        }
+        if (numBatched == 0 && prodBatch > 1){
+            batchStart = nowNs();
+        }
+        // with lanes the latency of each class is measured
+        uint64_t stamp = numLanes > 1 ? nowNs() : 0;
+        for (int i = 0; i < count; i++){
+            batch[numBatched].value = values[i];
+            batch[numBatched].prodNum = prodParm->threadNum;
+            batch[numBatched].stamp = stamp;
+            batch[numBatched++].lineNo = lineNo + i + 1;
+        }
+        lineNo += count;
+        if (numBatched == prodBatch){
+            buf->ops->put(buf, prodParm->threadNum, lineNo - numBatched + 1, batch, numBatched);
+            numBatched = 0;
+        }
+    }
+    if (numBatched > 0){
+        buf->ops->put(buf, prodParm->threadNum, lineNo - numBatched + 1, batch, numBatched);
+    }
+    // no more values from this producer
+    buf->ops->producerDone(buf, prodParm->threadNum);
+    if (prodParm->merge != NULL){
+        mergeProducerDone(prodParm->merge, prodParm->threadNum, lineNo);
+    }
+    // done.
+    intReaderClose(&reader);
+    free(batch);
+    free(values);
+    prodParm->numMoved = lineNo;
+    printf("Exit producer %d\n",prodParm->threadNum);
+    return NULL;
+}
+
+//+
+// Function: recordProducer
+//
+// Purpose:  The producer for record mode (-r). Reads its file a line at a
+//           time, copies each line into its slab and batches up the
+//           descriptors the way producer batches values. A line longer
+//           than a record is split, and a last line with no newline is
+//           given one. A partial batch is published before waiting for slab
+//           space, since the consumers can't finish records they haven't
+//           been given.
+//-
+
+void * recordProducer(void * parm){
+    struct threadParm *prodParm = (struct threadParm *) parm;
+    struct boundedBuffer *buf = prodParm->buf;
+    struct recordSlab *slab = &recordSlabs[prodParm->threadNum];
+    struct intReader reader;
+    int lineNo = 0;
+    struct item *batch;
+    int numBatched = 0;
+    const char *line;
+    int len;
+    uint64_t batchStart = 0;
+
+    myTrace = prodParm->trace;
+    printf("Enter producer %d\n",prodParm->threadNum);
+
+    if (intReaderOpen(&reader, prodParm->fileName, ingestMode) != 0){
+        perror(prodParm->fileName);
+        printf("Exit because producer %d can't open file\n",prodParm->threadNum);
+        exit(1);
+    }
+    if ((batch = calloc(prodBatch, sizeof(struct item))) == NULL){
+        perror("recordProducer");
+        exit(1);
+    }
+
+    while(1){
+        // flush a partial batch rather than hold it back on a slow input
+        if (numBatched > 0 && (nowNs() - batchStart >= flushUsec * 1000
+                || intReaderWouldBlock(&reader))){
+            buf->ops->put(buf, prodParm->threadNum, lineNo - numBatched + 1, batch, numBatched);
+            numBatched = 0;
+        }
+        // leave room for a newline
+        if ((len = intReaderLine(&reader, &line, MAX_RECORD_LEN - 1)) < 0){
+            break;
+        }
+        int addNewline = len == 0 || line[len - 1] != '\n';
+        if (numBatched > 0 && !slabRoom(slab, len + addNewline)){
+            buf->ops->put(buf, prodParm->threadNum, lineNo - numBatched + 1, batch, numBatched);
+            numBatched = 0;
+        }
+        size_t offset = slabReserve(slab, len + addNewline, buf);
+        char *payload = slab->data + offset + sizeof(struct recordHeader);
+        memcpy(payload, line, len);
+        if (addNewline){
+            payload[len] = '\n';
+        }
+
+        if (numBatched == 0 && prodBatch > 1){
+            batchStart = nowNs();
+        }
+        batch[numBatched].value = offset;
+        batch[numBatched].len = len + addNewline;
+        batch[numBatched].prodNum = prodParm->threadNum;
+        batch[numBatched].stamp = numLanes > 1 ? nowNs() : 0;
+        batch[numBatched++].lineNo = ++lineNo;
+        if (numBatched == prodBatch){
+            buf->ops->put(buf, prodParm->threadNum, lineNo - numBatched + 1, batch, numBatched);
+            numBatched = 0;
+        }
+    }
+    if (numBatched > 0){
+        buf->ops->put(buf, prodParm->threadNum, lineNo - numBatched + 1, batch, numBatched);
+    }
+    // no more records from this producer
+    buf->ops->producerDone(buf, prodParm->threadNum);
+    // done.
+    intReaderClose(&reader);
+    free(batch);
+    prodParm->numMoved = lineNo;
+    printf("Exit producer %d\n",prodParm->threadNum);
+    return NULL;
+}
+
+//+
+// Function: consumer
+//
+// Purpose:  This function reads from the buffer and writes to a file.
+//           The parameter is a pointer to a struct threadParam which
+//           gives the name of the output file and the number of the thread.
+//           Up to consBatch values are removed from the buffer at a time,
+//           and written through an outWriter, or handed to the merge stage
+//           when there is one.
+//           In record mode the lines are written from the producers' slabs.
+//-
+
+void * consumer(void * parm){
+    struct threadParm *consParm = (struct threadParm *) parm;
+    struct boundedBuffer *buf = consParm->buf;
+    int lineNo = 0;
+    struct item *items;
+    int count;
+    int location;
+
+    myTrace = consParm->trace;
+    printf("Enter consumer %d\n",consParm->threadNum);
+
+    struct outWriter writer;
+    if (consParm->merge == NULL && writerOpen(&writer, consParm->fileName, binaryOutput, echoOutput, consParm->starts > 1) != 0){
+        perror(consParm->fileName);
+        printf("Exiting because consumer %d can't open file\n",consParm->threadNum);
+        exit(1);
+    }
+    if ((items = calloc(consBatch, sizeof(struct item))) == NULL){
+        perror("consumer");
+        exit(1);
+    }
+
+    // stop once the buffer is empty and the producers are done
+    while((count = buf->ops->get(buf, consParm->threadNum, items, consBatch, &location)) > 0){
+        if (numLanes > 1){
+            uint64_t now = nowNs();
+            for (int i = 0; i < count; i++){
+                histAdd(&consParm->latency[itemClass(&items[i])], now - items[i].stamp);
+            }
+        }
+        if (recordMode){
+            // lines go straight from the slabs to the file
+            recordWrite(&writer, items, count);
+            lineNo += count;
+            continue;
+        }
+        for (int i = 0; i < count; i++){
+            lineNo++;
+            // write value to the output file
+            TRACE(TR_CONS_PULL, consParm->threadNum, (location + i) % buf->numSlots, lineNo, items[i].value);
+            if (consParm->merge == NULL){
+                writerPut(&writer, items[i].value);
+            }
+        }
+        if (consParm->merge != NULL){
+            mergeAdd(consParm->merge, items, count);
+        }
+    }
+
+    // done.
+    if (consParm->merge == NULL){
+        writerClose(&writer);
+    }
+    free(items);
+    consParm->numMoved += lineNo;
+    printf("Exiting consumer %d\n",consParm->threadNum);
+    atomic_store(&consParm->exited, 1);
+    return NULL;
+}
+
+/////////////////////////////////// Stages ////////////////////////////////////
+
+//+
+// Stages
+//
+// With -p the values pass through a chain of transform stages between the
+// producers and the consumers. Each stage has its own threads, and takes
+// values from a bounded buffer of its own (the connector), so the chain is
+//
+//    producers -> buffer -> stage 1 -> buffer -> ... -> stage n -> buffer -> consumers
+//
+// with every buffer from the backend chosen with -b. The threads of a stage
+// count as the producers of the next buffer, so the end of the stream
+// passes down the chain the same way it reaches the consumers. A stage is
+// given as name[:args][@threads[/slots]], where slots is the capacity of
+// the buffer in front of it (default -s):
+//
+//    filter:op:n    keep the values where value op n holds, op is one of
+//                   gt ge lt le eq ne, or mod for values that n divides
+//    sum            running sum of the values of each producer
+//    window:n:fn    one value for every n values of a producer, fn is one
+//                   of sum min max avg, a short last window is passed on
+//                   at the end of the stream
+//
+// The running sum and windows are kept per producer and per stage thread,
+// so they are over the producer's values in order when the stage has one
+// thread. The connectors' occupancy is sampled while the stages run, and a
+// report of each stage's throughput and input buffer follows the run.
+//-
+
+// most stages in a chain
+#define MAX_STAGES 16
+// time between occupancy samples
+#define STAGE_SAMPLE_US 1000
+
+struct stageOps;
+
+// One stage thread's running sum or window for one producer
+struct stageAcc{
+    long count;
+    int64_t sum;
+    int min;
+    int max;
+};
+
+struct stage{
+    const struct stageOps *ops;
+    // as given on the command line, for the report
+    char spec[64];
+    // predicate or aggregate, and its operand
+    int op;
+    int operand;
+    int numThreads;
+    int numSlots;
+    int numProducers;
+    // buffer the stage takes values from, and the one it passes them to
+    struct boundedBuffer *in;
+    struct boundedBuffer *out;
+    // values taken and passed on, added as the threads finish
+    atomic_long numIn;
+    atomic_long numOut;
+    // occupancy samples of the input buffer
+    long occupancySum;
+    long samples;
+};
+
+struct stageOps{
+    char *name;
+    // passes on exactly one value for each it takes, keeping line numbers
+    int oneToOne;
+    // decode the arguments after the name, 0 on success
+    int (*init)(struct stage *st, const char *args);
+    // transform count values into out, returning how many there are
+    int (*apply)(struct stage *st, struct stageAcc *accs, const struct item *in, int count, struct item *out);
+    // values still held at the end of the stream, one per producer at most
+    int (*flush)(struct stage *st, struct stageAcc *accs, struct item *out);
+};
+
+// Names of the filter predicates and window aggregates, by op
+const char *filterOps[] = {"gt", "ge", "lt", "le", "eq", "ne", "mod", NULL};
+const char *windowFns[] = {"sum", "min", "max", "avg", NULL};
+
+// Stages of the chain (-p), in order
+struct stage pipeStages[MAX_STAGES];
+int numPipeStages = 0;
+
+//+
+// Function: findName
+//
+// Purpose:  Looks up name in a NULL terminated list of names.
+//
+// Returns:  the index of name, -1 if it isn't in the list
+//-
+
+int findName(const char **names, const char *name){
+    for (int i = 0; names[i] != NULL; i++){
+        if (strcmp(names[i], name) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+//+
+// Function: filterInit
+//
+// Purpose:  Decodes "op:n" for a filter stage.
+//-
+
+int filterInit(struct stage *st, const char *args){
+    char op[8];
+    if (args == NULL || sscanf(args, "%7[a-z]:%d", op, &st->operand) != 2
+            || (st->op = findName(filterOps, op)) < 0){
+        return -1;
+    }
+    // mod 0 would divide by zero
+    return strcmp(op, "mod") == 0 && st->operand == 0 ? -1 : 0;
+}
+
+//+
+// Function: filterHolds
+//
+// Purpose:  Returns whether the predicate of a filter holds for v.
+//-
+
+int filterHolds(const struct stage *st, int v){
+    switch (st->op){
+    case 0:  return v > st->operand;
+    case 1:  return v >= st->operand;
+    case 2:  return v < st->operand;
+    case 3:  return v <= st->operand;
+    case 4:  return v == st->operand;
+    case 5:  return v != st->operand;
+    // every value is a multiple of -1, and INT_MIN % -1 would trap
+    default: return st->operand == -1 || v % st->operand == 0;
+    }
+}
+
+//+
+// Function: filterApply
+//
+// Purpose:  Passes on the values the predicate holds for.
+//-
+
+int filterApply(struct stage *st, struct stageAcc *accs, const struct item *in, int count, struct item *out){
+    int n = 0;
+    for (int i = 0; i < count; i++){
+        if (filterHolds(st, in[i].value)){
+            out[n++] = in[i];
+        }
+    }
+    return n;
+}
+
+//+
+// Function: sumInit
+//
+// Purpose:  Checks a running sum stage has no arguments.
+//-
+
+int sumInit(struct stage *st, const char *args){
+    return args == NULL ? 0 : -1;
+}
+
+//+
+// Function: sumApply
+//
+// Purpose:  Replaces each value with the sum of its producer's values so
+//           far, wrapping around like an unsigned int.
+//-
+
+int sumApply(struct stage *st, struct stageAcc *accs, const struct item *in, int count, struct item *out){
+    for (int i = 0; i < count; i++){
+        struct stageAcc *acc = &accs[in[i].prodNum];
+        acc->sum += in[i].value;
+        out[i] = in[i];
+        out[i].value = (int) (uint32_t) acc->sum;
+    }
+    return count;
+}
+
+//+
+// Function: windowInit
+//
+// Purpose:  Decodes "n:fn" for a window stage.
+//-
+
+int windowInit(struct stage *st, const char *args){
+    char fn[8];
+    if (args == NULL || sscanf(args, "%d:%7[a-z]", &st->operand, fn) != 2 || st->operand < 1
+            || (st->op = findName(windowFns, fn)) < 0){
+        return -1;
+    }
+    return 0;
+}
+
+//+
+// Function: windowValue
+//
+// Purpose:  Returns the aggregate of a window, and starts the next one.
+//-
+
+int windowValue(struct stage *st, struct stageAcc *acc){
+    int value;
+    switch (st->op){
+    case 0:  value = (int) (uint32_t) acc->sum; break;
+    case 1:  value = acc->min; break;
+    case 2:  value = acc->max; break;
+    default: value = acc->sum / acc->count;
+    }
+    acc->count = 0;
+    acc->sum = 0;
+    return value;
+}
+
+//+
+// Function: windowApply
+//
+// Purpose:  Adds each value to its producer's window, passing on the
+//           aggregate as each window fills. The aggregate keeps the line
+//           number and time stamp of the last value in the window.
+//-
+
+int windowApply(struct stage *st, struct stageAcc *accs, const struct item *in, int count, struct item *out){
+    int n = 0;
+    for (int i = 0; i < count; i++){
+        struct stageAcc *acc = &accs[in[i].prodNum];
+        int v = in[i].value;
+        acc->min = acc->count == 0 || v < acc->min ? v : acc->min;
+        acc->max = acc->count == 0 || v > acc->max ? v : acc->max;
+        acc->sum += v;
+        if (++acc->count == st->operand){
+            out[n] = in[i];
+            out[n++].value = windowValue(st, acc);
+        }
+    }
+    return n;
+}
+
+//+
+// Function: windowFlush
+//
+// Purpose:  Passes on the partly filled windows at the end of the stream.
+//-
+
+int windowFlush(struct stage *st, struct stageAcc *accs, struct item *out){
+    int n = 0;
+    for (int p = 0; p < st->numProducers; p++){
+        if (accs[p].count > 0){
+            out[n].prodNum = p;
+            out[n].lineNo = 0;
+            out[n].stamp = nowNs();
+            out[n++].value = windowValue(st, &accs[p]);
+        }
+    }
+    return n;
+}
+
+// List stages and their operations
+// Must be terminated by {NULL, ...}
+struct stageOps stageTypes[] = {
+    {"filter", 0, filterInit, filterApply, NULL},
+    {"sum", 1, sumInit, sumApply, NULL},
+    {"window", 0, windowInit, windowApply, windowFlush},
+    {NULL, 0, NULL, NULL, NULL}     // Terminator
+};
+
+//+
+// Function: parseStages
+//
+// Purpose:  Decodes the -p list of stages into pipeStages. Threads default
+//           to 1 and slots to defaultSlots.
+//
+// Returns:  0 on success, -1 if a stage is malformed
+//-
+
+int parseStages(const char *spec, int defaultSlots){
+    char *copy = strdup(spec);
+    char *save;
+
+    numPipeStages = 0;
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)){
+        if (numPipeStages == MAX_STAGES){
+            free(copy);
+            return -1;
+        }
+        struct stage *st = &pipeStages[numPipeStages++];
+        memset(st, 0, sizeof(struct stage));
+        snprintf(st->spec, sizeof(st->spec), "%s", tok);
+        st->numThreads = 1;
+        st->numSlots = defaultSlots;
+
+        // name[:args][@threads[/slots]]
+        char *at = strchr(tok, '@');
+        if (at != NULL){
+            *at = '\0';
+            char *slash = strchr(at + 1, '/');
+            st->numThreads = atoi(at + 1);
+            if (slash != NULL){
+                st->numSlots = atoi(slash + 1);
+            }
+        }
+        char *args = strchr(tok, ':');
+        if (args != NULL){
+            *args++ = '\0';
+        }
+        for (int i = 0; stageTypes[i].name != NULL && st->ops == NULL; i++){
+            if (strcmp(stageTypes[i].name, tok) == 0){
+                st->ops = &stageTypes[i];
+            }
+        }
+        if (st->ops == NULL || st->numThreads < 1 || st->numSlots < 1 || st->ops->init(st, args) != 0){
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+    return numPipeStages > 0 ? 0 : -1;
+}
+
+//+
+// Function: stageWorker
+//
+// Purpose:  Thread of a transform stage. Takes values from the stage's
+//           input buffer, transforms them and passes the result on, until
+//           the input ends. Then passes on what the stage still holds and
+//           leaves the output buffer like a producer would.
+//-
+
+void * stageWorker(void * parm){
+    struct threadParm *stageParm = (struct threadParm *) parm;
+    struct stage *st = stageParm->stage;
+    struct item *in = calloc(consBatch, sizeof(struct item));
+    // a window flush passes on a value per producer
+    int outLen = consBatch > st->numProducers ? consBatch : st->numProducers;
+    struct item *out = calloc(outLen, sizeof(struct item));
+    struct stageAcc *accs = calloc(st->numProducers, sizeof(struct stageAcc));
+    long numIn = 0;
+    long numOut = 0;
+    int count;
+    int location;
+
+    if (in == NULL || out == NULL || accs == NULL){
+        perror("stageWorker");
+        exit(1);
+    }
+    while ((count = st->in->ops->get(st->in, stageParm->threadNum, in, consBatch, &location)) > 0){
+        int n = st->ops->apply(st, accs, in, count, out);
+        if (n > 0){
+            st->out->ops->put(st->out, stageParm->threadNum, out[0].lineNo, out, n);
+        }
+        numIn += count;
+        numOut += n;
+    }
+    if (st->ops->flush != NULL){
+        int n = st->ops->flush(st, accs, out);
+        if (n > 0){
+            st->out->ops->put(st->out, stageParm->threadNum, out[0].lineNo, out, n);
+        }
+        numOut += n;
+    }
+    st->out->ops->producerDone(st->out, stageParm->threadNum);
+    atomic_fetch_add(&st->numIn, numIn);
+    atomic_fetch_add(&st->numOut, numOut);
+    free(in);
+    free(out);
+    free(accs);
+    return NULL;
+}
+
+// Occupancy sampling of the connectors while the stages run
+struct stageMonitor{
+    // the buffer in front of the consumers, sampled like a stage's input
+    struct boundedBuffer *last;
+    long lastSum;
+    long lastSamples;
+    atomic_int stop;
+};
+
+//+
+// Function: monitorStages
+//
+// Purpose:  Thread that samples the occupancy of every stage's input buffer
+//           and of the consumers' buffer until told to stop.
+//-
+
+void * monitorStages(void * parm){
+    struct stageMonitor *mon = (struct stageMonitor *) parm;
+
+    while (!atomic_load(&mon->stop)){
+        for (int s = 0; s < numPipeStages; s++){
+            pipeStages[s].occupancySum += pipeStages[s].in->ops->occupancy(pipeStages[s].in);
+            pipeStages[s].samples++;
+        }
+        mon->lastSum += mon->last->ops->occupancy(mon->last);
+        mon->lastSamples++;
+        usleep(STAGE_SAMPLE_US);
+    }
+    return NULL;
+}
+
+//+
+// Function: reportStages
+//
+// Purpose:  Prints each stage's values in and out, throughput and input
+//           buffer. A stage that can't keep up shows a full input buffer,
+//           with the stage in front of it waiting on full.
+//-
+
+void reportStages(struct stageMonitor *mon, long numRead, long numWritten, double seconds){
+    printf("%-5s %-20s %7s %10s %10s %12s %6s %9s %10s\n", "stage", "spec", "threads", "in", "out",
+           "in/sec", "slots", "avg full", "waited ms");
+    printf("%-5d %-20s %7s %10s %10ld %12s %6s %9s %10s\n", 0, "read", "-", "-", numRead, "-", "-", "-", "-");
+    for (int s = 0; s < numPipeStages; s++){
+        struct stage *st = &pipeStages[s];
+        double full = st->samples ? (double) st->occupancySum / st->samples / st->in->numSlots : 0;
+        printf("%-5d %-20s %7d %10ld %10ld %12.0f %6d %8.1f%% %10.1f\n", s + 1, st->spec, st->numThreads,
+               (long) st->numIn, (long) st->numOut, st->numIn / seconds, st->in->numSlots, full * 100,
+               st->in->fullWaitNs / 1e6);
+    }
+    double full = mon->lastSamples ? (double) mon->lastSum / mon->lastSamples / mon->last->numSlots : 0;
+    printf("%-5d %-20s %7s %10ld %10s %12.0f %6d %8.1f%% %10.1f\n", numPipeStages + 1, "write", "-",
+           numWritten, "-", numWritten / seconds, mon->last->numSlots, full * 100,
+           mon->last->fullWaitNs / 1e6);
+}
+
+/////////////////////////////// Priority Lanes ////////////////////////////////
+
+//+
+// Priority lanes
+//
+// With -L values are put in priority classes, and the buffers get a lane
+// for each class (see Sharded Buffers), so that a few urgent values don't
+// wait behind the bulk ones. Class 0 is the bulk lane and higher classes
+// are taken first. A value's class comes from its producer or from the
+// value itself:
+//
+//    producer:c0,c1,...   producer n is in class cn, producers past the
+//                         end of the list are in class 0
+//    value:op:n           values where value op n holds are in class 1,
+//                         op as for a filter stage
+//
+// Either can end in @n, the most sweeps in a row a consumer takes from the
+// higher lanes while the bulk lane has values waiting (default 16). With
+// lanes the values are stamped as they are read, and the consumers keep a
+// latency histogram for each class.
+//-
+
+// class of each producer, for producer:, up to the most the benchmark runs
+int laneClasses[64];
+int numLaneClasses = 0;
+// predicate of the class 1 values, for value:
+int laneByValue = 0;
+struct stage laneFilter;
+
+//+
+// Function: itemClass
+//
+// Purpose:  Returns the priority class of a value, 0 without lanes.
+//-
+
+int itemClass(const struct item *it){
+    if (numLanes == 1){
+        return 0;
+    }
+    if (laneByValue){
+        return filterHolds(&laneFilter, it->value);
+    }
+    return it->prodNum < numLaneClasses ? laneClasses[it->prodNum] : 0;
+}
+
+//+
+// Function: parseLanes
+//
+// Purpose:  Decodes the -L classes into numLanes and the class rule.
+//
+// Returns:  0 on success, -1 if the classes are malformed
+//-
+
+int parseLanes(const char *spec){
+    char *copy = strdup(spec);
+    int ok = 1;
+
+    char *at = strchr(copy, '@');
+    if (at != NULL){
+        *at = '\0';
+        ok = (laneStarve = atoi(at + 1)) >= 1;
+    }
+    if (strncmp(copy, "value:", 6) == 0){
+        laneByValue = 1;
+        numLanes = 2;
+        ok = ok && filterInit(&laneFilter, copy + 6) == 0;
+    } else if (strncmp(copy, "producer:", 9) == 0){
+        char *save;
+        numLanes = 1;
+        numLaneClasses = 0;
+        for (char *tok = strtok_r(copy + 9, ",", &save); ok && tok != NULL; tok = strtok_r(NULL, ",", &save)){
+            int cls = atoi(tok);
+            ok = numLaneClasses < (int) (sizeof(laneClasses) / sizeof(laneClasses[0]))
+                 && cls >= 0 && cls < MAX_LANES;
+            laneClasses[numLaneClasses++] = cls;
+            numLanes = cls + 1 > numLanes ? cls + 1 : numLanes;
+        }
+        // every producer in the bulk class needs no lanes
+        ok = ok && numLanes > 1;
+    } else {
+        ok = 0;
+    }
+    free(copy);
+    return ok ? 0 : -1;
+}
+
+///////////////////////////////// Event Loop //////////////////////////////////
+
+//+
+// Event loop
+//
+// With -X async there are no threads and no shared buffer. One loop reads
+// every producer file and writes every consumer file, all opened
+// non-blocking. Pipes and other pollable files are waited on with epoll.
+// Regular files can't be polled, because they are always ready, so they
+// are read as the loop goes around. Each value is formatted straight into
+// a consumer's output buffer, a batch at a time, with the consumers taken
+// in turn. The values and line numbers are what the threaded producers
+// read, so the out<test><n>.dat files hold the same values. With -M the
+// merged output is the same file.
+//
+// To compare the two modes on many files, for example:
+//
+//    for i in $(seq 0 127); do seq $((i * 10000)) $((i * 10000 + 9999)) > t7$i.dat; done
+//    ./main -X threads 7 128 4
+//    ./main -X async 7 128 4
+//-
+
+// bytes read from a producer file at a time
+#define ASYNC_CHUNK (1 << 16)
+// most values taken from one file before moving on to the next
+#define ASYNC_BATCH 256
+
+// A producer file
+struct asyncSource{
+    int fd;
+    // can be waited on with epoll, and has no input ready for now
+    int pollable;
+    int waiting;
+    int eof;
+    // bytes pos to len of buf are not converted yet
+    char *buf;
+    size_t len;
+    size_t pos;
+    int lineNo;
+};
+
+// A consumer file, its bytes written up to done
+struct asyncOut{
+    struct outWriter writer;
+    int pollable;
+    // waiting for epoll to say it can be written
+    int waiting;
+    size_t done;
+    long numValues;
+};
+
+//+
+// Function: asyncPollable
+//
+// Purpose:  Adds fd to the epoll set, with no events for now.
+//
+// Returns:  1 if fd can be polled, 0 for a regular file
+//-
+
+int asyncPollable(int epfd, int fd, uint64_t tag){
+    struct epoll_event ev = {0, {.u64 = tag}};
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0){
+        return 1;
+    }
+    if (errno != EPERM){
+        perror("epoll_ctl");
+        exit(1);
+    }
+    return 0;
+}
+
+//+
+// Function: asyncWatch
+//
+// Purpose:  Sets the events the loop waits for on fd.
+//-
+
+void asyncWatch(int epfd, int fd, uint32_t events, uint64_t tag){
+    struct epoll_event ev = {events, {.u64 = tag}};
+
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) != 0){
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+//+
+// Function: asyncDrain
+//
+// Purpose:  Writes as much of a consumer's buffered output as the file
+//           takes without waiting. The buffer is emptied once it has all
+//           been written.
+//
+// Returns:  1 if everything was written, 0 if the file is full for now
+//-
+
+int asyncDrain(struct asyncOut *out){
+    struct outWriter *w = &out->writer;
+
+    while (out->done < w->len){
+        ssize_t n = write(w->fd, w->buf + out->done, w->len - out->done);
+        if (n < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            if (errno == EAGAIN){
+                return 0;
+            }
+            perror("write");
+            exit(1);
+        }
+        out->done += n;
+    }
+    w->len = out->done = 0;
+    return 1;
+}
+
+//+
+// Function: asyncFill
+//
+// Purpose:  Reads more of a producer file after the part of a line left
+//           in its buffer, without waiting.
+//
+// Returns:  1 if there is more to convert, 0 if the file has nothing ready
+//-
+
+int asyncFill(struct asyncSource *src){
+    memmove(src->buf, src->buf + src->pos, src->len - src->pos);
+    src->len -= src->pos;
+    src->pos = 0;
+    while (1){
+        ssize_t n = read(src->fd, src->buf + src->len, ASYNC_CHUNK - src->len);
+        if (n < 0 && errno == EINTR){
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN){
+            return 0;
+        }
+        if (n <= 0){
+            src->eof = 1;
+        } else {
+            src->len += n;
+        }
+        return 1;
+    }
+}
+
+//+
+// Function: runAsync
+//
+// Purpose:  Moves the values of numProducers files t<test><n>.dat to
+//           numConsumers files out<test><n>.dat, or to the merge, in one
+//           thread.
+//
+// Returns:  the number of values moved
+//-
+
+long runAsync(int numProducers, int numConsumers){
+    struct asyncSource *srcs = calloc(numProducers, sizeof(struct asyncSource));
+    struct asyncOut *outs = calloc(numConsumers, sizeof(struct asyncOut));
+    int *values = malloc(ASYNC_BATCH * sizeof(int));
+    struct item *items = malloc(ASYNC_BATCH * sizeof(struct item));
+    struct epoll_event *events = malloc((numProducers + numConsumers) * sizeof(struct epoll_event));
+    char fileName[20];
+    int epfd = epoll_create1(0);
+    if (srcs == NULL || outs == NULL || values == NULL || items == NULL || events == NULL || epfd < 0){
+        perror("runAsync");
+        exit(1);
+    }
+
+    // the producer files are tagged by number, the consumer files after them
+    for (int i = 0; i < numProducers; i++){
+        sprintf(fileName,"t%d%d.dat",testNum,i);
+        if ((srcs[i].fd = open(fileName, O_RDONLY | O_NONBLOCK)) < 0){
+            perror(fileName);
+            printf("Exit because producer %d can't open file\n",i);
+            exit(1);
+        }
+        if ((srcs[i].buf = malloc(ASYNC_CHUNK)) == NULL){
+            perror("runAsync");
+            exit(1);
+        }
+        // a pipe is read once epoll says so, since a read before its
+        // writer has opened it would look like the end of the file
+        if ((srcs[i].pollable = asyncPollable(epfd, srcs[i].fd, i))){
+            srcs[i].waiting = 1;
+            asyncWatch(epfd, srcs[i].fd, EPOLLIN, i);
+        }
+    }
+    struct mergeStage *merge = NULL;
+    if (mergeMode){
+        sprintf(fileName,"out%d.%s",testNum,binaryOutput ? "bin" : "dat");
+        printf("Main: merging output into %s\n", fileName);
+        merge = mergeCreate(fileName, mergeMode, mergeWindow, numProducers);
+        numConsumers = 0;
+    }
+    for (int i = 0; i < numConsumers; i++){
+        sprintf(fileName,"out%d%d.%s",testNum,i,binaryOutput ? "bin" : "dat");
+        if (writerOpen(&outs[i].writer, fileName, binaryOutput, 0, 0) != 0){
+            perror(fileName);
+            printf("Exiting because consumer %d can't open file\n",i);
+            exit(1);
+        }
+        fcntl(outs[i].writer.fd, F_SETFL, fcntl(outs[i].writer.fd, F_GETFL) | O_NONBLOCK);
+        outs[i].pollable = asyncPollable(epfd, outs[i].writer.fd, numProducers + i);
+    }
 
-// function prototypes
-void simulate_interrupt(void);
+    long numMoved = 0;
+    int numOpen = numProducers;
+    int next = 0;
+    while (numOpen > 0){
+        int progress = 0;
+        for (int i = 0; i < numProducers; i++){
+            struct asyncSource *src = &srcs[i];
+            if (src->fd < 0 || src->waiting){
+                continue;
+            }
+            // the next consumer with room for a batch
+            struct asyncOut *out = NULL;
+            for (int k = 0; k < numConsumers && out == NULL; k++){
+                struct asyncOut *o = &outs[(next + k) % numConsumers];
+                if (!o->waiting && WRITE_BUFSIZE - o->writer.len >= ASYNC_BATCH * MAX_RECORD){
+                    out = o;
+                    next = (next + k + 1) % numConsumers;
+                }
+            }
+            if (out == NULL && merge == NULL){
+                break;
+            }
+
+            size_t used;
+            int count = scanInts(src->buf + src->pos, src->len - src->pos, src->eof, values, ASYNC_BATCH, &used);
+            src->pos += used;
+            if (count == 0){
+                if (src->eof){
+                    if (merge != NULL){
+                        mergeProducerDone(merge, i, src->lineNo);
+                    }
+                    close(src->fd);
+                    src->fd = -1;
+                    numOpen--;
+                    progress = 1;
+                } else if (asyncFill(src)){
+                    progress = 1;
+                } else {
+                    src->waiting = 1;
+                    asyncWatch(epfd, src->fd, EPOLLIN, i);
+                }
+                continue;
+            }
+            progress = 1;
+            if (merge != NULL){
+                for (int j = 0; j < count; j++){
+                    items[j].value = values[j];
+                    items[j].prodNum = i;
+                    items[j].lineNo = src->lineNo + j + 1;
+                }
+                // the merge takes a consumer batch at a time
+                for (int j = 0; j < count; j += consBatch){
+                    mergeAdd(merge, items + j, count - j < consBatch ? count - j : consBatch);
+                }
+            } else {
+                for (int j = 0; j < count; j++){
+                    writerPut(&out->writer, values[j]);
+                }
+                out->numValues += count;
+                // write in large blocks, but before the buffer fills
+                if (out->writer.len >= WRITE_BUFSIZE / 2 && !asyncDrain(out)){
+                    out->waiting = 1;
+                    asyncWatch(epfd, out->writer.fd, EPOLLOUT, numProducers + (out - outs));
+                }
+            }
+            src->lineNo += count;
+            numMoved += count;
+        }
 
-// mutexes
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t empty  = PTHREAD_COND_INITIALIZER;
-pthread_cond_t full  = PTHREAD_COND_INITIALIZER;
+        if (!progress){
+            // every file that is open is waiting on epoll
+            int n = epoll_wait(epfd, events, numProducers + numConsumers, -1);
+            if (n < 0 && errno != EINTR){
+                perror("epoll_wait");
+                exit(1);
+            }
+            for (int e = 0; e < n; e++){
+                int tag = events[e].data.u64;
+                if (tag < numProducers){
+                    srcs[tag].waiting = 0;
+                    asyncWatch(epfd, srcs[tag].fd, 0, tag);
+                } else if (asyncDrain(&outs[tag - numProducers])){
+                    outs[tag - numProducers].waiting = 0;
+                    asyncWatch(epfd, outs[tag - numProducers].writer.fd, 0, tag);
+                }
+            }
+        }
+    }
+
+    // the rest of the output can be written waiting
+    for (int i = 0; i < numConsumers; i++){
+        struct outWriter *w = &outs[i].writer;
+        fcntl(w->fd, F_SETFL, fcntl(w->fd, F_GETFL) & ~O_NONBLOCK);
+        asyncDrain(&outs[i]);
+        writerClose(w);
+        printf("Main: consumer %d wrote %ld values\n", i, outs[i].numValues);
+    }
+    if (merge != NULL){
+        mergeClose(merge);
+    }
+    for (int i = 0; i < numProducers; i++){
+        free(srcs[i].buf);
+    }
+    close(epfd);
+    free(srcs);
+    free(outs);
+    free(values);
+    free(items);
+    free(events);
+    return numMoved;
+}
 
-//*********Begin Shared Variables*************
-// number of running producers
-int numProdRunning = 0;
-// buffer
-#define numSlots 3
-int numElements = 0;
-int head = 0;
-int tail = 0;
-int buffer[numSlots];
-//*********End Shared Variables*************
+////////////////////////////////// Benchmark //////////////////////////////////
 
 //+
-// Function: producer
+// Function: benchProducer
 //
-// Purpose:  This function reads from the file and writes to the buffer.
-//           The parameter is a pointer to a struct threadParam which
-//           gives the name of the output file and the number of the thread.
+// Purpose:  Benchmark producer. Publishes its in memory stream in batches of
+//           prodBatch values, stamping each batch as it is put in the buffer.
 //-
 
-void * producer(void * parm){
+void * benchProducer(void * parm){
     struct threadParm *prodParm = (struct threadParm *) parm;
-    const unsigned int linelen= 1024;
-    char line[linelen];
-    int lineNo = 0;
-    int value = 0;
+    struct boundedBuffer *buf = prodParm->buf;
+    struct item *batch;
 
-    printf("Enter producer %d\n",prodParm->threadNum);
+    if ((batch = calloc(prodBatch, sizeof(struct item))) == NULL){
+        perror("benchProducer");
+        exit(1);
+    }
+    for (long i = 0; i < prodParm->streamLen; i += prodBatch){
+        int count = prodParm->streamLen - i < prodBatch ? prodParm->streamLen - i : prodBatch;
+        uint64_t stamp = nowNs();
+        for (int j = 0; j < count; j++){
+            batch[j].value = prodParm->stream[i + j];
+            batch[j].prodNum = prodParm->threadNum;
+            batch[j].lineNo = i + j + 1;
+            batch[j].stamp = stamp;
+        }
+        buf->ops->put(buf, prodParm->threadNum, i + 1, batch, count);
+    }
+    buf->ops->producerDone(buf, prodParm->threadNum);
+    free(batch);
+    prodParm->numMoved = prodParm->streamLen;
+    return NULL;
+}
 
-    FILE * inFile = fopen(prodParm->fileName,"r");
-    if (inFile == NULL){
-        perror(prodParm->fileName);
-        printf("Exit because producer %d can't open file\n",prodParm->threadNum);
+//+
+// Function: benchConsumer
+//
+// Purpose:  Benchmark consumer. Removes values in batches of consBatch and
+//           records how long each one spent in the buffer, without writing
+//           anything out.
+//-
+
+void * benchConsumer(void * parm){
+    struct threadParm *consParm = (struct threadParm *) parm;
+    struct boundedBuffer *buf = consParm->buf;
+    struct item *items;
+    int count;
+    int location;
+
+    if ((items = calloc(consBatch, sizeof(struct item))) == NULL){
+        perror("benchConsumer");
         exit(1);
     }
+    while((count = buf->ops->get(buf, consParm->threadNum, items, consBatch, &location)) > 0){
+        uint64_t now = nowNs();
+        for (int i = 0; i < count; i++){
+            histAdd(&consParm->latency[itemClass(&items[i])], now - items[i].stamp);
+        }
+        consParm->numMoved += count;
+    }
+    free(items);
+    atomic_store(&consParm->exited, 1);
+    return NULL;
+}
+
+// Settings for one run of the producers and consumers
+struct runConfig{
+    const struct bufferOps *backend;
+    int numSlots;
+    int numProducers;
+    int numConsumers;
+    // in memory input for each producer, NULL to read the t<test><n>.dat files
+    int **streams;
+    long streamLen;
+    // elastic pool limits, numConsumers is where it starts. 0 for a fixed
+    // pool
+    int minConsumers;
+    int maxConsumers;
+};
+
+// Measurements from one run
+struct runStats{
+    int numSlots;
+    double seconds;
+    long numMoved;
+    struct latHist latency;
+    // the latency of each priority class
+    struct latHist classLatency[MAX_LANES];
+    long fullWaits;
+    long fullWaitNs;
+    long emptyWaits;
+    long emptyWaitNs;
+    long spinWakes;
+    long parks;
+};
+
+//+
+// Function: placeThread
+//
+// Purpose:  Sets the CPUs of a producer or consumer thread in attr, following
+//           threadPlacement, and describes them in where for the start up
+//           message. where is empty when the thread isn't placed.
+//-
+
+void placeThread(pthread_attr_t *attr, int consumer, int threadNum, int numProducers, char *where, size_t len){
+    cpu_set_t cpus;
+
+    where[0] = '\0';
+    if (!placementCpus(&threadPlacement, consumer, threadNum, numProducers, &cpus)){
+        return;
+    }
+    pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+    int used = snprintf(where, len, " on cpus ");
+    formatCpuSet(&cpus, where + used, len - used);
+}
 
-    while(fgets(line, linelen, inFile)){
-        lineNo++;
-        value = atoi(line);
+//+
+// Function: reportPlacement
+//
+// Purpose:  Prints how the threads will be placed.
+//-
 
-        // lock
-        pthread_mutex_lock(&mutex);
-        printf("Producer thread %d obtaining lock for %d: %d\n", prodParm -> threadNum,lineNo, value);
+void reportPlacement(const struct placement *pl){
+    char cpus[256];
 
-        //if full output to user 
-        if(numElements == numSlots){
-             printf("Producer thread %d waiting full\n", prodParm->threadNum);
+    if (pl->mode == PLACE_AUTO){
+        printf("Placement auto, %d %s group%s:", pl->numGroups, pl->groupKind, pl->numGroups == 1 ? "" : "s");
+        for (int g = 0; g < pl->numGroups; g++){
+            formatCpuSet(&pl->groups[g], cpus, sizeof(cpus));
+            printf(" %s", cpus);
         }
-        //if full wait
-        while (numElements == numSlots){
-            pthread_cond_wait(&full, &mutex);
+        printf("\n");
+    } else if (pl->mode == PLACE_LIST){
+        printf("Placement by cpu list, %d producer cpus, %d consumer cpus%s\n", pl->numProdCpus,
+               pl->numConsCpus, pl->sharedList ? " (shared)" : "");
+    }
+}
+
+//+
+// Elastic consumer pool
+//
+// With -E min:max the number of consumers follows the load. While the
+// producers run, the main thread samples the buffer every
+// ELASTIC_SAMPLE_US. A sample shows backpressure when the buffer is at
+// least 3/4 full, or the producers spent at least 1/20 of the sample
+// waiting on full, and shows slack when the buffer is at most 1/8 full and
+// no producer waited. ELASTIC_GROW_SAMPLES samples of backpressure in a row
+// start a consumer, and ELASTIC_SHRINK_SAMPLES samples of slack in a row
+// retire one, taking longer to shrink than to grow. A retired consumer
+// leaves through the end of stream path, so its output file is flushed and
+// closed. A restarted slot adds to its old file.
+//-
+
+#define ELASTIC_SAMPLE_US 10000
+#define ELASTIC_GROW_SAMPLES 3
+#define ELASTIC_SHRINK_SAMPLES 10
+
+//+
+// Function: startConsumer
+//
+// Purpose:  Starts a consumer thread for the slot parm, placing it like the
+//           other consumers.
+//-
+
+void startConsumer(const struct runConfig *cfg, struct threadParm *parm, pthread_t *thread){
+    pthread_attr_t attr;
+    char where[256];
+
+    pthread_attr_init(&attr);
+    placeThread(&attr, 1, parm->threadNum, cfg->numProducers, where, sizeof(where));
+    parm->starts++;
+    atomic_store(&parm->exited, 0);
+    if (cfg->streams != NULL){
+        pthread_create(thread,&attr,benchConsumer,parm);
+    } else {
+        printf("Main: starting consumer %d with file %s%s\n", parm->threadNum, parm->fileName, where);
+        pthread_create(thread,&attr,consumer,parm);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+//+
+// Function: elasticControl
+//
+// Purpose:  Grows and shrinks the consumer pool until the producers are
+//           done, see the comment above. live marks the slots with a thread
+//           that hasn't been joined, and is kept up to date.
+//-
+
+void elasticControl(const struct runConfig *cfg, struct boundedBuffer *buf, struct threadParm *cons_parm,
+                    pthread_t *cons_thread, char *live){
+    int active = 0;
+    int pressure = 0;
+    int slack = 0;
+    long lastWaits = buf->fullWaits;
+    long lastWaitNs = buf->fullWaitNs;
+
+    for (int i = 0; i < cfg->maxConsumers; i++){
+        active += live[i];
+    }
+    int peak = active;
+    while (1){
+        usleep(ELASTIC_SAMPLE_US);
+        if (atomic_load(&buf->numProdRunning) == 0){
+            break;
         }
 
-        // add value to buffer
-        buffer[head] = value;
-        head = (head + 1) % numSlots;
-        numElements++;
-        //printf("Producer thread %d adding %d: %d at position %d\n", prodParm -> threadNum,lineNo, value, head);
+        // join the consumers that took a retire request
+        for (int i = 0; i < cfg->maxConsumers; i++){
+            if (live[i] && atomic_load(&cons_parm[i].exited)){
+                pthread_join(cons_thread[i],NULL);
+                live[i] = 0;
+                active--;
+            }
+        }
 
-        //signal empty
-        //if (numProdRunning == 0) {
-        pthread_cond_signal(&empty);
-        printf("Producer thread %d signaling empty\n", prodParm->threadNum);
-        //}
+        int occupancy = buf->ops->occupancy(buf);
+        long waits = buf->fullWaits - lastWaits;
+        long waitNs = buf->fullWaitNs - lastWaitNs;
+        lastWaits += waits;
+        lastWaitNs += waitNs;
+        if (occupancy * 4 >= buf->numSlots * 3 || waitNs * 20 >= ELASTIC_SAMPLE_US * 1000L){
+            pressure++;
+            slack = 0;
+        } else if (occupancy * 8 <= buf->numSlots && waits == 0){
+            slack++;
+            pressure = 0;
+        } else {
+            pressure = slack = 0;
+        }
 
-        // release
-        pthread_mutex_unlock(&mutex);
-        printf("Producer thread %d releasing lock\n", prodParm->threadNum);
+        if (pressure >= ELASTIC_GROW_SAMPLES && active < cfg->maxConsumers){
+            int i = 0;
+            while (live[i]){
+                i++;
+            }
+            printf("Main: growing the pool to %d consumers, %d/%d slots full, producers waited %ld us\n",
+                   active + 1, occupancy, buf->numSlots, waitNs / 1000);
+            startConsumer(cfg, &cons_parm[i], &cons_thread[i]);
+            live[i] = 1;
+            active++;
+            peak = active > peak ? active : peak;
+            pressure = 0;
+        } else if (slack >= ELASTIC_SHRINK_SAMPLES && active > cfg->minConsumers && buf->retiring == 0){
+            printf("Main: shrinking the pool to %d consumers, %d/%d slots full\n",
+                   active - 1, occupancy, buf->numSlots);
+            buf->ops->retire(buf);
+            slack = 0;
+        }
     }
-    //lock the critical section
-    pthread_mutex_lock(&mutex);
-    // decrement the number of running producers
-    numProdRunning--;
-    // broadcast signal if we are the last one = index of prod is 0. 
-    if(numProdRunning == 0){
-        pthread_cond_broadcast(&empty);
-    }
-    pthread_mutex_unlock(&mutex);
-    // done. 
-    fclose(inFile);
-    printf("Exit producer %d\n",prodParm->threadNum);
-    return NULL;
+    printf("Main: the pool peaked at %d consumers\n", peak);
 }
 
 //+
-// Function: consumer
+// Function: runPipeline
 //
-// Purpose:  This function reads from the buffer and writes to a file.
-//           The parameter is a pointer to a struct threadParam which
-//           gives the name of the output file and the number of the thread.
+// Purpose:  Creates the buffer, starts the producer and consumer threads
+//           and waits for them to finish. With no streams the producers read
+//           t<test><n>.dat and the consumers write out<test><n>.dat, otherwise
+//           the benchmark threads are used. stats may be NULL. With an
+//           elastic pool there is a consumer slot for each of maxConsumers.
 //-
 
-void * consumer(void * parm){
-    struct threadParm *consParm = (struct threadParm *) parm;
-    int lineNo = 0;
-    int value = 0;
-    int location;
+void runPipeline(const struct runConfig *cfg, struct runStats *stats){
+    int poolSize = cfg->maxConsumers > 0 ? cfg->maxConsumers : cfg->numConsumers;
+    // thread vars
+    pthread_t *prod_thread = calloc(cfg->numProducers, sizeof(pthread_t));
+    pthread_t *cons_thread = calloc(poolSize, sizeof(pthread_t));
+    struct threadParm *prod_parm = calloc(cfg->numProducers, sizeof(struct threadParm));
+    struct threadParm *cons_parm = calloc(poolSize, sizeof(struct threadParm));
+    struct latHist *cons_latency = calloc(poolSize * MAX_LANES, sizeof(struct latHist));
+    // consumer slots with a thread that hasn't been joined
+    char *live = calloc(poolSize, 1);
+    if (prod_thread == NULL || cons_thread == NULL || prod_parm == NULL || cons_parm == NULL
+            || cons_latency == NULL || live == NULL){
+        perror("runPipeline");
+        exit(1);
+    }
 
-    printf("Enter consumer %d\n",consParm->threadNum);
+    // producers of the consumers' buffer, the last stage's threads if
+    // there are stages
+    int lastProducers = numPipeStages > 0 ? pipeStages[numPipeStages - 1].numThreads : cfg->numProducers;
+    struct boundedBuffer *buf = bufferCreate(cfg->backend, cfg->numSlots, lastProducers, poolSize);
 
-    FILE * outFile = fopen(consParm->fileName,"w");
-    if (outFile == NULL){
-        perror(consParm->fileName);
-        printf("Exiting because consumer %d can't open file\n",consParm->threadNum);
+    // with stages, the producers fill the first stage's buffer and the last
+    // stage fills the consumers'
+    struct boundedBuffer *prodBuf = buf;
+    int numStageThreads = 0;
+    for (int s = numPipeStages - 1; s >= 0; s--){
+        struct stage *st = &pipeStages[s];
+        st->out = prodBuf;
+        atomic_store(&st->out->numProdRunning, st->numThreads);
+        st->in = bufferCreate(cfg->backend, st->numSlots, s > 0 ? pipeStages[s - 1].numThreads : cfg->numProducers,
+                              st->numThreads);
+        st->numProducers = cfg->numProducers;
+        atomic_store(&st->numIn, 0);
+        atomic_store(&st->numOut, 0);
+        st->occupancySum = st->samples = 0;
+        prodBuf = st->in;
+        numStageThreads += st->numThreads;
+    }
+    pthread_t *stage_thread = calloc(numStageThreads + 1, sizeof(pthread_t));
+    struct threadParm *stage_parm = calloc(numStageThreads + 1, sizeof(struct threadParm));
+    if (stage_thread == NULL || stage_parm == NULL){
+        perror("runPipeline");
         exit(1);
     }
 
-    while(1){
-        lineNo++;
+    // the trace rings are allocated before the threads start
+    int numThreads = cfg->numProducers + poolSize;
+    struct traceRing **rings = calloc(numThreads, sizeof(struct traceRing *));
+    if (rings == NULL){
+        perror("runPipeline");
+        exit(1);
+    }
+    for (int i = 0; tracing && i < numThreads; i++){
+        rings[i] = traceCreate();
+    }
+    for (int i = 0; i < cfg->numProducers; i++){
+        prod_parm[i].trace = rings[i];
+    }
+    for (int i = 0; i < poolSize; i++){
+        cons_parm[i].trace = rings[cfg->numProducers + i];
+    }
+
+    // one merged output file instead of one per consumer
+    struct mergeStage *merge = NULL;
+    if (mergeMode && cfg->streams == NULL){
+        char mergeName[20];
+        sprintf(mergeName,"out%d.%s",testNum,binaryOutput ? "bin" : "dat");
+        printf("Main: merging consumer output into %s\n", mergeName);
+        merge = mergeCreate(mergeName, mergeMode, mergeWindow, cfg->numProducers);
+    }
+    for (int i = 0; i < cfg->numProducers; i++){
+        prod_parm[i].merge = merge;
+    }
+    for (int i = 0; i < poolSize; i++){
+        cons_parm[i].merge = merge;
+    }
+    // placement of each thread, and where it is for the start up messages
+    pthread_attr_t attr;
+    char where[256];
+    pthread_attr_init(&attr);
+    if (recordMode){
+        recordSlabs = slabsCreate(cfg->numProducers, slabBytes);
+    }
+    uint64_t start = nowNs();
+
+    // start the producers
+    for (int i = 0; i < cfg->numProducers; i++){
+        // race condition. If the consumers start before the producers
+        // then they may not see running producers, so incrmeent here.
+        atomic_fetch_add(&prodBuf->numProdRunning, 1);
+
+        prod_parm[i].threadNum = i;
+        prod_parm[i].buf = prodBuf;
+        placeThread(&attr, 0, i, cfg->numProducers, where, sizeof(where));
+        if (cfg->streams != NULL){
+            prod_parm[i].stream = cfg->streams[i];
+            prod_parm[i].streamLen = cfg->streamLen;
+            pthread_create(&prod_thread[i],&attr,benchProducer,&prod_parm[i]);
+            continue;
+        }
+    // specify input data file and thread number
+        sprintf(prod_parm[i].fileName,"t%d%d.dat",testNum,i);
+        printf("Main: starting producer %d with file %s%s\n", i, prod_parm[i].fileName, where);
+        pthread_create(&prod_thread[i],&attr,recordMode ? recordProducer : producer,&prod_parm[i]);
+    }
+    pthread_attr_destroy(&attr);
+
+    // start the stages, numbering the threads of each from 0
+    int t = 0;
+    for (int s = 0; s < numPipeStages; s++){
+        for (int i = 0; i < pipeStages[s].numThreads; i++, t++){
+            stage_parm[t].threadNum = i;
+            stage_parm[t].stage = &pipeStages[s];
+            pthread_create(&stage_thread[t],NULL,stageWorker,&stage_parm[t]);
+        }
+    }
+    struct stageMonitor monitor = {buf, 0, 0, 0};
+    pthread_t monitor_thread;
+    if (numPipeStages > 0){
+        pthread_create(&monitor_thread,NULL,monitorStages,&monitor);
+    }
 
-        // lock
-        pthread_mutex_lock(&mutex);
-        printf("Consumer thread %d aquiring lock\n", consParm->threadNum);
+    for (int i = 0; i < poolSize; i++){
+        cons_parm[i].threadNum = i;
+        cons_parm[i].buf = buf;
+        cons_parm[i].latency = &cons_latency[i * MAX_LANES];
+    // specify output data file and thread number
+        sprintf(cons_parm[i].fileName,"out%d%d.%s",testNum,i,binaryOutput ? "bin" : "dat");
+    }
+    for (int i = 0; i < cfg->numConsumers; i++){
+        startConsumer(cfg, &cons_parm[i], &cons_thread[i]);
+        live[i] = 1;
+    }
+    if (cfg->maxConsumers > 0){
+        elasticControl(cfg, buf, cons_parm, cons_thread, live);
+    }
 
-        //wait if empty and there are producers
-        if(numProdRunning > 0 && head == tail){
-            //pthread_cond_wait(&empty, &mutex);
-            printf("Consumer thread %d waiting on empty\n", consParm->threadNum);
+    // wait for threads to complete
+    for (int i = 0; i < cfg->numProducers; i++){
+        pthread_join(prod_thread[i],NULL);
+    }
+    for (int i = 0; i < numStageThreads; i++){
+        pthread_join(stage_thread[i],NULL);
+    }
+    for (int i = 0; i < poolSize; i++){
+        if (live[i]){
+            pthread_join(cons_thread[i],NULL);
+        }
+    }
+    if (merge != NULL){
+        mergeClose(merge);
+    }
+    if (recordMode){
+        slabsReport(recordSlabs, cfg->numProducers);
+        recordSlabs = NULL;
+    }
+    if (numLanes > 1 && cfg->streams == NULL){
+        reportLanes(cons_latency, poolSize);
+    }
+    if (numPipeStages > 0){
+        atomic_store(&monitor.stop, 1);
+        pthread_join(monitor_thread,NULL);
+        long numRead = 0;
+        long numWritten = 0;
+        for (int i = 0; i < cfg->numProducers; i++){
+            numRead += prod_parm[i].numMoved;
         }
-        //wait if empty and there are producers
-        while(numProdRunning > 0 && head == tail){
-            pthread_cond_wait(&empty, &mutex);
+        for (int i = 0; i < poolSize; i++){
+            numWritten += cons_parm[i].numMoved;
         }
+        reportStages(&monitor, numRead, numWritten, (nowNs() - start) / 1e9);
+    }
 
-        // if the buffer is empty and no producers, then 
-        // release the lock and break the loop
-        if(numElements == 0 && numProdRunning == 0){
-             pthread_mutex_unlock(&mutex);
-             break;
+    if (tracing){
+        traceDecode(rings, numThreads);
+        for (int i = 0; i < numThreads; i++){
+            free(rings[i]->events);
+            free(rings[i]);
         }
+    }
+    free(rings);
 
-        // read value from to buffer
-        value = buffer[tail];
-        location = tail;
-        tail = (tail + 1) % numSlots;
-        //decrement the number of elements
-        numElements--;
+    if (stats != NULL){
+        memset(stats, 0, sizeof(struct runStats));
+        stats->seconds = (nowNs() - start) / 1e9;
+        stats->numSlots = buf->numSlots;
+        for (int i = 0; i < poolSize; i++){
+            stats->numMoved += cons_parm[i].numMoved;
+            for (int c = 0; c < MAX_LANES; c++){
+                histMerge(&stats->latency, &cons_latency[i * MAX_LANES + c]);
+                histMerge(&stats->classLatency[c], &cons_latency[i * MAX_LANES + c]);
+            }
+        }
+        stats->fullWaits = buf->fullWaits;
+        stats->fullWaitNs = buf->fullWaitNs;
+        stats->emptyWaits = buf->emptyWaits;
+        stats->emptyWaitNs = buf->emptyWaitNs;
+        stats->spinWakes = buf->spinWakes;
+        stats->parks = buf->parks;
+    }
+    free(prod_thread);
+    free(cons_thread);
+    free(prod_parm);
+    free(cons_parm);
+    free(cons_latency);
+    free(live);
+    free(stage_thread);
+    free(stage_parm);
+}
+
+//+
+// Function: sweepNext
+//
+// Purpose:  Steps a thread count in the benchmark sweep: one at a time up
+//           to 5, then doubling, with max itself always included.
+//-
+
+int sweepNext(int n, int max){
+    if (n < 5){
+        return n + 1;
+    }
+    return n < max && n * 2 > max ? max : n * 2;
+}
 
-        //signal if the consumer thread is signaling full
-        pthread_cond_signal(&full);
-        printf("Consumer thread %d signaling full\n", consParm->threadNum);
+//+
+// Function: runBenchmark
+//
+// Purpose:  Sweeps the buffer capacity and the number of producers and
+//           consumers (1 up to maxProducers and maxConsumers, see sweepNext)
+//           for each of the given backends, split into numShards shards, moving streamLen synthetic values per producer.
+//           One CSV row per run is appended to csvName, with a header when
+//           the file is new, so results from different builds can be
+//           compared. Capacities come from slotList, terminated by 0.
+//-
 
-        // release
-        pthread_mutex_unlock(&mutex);
-        printf("Consumer thread %d releasing lock\n", consParm->threadNum);
+void runBenchmark(const char *csvName, const struct bufferOps **benchBackends, const int *slotList,
+                  int maxProducers, int maxConsumers, long streamLen){
+    FILE *csv = fopen(csvName, "a");
+    if (csv == NULL){
+        perror(csvName);
+        exit(1);
+    }
+    if (ftell(csv) == 0){
+        fprintf(csv, "test,backend,slots,producers,consumers,prod_batch,cons_batch,items,seconds,"
+                     "items_per_sec,p50_ns,p99_ns,p999_ns,full_waits,full_wait_ns,empty_waits,empty_wait_ns,"
+                     "wait,spin_wakes,parks,shards,lanes,top_p50_ns,top_p99_ns,top_p999_ns\n");
+    }
 
-        // write value to the output file
-        printf("Consumer thread %d pulled %d: %d from position %d\n", consParm -> threadNum, lineNo, value, location);
-        printf("%d\n", value);
-        fprintf(outFile,"%d\n", value);
+    // the synthetic streams are generated once, outside the timed runs
+    int **streams = calloc(maxProducers, sizeof(int *));
+    for (int i = 0; i < maxProducers; i++){
+        if (streams == NULL || (streams[i] = malloc(streamLen * sizeof(int))) == NULL){
+            perror("runBenchmark");
+            exit(1);
+        }
+        for (long j = 0; j < streamLen; j++){
+            streams[i][j] = lrand48();
+        }
     }
 
-    // done.
-    fclose(outFile);
-    printf("Exiting consumer %d\n",consParm->threadNum);
-    return NULL;
+    printf("Waiting with %s\n", waitMode == WAIT_FUTEX ? "spin then futex" : "condition variables");
+    printf("Shards %d\n", numShards);
+    if (numLanes > 1){
+        printf("Priority lanes %d, bulk lane at least every %d sweeps\n", numLanes, laneStarve);
+    }
+    printf("%-8s %6s %4s %4s %10s %12s %9s %9s %9s %8s\n", "backend", "slots", "prod", "cons",
+           "seconds", "items/sec", "p50 ns", "p99 ns", "p999 ns", "waits");
+    for (int b = 0; benchBackends[b] != NULL; b++){
+        for (int s = 0; slotList[s] != 0; s++){
+            for (int p = 1; p <= maxProducers; p = sweepNext(p, maxProducers)){
+                for (int c = 1; c <= maxConsumers; c = sweepNext(c, maxConsumers)){
+                    struct runConfig cfg = {benchBackends[b], slotList[s], p, c, streams, streamLen};
+                    struct runStats stats;
+                    runPipeline(&cfg, &stats);
+                    if (stats.numMoved != p * streamLen && numPipeStages == 0){
+                        fprintf(stderr, "%s moved %ld values, expected %ld\n",
+                                benchBackends[b]->name, stats.numMoved, p * streamLen);
+                    }
+                    double rate = stats.numMoved / stats.seconds;
+                    uint64_t p50 = histPercentile(&stats.latency, 0.50);
+                    uint64_t p99 = histPercentile(&stats.latency, 0.99);
+                    uint64_t p999 = histPercentile(&stats.latency, 0.999);
+                    printf("%-8s %6d %4d %4d %10.4f %12.0f %9lu %9lu %9lu %8ld\n", benchBackends[b]->name,
+                           stats.numSlots, p, c, stats.seconds, rate, p50, p99, p999,
+                           stats.fullWaits + stats.emptyWaits);
+                    // the latency of each class, highest first
+                    for (int k = numLanes - 1; numLanes > 1 && k >= 0; k--){
+                        const struct latHist *h = &stats.classLatency[k];
+                        printf("  class %d %21s %10s %12lu %9lu %9lu %9lu\n", k, "", "values", h->total,
+                               histPercentile(h, 0.50), histPercentile(h, 0.99), histPercentile(h, 0.999));
+                    }
+                    const struct latHist *top = &stats.classLatency[numLanes - 1];
+                    fprintf(csv, "%d,%s,%d,%d,%d,%d,%d,%ld,%.6f,%.0f,%lu,%lu,%lu,%ld,%ld,%ld,%ld,%s,%ld,%ld,%d,%d,%lu,%lu,%lu\n",
+                            testNum, benchBackends[b]->name, stats.numSlots, p, c, prodBatch, consBatch,
+                            stats.numMoved, stats.seconds, rate, p50, p99, p999,
+                            stats.fullWaits, stats.fullWaitNs, stats.emptyWaits, stats.emptyWaitNs,
+                            waitMode == WAIT_FUTEX ? "futex" : "condvar", stats.spinWakes, stats.parks, numShards,
+                            numLanes, histPercentile(top, 0.50), histPercentile(top, 0.99),
+                            histPercentile(top, 0.999));
+                    fflush(csv);
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < maxProducers; i++){
+        free(streams[i]);
+    }
+    free(streams);
+    fclose(csv);
 }
 
+//+
+// Function: usage
+//
+// Purpose:  Prints the command line options and exits.
+//-
 
+void usage(const char *prog){
+    fprintf(stderr,"Usage: %s [options] testNum numProducers numconsumers\n", prog);
+    fprintf(stderr,"       %s -B file.csv [options] [testNum maxProducers maxConsumers]\n", prog);
+    fprintf(stderr,"  -b mutex|lockfree|steal\n");
+    fprintf(stderr,"                     buffer backend (default mutex, benchmark sweeps all)\n");
+    fprintf(stderr,"  -s slots           buffer capacity (default 3, benchmark sweeps several)\n");
+    fprintf(stderr,"  -d rr|hash         how producers pick a consumer's deque with -b steal\n");
+    fprintf(stderr,"  -W condvar|futex   how threads wait with -b mutex or steal (default condvar)\n");
+    fprintf(stderr,"  -a auto|cpus[:cpus] pin threads: auto puts each producer and its consumers\n");
+    fprintf(stderr,"                     on one L3 cache or package, a list like 0-3,8 is taken\n");
+    fprintf(stderr,"                     in turn by producers then consumers, or give each a list\n");
+    fprintf(stderr,"  -k shards          split each buffer into shards, producer p using shard p %% shards\n");
+    fprintf(stderr,"  -L producer:c0,c1,...|value:op:n[@n]\n");
+    fprintf(stderr,"                     priority lanes, classes by producer or by value, higher\n");
+    fprintf(stderr,"                     first, the bulk lane served at least every n sweeps\n");
+    fprintf(stderr,"  -E min:max         elastic consumer pool, starting from numconsumers\n");
+    fprintf(stderr,"  -p stage,...       transform stages between producers and consumers, each\n");
+    fprintf(stderr,"                     name[:args][@threads[/slots]], name[:args] one of\n");
+    fprintf(stderr,"                     filter:gt|ge|lt|le|eq|ne|mod:n, sum, window:n:sum|min|max|avg\n");
+    fprintf(stderr,"  -n N               producer batch size (default 1)\n");
+    fprintf(stderr,"  -m M               consumer batch size (default 1)\n");
+    fprintf(stderr,"  -f usec            flush a partial producer batch after usec (default 1000)\n");
+    fprintf(stderr,"  -i mmap|read|stdio how producers read files (default mmap)\n");
+    fprintf(stderr,"  -F text|binary     consumer output format, binary writes out<test><n>.bin\n");
+    fprintf(stderr,"  -e                 also echo consumer output to stdout\n");
+    fprintf(stderr,"  -r                 move whole lines through the buffer, held in a slab per producer\n");
+    fprintf(stderr,"  -R bytes           bytes of each producer's slab with -r (default 1048576,\n");
+    fprintf(stderr,"                     at most 1073741824)\n");
+    fprintf(stderr,"  -M producer|global merge consumer output into out<test>.dat, in line order per\n");
+    fprintf(stderr,"                     producer or k-way merged by value\n");
+    fprintf(stderr,"  -w values          most values the merge holds back (default 4096)\n");
+    fprintf(stderr,"  -X threads|async   a thread per file, or one event loop for every file, either\n");
+    fprintf(stderr,"                     allowing up to 512 producers\n");
+    fprintf(stderr,"  -B file.csv        benchmark with synthetic streams, appending results to file.csv\n");
+    fprintf(stderr,"  -N items           values per producer in the benchmark (default 100000)\n");
+    fprintf(stderr,"  -t                 trace lock and buffer events, printed after the run\n");
+    fprintf(stderr,"  -T events          trace events kept per thread (default 65536)\n");
+    exit(1);
+}
 
 //+
 // Function: main
@@ -193,92 +4169,393 @@ void * consumer(void * parm){
 //           and consumer threads.
 //-
 
-int main(int argc, const char * argv[]) {
-    
+int main(int argc, char * argv[]) {
+
     // constants
     const unsigned int maxProducers = 5;
-    const unsigned int maxConsumers = 5;
-    
-    // thread vars
-    pthread_t prod_thread[maxProducers];
-    pthread_t cons_thread[maxConsumers];
-    struct threadParm prod_parm[maxConsumers];
-    struct threadParm cons_parm[maxProducers];
+    // the benchmark has no input files, so it can run more producers, by
+    // default sweeping up to benchProducers
+    const unsigned int maxBenchProducers = 64;
+    const unsigned int benchProducers = 16;
+    // comparing the threads and the event loop (-X) takes many files
+    const unsigned int maxIoProducers = 512;
+    // one consumer per core, but allow the original 5 on small machines
+    long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+    const unsigned int maxConsumers = numCores > 5 ? numCores : 5;
+    waitSpin = numCores > 1;
+    // capacities swept by the benchmark, terminated by 0
+    const int benchSlots[] = {1, 3, 16, 128, 1024, 0};
 
     int numProducers = 0;
     int numConsumers = 0;
+    int numSlots = 3;
+    int slotsGiven = 0;
+    const struct bufferOps *backend = NULL;
+    const char *benchFile = NULL;
+    const char *placeSpec = NULL;
+    int minConsumers = 0;
+    int maxPool = 0;
+    const char *stageSpec = NULL;
+    long benchItems = 100000;
+    int modeGiven = 0;
+    int opt;
 
      // seed the random number generator
     srand48(time(NULL));
 
-    // check that there are 4 arguments, error if otherwise
-    if (argc != 4){
-        fprintf(stderr,"Usage: %s testNum numProducers numconsumers\n", argv[0]);
-        exit(1);
+    // options come before the positional arguments
+    while ((opt = getopt(argc, argv, "b:s:d:W:k:L:a:E:p:n:m:f:i:F:erR:M:w:X:B:N:tT:")) != -1){
+        switch (opt){
+        case 'b':
+            // buffer backend
+            if ((backend = findBackend(optarg)) == NULL){
+                fprintf(stderr, "Unknown backend %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            // buffer capacity
+            if ((numSlots = atoi(optarg)) < 1){
+                fprintf(stderr, "must be at least one slot, you said %s\n", optarg);
+                exit(1);
+            }
+            slotsGiven = 1;
+            break;
+        case 'd':
+            // steal backend dispatch
+            if (strcmp(optarg, "rr") == 0){
+                stealDispatch = DISPATCH_RR;
+            } else if (strcmp(optarg, "hash") == 0){
+                stealDispatch = DISPATCH_HASH;
+            } else {
+                fprintf(stderr, "Unknown dispatch %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'W':
+            // how to wait on a full or empty buffer
+            if (strcmp(optarg, "condvar") == 0){
+                waitMode = WAIT_CONDVAR;
+            } else if (strcmp(optarg, "futex") == 0){
+                waitMode = WAIT_FUTEX;
+            } else {
+                fprintf(stderr, "Unknown wait %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'k':
+            // buffer shards
+            if ((numShards = atoi(optarg)) < 1){
+                fprintf(stderr, "must be at least one shard, you said %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'L':
+            // priority lanes
+            if (parseLanes(optarg) != 0){
+                fprintf(stderr, "Bad priority classes %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'a':
+            // thread placement
+            placeSpec = optarg;
+            break;
+        case 'E':
+            // elastic consumer pool
+            if (sscanf(optarg, "%d:%d", &minConsumers, &maxPool) != 2 || minConsumers < 1
+                    || maxPool < minConsumers){
+                fprintf(stderr, "elastic pool must be min:max with 1 <= min <= max, you said %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'p':
+            // transform stages, decoded once the default capacity is known
+            stageSpec = optarg;
+            break;
+        case 'n':
+            // producer batch size
+            if ((prodBatch = atoi(optarg)) < 1){
+                fprintf(stderr, "producer batch must be at least 1, you said %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'm':
+            // consumer batch size
+            if ((consBatch = atoi(optarg)) < 1){
+                fprintf(stderr, "consumer batch must be at least 1, you said %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'f':
+            // producer flush timeout
+            if ((flushUsec = atol(optarg)) < 0){
+                fprintf(stderr, "flush timeout can't be negative, you said %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'i':
+            // ingestion path
+            if (strcmp(optarg, "mmap") == 0){
+                ingestMode = INGEST_MMAP;
+            } else if (strcmp(optarg, "read") == 0){
+                ingestMode = INGEST_READ;
+            } else if (strcmp(optarg, "stdio") == 0){
+                ingestMode = INGEST_STDIO;
+            } else {
+                fprintf(stderr, "Unknown ingestion path %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'F':
+            // output format
+            if (strcmp(optarg, "text") == 0){
+                binaryOutput = 0;
+            } else if (strcmp(optarg, "binary") == 0){
+                binaryOutput = 1;
+            } else {
+                fprintf(stderr, "Unknown output format %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'e':
+            // echo output
+            echoOutput = 1;
+            break;
+        case 'r':
+            // record mode
+            recordMode = 1;
+            break;
+        case 'R':
+            // record slab size, whole records
+            if ((slabBytes = atol(optarg)) < MIN_SLAB_BYTES){
+                fprintf(stderr, "slab must be at least %d bytes, you said %s\n", MIN_SLAB_BYTES, optarg);
+                exit(1);
+            }
+            if (slabBytes > MAX_SLAB_BYTES){
+                fprintf(stderr, "slab must be at most %ld bytes, you said %s\n", MAX_SLAB_BYTES, optarg);
+                exit(1);
+            }
+            slabBytes -= slabBytes % RECORD_ALIGN;
+            break;
+        case 'M':
+            // merge stage
+            if (strcmp(optarg, "producer") == 0){
+                mergeMode = MERGE_PRODUCER;
+            } else if (strcmp(optarg, "global") == 0){
+                mergeMode = MERGE_GLOBAL;
+            } else {
+                fprintf(stderr, "Unknown merge order %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'w':
+            // merge window
+            if ((mergeWindow = atoi(optarg)) < 1){
+                fprintf(stderr, "merge window must be at least 1, you said %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'X':
+            // threads or event loop
+            if (strcmp(optarg, "threads") == 0){
+                asyncMode = 0;
+            } else if (strcmp(optarg, "async") == 0){
+                asyncMode = 1;
+            } else {
+                fprintf(stderr, "Unknown execution mode %s\n", optarg);
+                exit(1);
+            }
+            modeGiven = 1;
+            break;
+        case 'B':
+            // benchmark results file
+            benchFile = optarg;
+            break;
+        case 'N':
+            // benchmark values per producer
+            if ((benchItems = atol(optarg)) < 1){
+                fprintf(stderr, "must be at least one value per producer, you said %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            // trace events
+            tracing = 1;
+            break;
+        case 'T':
+            // trace ring size
+            if ((traceEvents = atol(optarg)) < 1){
+                fprintf(stderr, "must keep at least one trace event, you said %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
-    // convert the testNumber on the command line (argument 1) from string to number.
-    // An invalid number will convert as zero
-    if ((testNum = atoi(argv[1]))==0){
-        fprintf(stderr, "testNum must be greater than 0, you said %s\n",argv[1]);
-        exit(1);
+
+    // the benchmark sweeps up to the maximum counts unless told otherwise
+    if (benchFile != NULL && argc == optind){
+        numProducers = benchProducers;
+        numConsumers = maxConsumers;
+        testNum = 1;
+    } else {
+        // check that there are 3 arguments after the options, error if otherwise
+        if (argc - optind != 3){
+            usage(argv[0]);
+        }
+        argv += optind - 1;
+
+        // convert the testNumber on the command line (argument 1) from string to number.
+        // An invalid number will convert as zero
+        if ((testNum = atoi(argv[1]))==0){
+            fprintf(stderr, "testNum must be greater than 0, you said %s\n",argv[1]);
+            exit(1);
+        }
+        // convert the number of producers on the command line (arg 2) from string to number.
+        // An invalid number will convert as zero
+        if ((numProducers = atoi(argv[2]))==0){
+            fprintf(stderr, "must be at least one producer, you said %s\n",argv[2]);
+            exit(1);
+        }
+        // number of producers exceeded max, each producer reads a file
+        // unless this is the benchmark
+        unsigned int prodLimit = benchFile != NULL ? maxBenchProducers : modeGiven ? maxIoProducers : maxProducers;
+        if (numProducers > prodLimit){
+            fprintf(stderr, "No more than %d Producers, you said %d\n",prodLimit, numProducers);
+            exit(1);
+        }
+        // convert the number of consumers on the command line (arg 2) from string to number.
+        // An invalid number will convert as zero
+        if ((numConsumers = atoi(argv[3]))==0){
+            fprintf(stderr, "must be at least one consumer, you said %s\n", argv[3]);
+            exit(1);
+        }
+        // number of producers exceeded max
+        if (numConsumers > maxConsumers){
+            fprintf(stderr, "No more than %d Consumers, you said %d\n",maxConsumers, numConsumers);
+            exit(1);
+        }
     }
-    // convert the number of producers on the command line (arg 2) from string to number.
-    // An invalid number will convert as zero
-    if ((numProducers = atoi(argv[2]))==0){
-        fprintf(stderr, "must be at least one producer, you said %s\n",argv[2]);
-        exit(1);
+
+    if (maxPool > 0){
+        // the benchmark sweeps the number of consumers itself
+        if (benchFile != NULL){
+            fprintf(stderr, "-E can't be used with the benchmark\n");
+            exit(1);
+        }
+        if (maxPool > maxConsumers){
+            fprintf(stderr, "No more than %d Consumers, you said %d\n",maxConsumers, maxPool);
+            exit(1);
+        }
+        numConsumers = numConsumers < minConsumers ? minConsumers : numConsumers;
+        numConsumers = numConsumers > maxPool ? maxPool : numConsumers;
+    }
+
+    if (stageSpec != NULL){
+        if (parseStages(stageSpec, numSlots) != 0){
+            fprintf(stderr, "Bad stage list %s\n", stageSpec);
+            exit(1);
+        }
+        // the merge waits for every line number of a producer
+        for (int s = 0; mergeMode && s < numPipeStages; s++){
+            if (!pipeStages[s].ops->oneToOne){
+                fprintf(stderr, "-M needs every value, it can't follow stage %s\n", pipeStages[s].spec);
+                exit(1);
+            }
+        }
     }
-    // number of producers exceeded max
-    if (numProducers > maxProducers){
-        fprintf(stderr, "No more than %d Producers, you said %d\n",maxProducers, numProducers);
+
+    if (asyncMode && (benchFile != NULL || maxPool > 0 || stageSpec != NULL || recordMode || numLanes > 1
+                      || echoOutput || tracing)){
+        fprintf(stderr, "-X async can't be used with -B, -E, -p, -r, -L, -e or -t\n");
         exit(1);
     }
-    // convert the number of consumers on the command line (arg 2) from string to number.
-    // An invalid number will convert as zero
-    if ((numConsumers = atoi(argv[3]))==0){
-        fprintf(stderr, "must be at least one consumer, you said %s\n", argv[3]);
+
+    if (numLanes > 1 && numShards > 1){
+        fprintf(stderr, "-L and -k can't be used together\n");
         exit(1);
     }
-    // number of producers exceeded max
-    if (numConsumers > maxConsumers){
-        fprintf(stderr, "No more than %d Producers, you said %d\n",maxProducers, numProducers);
+
+    if (recordMode){
+        // the lines are written as they are, they never become values
+        if (benchFile != NULL || binaryOutput || mergeMode || numPipeStages > 0 || laneByValue){
+            fprintf(stderr, "-r can't be used with -B, -F binary, -M, -p or -L value\n");
+            exit(1);
+        }
+        // the slots only hold descriptors, and the slabs hold the producers
+        // back, so unless told otherwise there is a slot for every record
+        // the slabs can hold
+        if (!slotsGiven){
+            long slabSlots = numProducers * (slabBytes / recordSize(1));
+            numSlots = slabSlots < MAX_RECORD_SLOTS ? slabSlots : MAX_RECORD_SLOTS;
+        }
+    }
+
+    if (placementInit(&threadPlacement, placeSpec) != 0){
+        fprintf(stderr, "Bad cpu placement %s\n", placeSpec);
         exit(1);
     }
+
+    if (benchFile != NULL){
+        // a given backend or capacity narrows the sweep
+        const struct bufferOps *benchBackends[sizeof(backends) / sizeof(backends[0])];
+        const int oneSlot[] = {numSlots, 0};
+        int n = 0;
+        for (int i = 0; backends[i].name != NULL; i++){
+            if (backend == NULL || backend == &backends[i]){
+                benchBackends[n++] = &backends[i];
+            }
+        }
+        benchBackends[n] = NULL;
+        // the benchmark measures the buffer, not the trace
+        tracing = 0;
+        reportPlacement(&threadPlacement);
+        runBenchmark(benchFile, benchBackends, slotsGiven ? oneSlot : benchSlots,
+                     numProducers, numConsumers, benchItems);
+        return 0;
+    }
+
+    if (backend == NULL){
+        backend = &backends[0];
+    }
     printf("Test Number %d\n", testNum);
     printf("Number of producers %d\n", numProducers);
     printf("Number of consumers %d\n", numConsumers);
-
-    // start the producers
-    for (int i = 0; i < numProducers; i++){
-        // race condition. If the consumers start before the producers
-        // then they may not see running producers, so incrmeent here.
-        pthread_mutex_lock(&mutex);
-        numProdRunning++;
-        pthread_mutex_unlock(&mutex);
-
-    // specify input data file and thread number
-        sprintf(prod_parm[i].fileName,"t%d%d.dat",testNum,i);
-        prod_parm[i].threadNum = i;
-        printf("Main: starting producer %d with file %s\n", i, prod_parm[i].fileName);
-        pthread_create(&prod_thread[i],NULL,producer,&prod_parm[i]);
+    if (asyncMode){
+        printf("One event loop, no threads\n");
+        uint64_t start = nowNs();
+        long numMoved = runAsync(numProducers, numConsumers);
+        printf("Main: moved %ld values in %.3f seconds\n", numMoved, (nowNs() - start) / 1e9);
+        return 0;
     }
-
-    for (int i = 0; i < numConsumers; i++){
-    // specify output data file and thread number
-        sprintf(cons_parm[i].fileName,"out%d%d.dat",testNum,i);
-        cons_parm[i].threadNum = i;
-        printf("Main: starting consumer %d with file %s\n", i, cons_parm[i].fileName);
-        pthread_create(&cons_thread[i],NULL,consumer,&cons_parm[i]);
+    printf("Buffer backend %s, %d slots\n", backend->name, numSlots);
+    if (numShards > 1){
+        printf("Split into %d shards\n", numShards);
     }
-   
-    // wait for threads to complete 
-    for (int i = 0; i < numProducers; i++){
-        pthread_join(prod_thread[i],NULL);
+    if (numLanes > 1){
+        printf("Priority lanes %d, bulk lane at least every %d sweeps\n", numLanes, laneStarve);
     }
-    for (int i = 0; i < numConsumers; i++){
-        pthread_join(cons_thread[i],NULL);
+    printf("Batch sizes %d producer, %d consumer\n", prodBatch, consBatch);
+    if (recordMode){
+        printf("Moving lines, %ld byte slab per producer\n", slabBytes);
+    }
+    printf("Waiting with %s\n", waitMode == WAIT_FUTEX ? "spin then futex" : "condition variables");
+    reportPlacement(&threadPlacement);
+    if (maxPool > 0){
+        printf("Elastic consumer pool, %d to %d consumers\n", minConsumers, maxPool);
+    }
+    for (int s = 0; s < numPipeStages; s++){
+        printf("Stage %d %s, %d threads, %d slots\n", s + 1, pipeStages[s].spec, pipeStages[s].numThreads,
+               pipeStages[s].numSlots);
     }
 
+    struct runConfig cfg = {backend, numSlots, numProducers, numConsumers, NULL, 0, minConsumers, maxPool};
+    struct runStats stats;
+    runPipeline(&cfg, &stats);
+    printf("Main: moved %ld values in %.3f seconds\n", stats.numMoved, stats.seconds);
+
     return 0;
 }
 
@@ -295,4 +4572,77 @@ void simulate_interrupt(void){
         // 33 peercent chance of yielding
         sched_yield();
     }
-}
\ No newline at end of file
+}
+
+//+
+// Function: cpu_relax
+//
+// Purpose:  Backs off while spinning on the lock-free ring. The pause
+//           instruction lets a sibling hyperthread run, and the yield keeps
+//           a spinning thread from starving the thread it is waiting for
+//           when there are more threads than cores.
+//-
+
+void cpu_relax(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+    sched_yield();
+}
+
+//+
+// Function: cpu_pause
+//
+// Purpose:  Backs off for a moment while spinning in waitOn, without giving
+//           up the core.
+//-
+
+void cpu_pause(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+//+
+// Function: nowNs
+//
+// Purpose:  Returns the monotonic clock in nanoseconds.
+//-
+
+uint64_t nowNs(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//+
+// Function: recordWait
+//
+// Purpose:  Counts one wait that began at start.
+//-
+
+void recordWait(atomic_long *waits, atomic_long *waitNs, uint64_t start){
+    atomic_fetch_add_explicit(waits, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(waitNs, nowNs() - start, memory_order_relaxed);
+}
+
+//+
+// Function: takeRetire
+//
+// Purpose:  Takes one of the retire requests of the elastic pool, if there
+//           are any.
+//
+// Returns:  1 if the calling consumer should leave, 0 otherwise
+//-
+
+int takeRetire(struct boundedBuffer *buf){
+    int n = atomic_load_explicit(&buf->retiring, memory_order_relaxed);
+    while (n > 0){
+        if (atomic_compare_exchange_weak(&buf->retiring, &n, n - 1)){
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ingest.h"
+
+//+
+// File:    parsebench.c
+//
+// Purpose: Measures how fast the producer input files can be parsed. Each
+//      ingestion path reads the whole file several times, and the best pass
+//      is reported in GB/s and values per second, next to the original
+//      fgets and atoi path (stdio). A checksum of the values and line count
+//      must agree across the paths, so this also checks the fast paths
+//      convert every line the way atoi does.
+//
+//      With -g a test file is written first. Most of its lines are plain
+//      integers, but some are malformed: white space, signs, trailing junk,
+//      empty lines, overflowing numbers and lines longer than 1023 bytes.
+//-
+
+// values read per call, like a large producer batch
+#define BATCH 4096
+
+//+
+// Function: nowNs
+//
+// Purpose:  Returns the monotonic clock in nanoseconds.
+//-
+
+uint64_t nowNs(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//+
+// Function: writeTestFile
+//
+// Purpose:  Writes numLines lines of test input to fileName.
+//-
+
+void writeTestFile(const char *fileName, long numLines){
+    FILE *out = fopen(fileName, "w");
+    if (out == NULL){
+        perror(fileName);
+        exit(1);
+    }
+    for (long i = 0; i < numLines; i++){
+        long r = lrand48();
+        if (r % 100 != 0){
+            fprintf(out, "%ld\n", (r % 2 ? -1 : 1) * (lrand48() % 1000000000));
+            continue;
+        }
+        switch (r / 100 % 8){
+        case 0:
+            fprintf(out, " \t%+ld\n", lrand48());
+            break;
+        case 1:
+            fprintf(out, "%ldabc 12\n", lrand48() % 1000);
+            break;
+        case 2:
+            fprintf(out, "\n");
+            break;
+        case 3:
+            fprintf(out, "-98765432109876543210123\n");
+            break;
+        case 4:
+            fprintf(out, "4294967297\n");
+            break;
+        case 5:
+            // split by fgets into a 1023 byte line and the rest
+            for (int j = 0; j < 1500; j++){
+                fputc('0' + j % 10, out);
+            }
+            fputc('\n', out);
+            break;
+        case 6:
+            // exactly fills the fgets buffer, the newline is read as its own line
+            for (int j = 0; j < 1023; j++){
+                fputc('7', out);
+            }
+            fputc('\n', out);
+            break;
+        default:
+            fprintf(out, "x%ld\n", lrand48());
+        }
+    }
+    fclose(out);
+}
+
+//+
+// Function: main
+//
+// Purpose:  Decodes the command line and times each ingestion path.
+//-
+
+int main(int argc, char * argv[]){
+    const char *names[] = {"stdio", "read", "mmap"};
+    const int modes[] = {INGEST_STDIO, INGEST_READ, INGEST_MMAP};
+    int reps = 5;
+    long genLines = 0;
+    int opt;
+    struct stat st;
+    uint64_t baseSum = 0;
+    long baseLines = 0;
+    int status = 0;
+
+    while ((opt = getopt(argc, argv, "r:g:")) != -1){
+        switch (opt){
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 'g':
+            genLines = atol(optarg);
+            break;
+        default:
+            reps = 0;
+        }
+    }
+    if (argc - optind != 1 || reps < 1){
+        fprintf(stderr, "Usage: %s [-r reps] [-g lines] file\n", argv[0]);
+        fprintf(stderr, "  -r reps   timed passes per path, the best is reported (default 5)\n");
+        fprintf(stderr, "  -g lines  first write a test file of this many lines\n");
+        exit(1);
+    }
+    const char *fileName = argv[optind];
+    if (genLines > 0){
+        srand48(time(NULL));
+        writeTestFile(fileName, genLines);
+    }
+    if (stat(fileName, &st) != 0){
+        perror(fileName);
+        exit(1);
+    }
+
+    int *values = malloc(BATCH * sizeof(int));
+    printf("%-6s %10s %10s %12s %s\n", "path", "seconds", "GB/s", "values/s", "check");
+    for (int m = 0; m < 3; m++){
+        double best = 0;
+        uint64_t sum = 0;
+        long lines = 0;
+        for (int rep = 0; rep < reps; rep++){
+            struct intReader reader;
+            int count;
+            uint64_t start = nowNs();
+            if (intReaderOpen(&reader, fileName, modes[m]) != 0){
+                perror(fileName);
+                exit(1);
+            }
+            sum = 0;
+            lines = 0;
+            while ((count = intReaderRead(&reader, values, BATCH)) >= 0){
+                for (int i = 0; i < count; i++){
+                    sum = sum * 31 + (uint32_t) values[i];
+                }
+                lines += count;
+            }
+            intReaderClose(&reader);
+            double seconds = (nowNs() - start) / 1e9;
+            if (rep == 0 || seconds < best){
+                best = seconds;
+            }
+        }
+        if (m == 0){
+            baseSum = sum;
+            baseLines = lines;
+        }
+        int match = sum == baseSum && lines == baseLines;
+        printf("%-6s %10.4f %10.3f %12.0f %s\n", names[m], best, st.st_size / best / 1e9,
+               lines / best, match ? "ok" : "MISMATCH");
+        if (!match){
+            status = 1;
+        }
+    }
+    printf("%ld lines, %ld bytes\n", baseLines, (long) st.st_size);
+    free(values);
+    return status;
+}
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "placement.h"
+
+//+
+// File:    placement.c
+//
+// Purpose: Thread placement for the producers and consumers, see
+//          placement.h.
+//-
+
+// most cache levels looked at under cpu<n>/cache
+#define MAX_CACHE_INDEX 10
+
+//+
+// Function: parseCpuList
+//
+// Purpose:  Decodes a CPU list such as "0-3,8,10-11", the format used on the
+//           command line and in /sys. Trailing white space is ignored.
+//
+// Returns:  the number of CPUs put in cpus, -1 if the list is malformed or
+//           has more than maxCpus entries
+//-
+
+int parseCpuList(const char *s, int *cpus, int maxCpus){
+    int count = 0;
+    char *end;
+
+    while (*s != '\0' && *s != '\n' && *s != ' '){
+        long first = strtol(s, &end, 10);
+        long last = first;
+        if (end == s || first < 0){
+            return -1;
+        }
+        s = end;
+        if (*s == '-'){
+            last = strtol(s + 1, &end, 10);
+            if (end == s + 1 || last < first){
+                return -1;
+            }
+            s = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++){
+            if (count == maxCpus){
+                return -1;
+            }
+            cpus[count++] = cpu;
+        }
+        if (*s == ','){
+            s++;
+        }
+    }
+    return count;
+}
+
+//+
+// Function: formatCpuSet
+//
+// Purpose:  Writes set as a CPU list, with runs of CPUs as ranges.
+//-
+
+void formatCpuSet(const cpu_set_t *set, char *out, size_t len){
+    size_t used = 0;
+
+    out[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && used < len; cpu++){
+        if (!CPU_ISSET(cpu, set)){
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)){
+            last++;
+        }
+        if (last == cpu){
+            used += snprintf(out + used, len - used, "%s%d", used ? "," : "", cpu);
+        } else {
+            used += snprintf(out + used, len - used, "%s%d-%d", used ? "," : "", cpu, last);
+        }
+        cpu = last;
+    }
+}
+
+//+
+// Function: readCpuFile
+//
+// Purpose:  Reads a CPU list from a file under /sys into set.
+//
+// Returns:  0 on success, -1 if the file can't be read or decoded
+//-
+
+int readCpuFile(const char *path, cpu_set_t *set){
+    char line[1024];
+    int cpus[CPU_SETSIZE];
+    FILE *in = fopen(path, "r");
+
+    if (in == NULL){
+        return -1;
+    }
+    int ok = fgets(line, sizeof(line), in) != NULL;
+    fclose(in);
+    int count = ok ? parseCpuList(line, cpus, CPU_SETSIZE) : -1;
+    if (count <= 0){
+        return -1;
+    }
+    CPU_ZERO(set);
+    for (int i = 0; i < count; i++){
+        if (cpus[i] < CPU_SETSIZE){
+            CPU_SET(cpus[i], set);
+        }
+    }
+    return 0;
+}
+
+//+
+// Function: complexOf
+//
+// Purpose:  Finds the CPUs that share the largest cache of cpu, an L3
+//           cache, or failing that the CPUs of its package.
+//
+// Returns:  the kind of group found, NULL if the topology can't be read
+//-
+
+const char * complexOf(int cpu, cpu_set_t *set){
+    char path[256];
+    char level[16];
+
+    for (int index = 0; index < MAX_CACHE_INDEX; index++){
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+        FILE *in = fopen(path, "r");
+        if (in == NULL){
+            break;
+        }
+        int ok = fgets(level, sizeof(level), in) != NULL;
+        fclose(in);
+        if (ok && atoi(level) == 3){
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list",
+                     cpu, index);
+            if (readCpuFile(path, set) == 0){
+                return "L3 cache";
+            }
+        }
+    }
+    // package_cpus_list replaced core_siblings_list in newer kernels
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/package_cpus_list", cpu);
+    if (readCpuFile(path, set) == 0){
+        return "package";
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_siblings_list", cpu);
+    if (readCpuFile(path, set) == 0){
+        return "package";
+    }
+    return NULL;
+}
+
+//+
+// Function: readTopology
+//
+// Purpose:  Splits the CPUs in allowed into core complexes.
+//-
+
+void readTopology(struct placement *pl, const cpu_set_t *allowed){
+    pl->groups = calloc(CPU_COUNT(allowed), sizeof(cpu_set_t));
+    if (pl->groups == NULL){
+        perror("readTopology");
+        exit(1);
+    }
+    pl->numGroups = 0;
+    pl->groupKind = NULL;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if (!CPU_ISSET(cpu, allowed)){
+            continue;
+        }
+        // skip CPUs already in a group
+        int seen = 0;
+        for (int g = 0; g < pl->numGroups && !seen; g++){
+            seen = CPU_ISSET(cpu, &pl->groups[g]);
+        }
+        if (seen){
+            continue;
+        }
+        cpu_set_t complex;
+        const char *kind = complexOf(cpu, &complex);
+        if (kind == NULL || (pl->groupKind != NULL && strcmp(kind, pl->groupKind) != 0)){
+            // no topology, or a mix of kinds, so treat the machine as one group
+            pl->numGroups = 1;
+            pl->groupKind = "machine";
+            CPU_OR(&pl->groups[0], allowed, allowed);
+            return;
+        }
+        pl->groupKind = kind;
+        CPU_AND(&pl->groups[pl->numGroups], &complex, allowed);
+        CPU_SET(cpu, &pl->groups[pl->numGroups]);
+        pl->numGroups++;
+    }
+}
+
+//+
+// Function: placementInit
+//
+// Purpose:  Sets up placement from a -a option: "auto", a CPU list shared
+//           by the producers and then the consumers, or a producer list and
+//           a consumer list separated by a colon. spec may be NULL for no
+//           placement.
+//
+// Returns:  0 on success, -1 if spec is malformed or names a CPU this
+//           process can't run on
+//-
+
+int placementInit(struct placement *pl, const char *spec){
+    cpu_set_t allowed;
+
+    memset(pl, 0, sizeof(struct placement));
+    if (spec == NULL){
+        pl->mode = PLACE_NONE;
+        return 0;
+    }
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0){
+        perror("sched_getaffinity");
+        exit(1);
+    }
+    if (strcmp(spec, "auto") == 0){
+        pl->mode = PLACE_AUTO;
+        readTopology(pl, &allowed);
+        return 0;
+    }
+
+    pl->mode = PLACE_LIST;
+    pl->prodCpus = malloc(CPU_SETSIZE * sizeof(int));
+    pl->consCpus = malloc(CPU_SETSIZE * sizeof(int));
+    if (pl->prodCpus == NULL || pl->consCpus == NULL){
+        perror("placementInit");
+        exit(1);
+    }
+    const char *colon = strchr(spec, ':');
+    if (colon == NULL){
+        pl->sharedList = 1;
+        pl->numProdCpus = parseCpuList(spec, pl->prodCpus, CPU_SETSIZE);
+        memcpy(pl->consCpus, pl->prodCpus, CPU_SETSIZE * sizeof(int));
+        pl->numConsCpus = pl->numProdCpus;
+    } else {
+        pl->numConsCpus = parseCpuList(colon + 1, pl->consCpus, CPU_SETSIZE);
+        // the producer list stops at the colon
+        char *prodSpec = strndup(spec, colon - spec);
+        pl->numProdCpus = prodSpec != NULL ? parseCpuList(prodSpec, pl->prodCpus, CPU_SETSIZE) : -1;
+        free(prodSpec);
+    }
+    if (pl->numProdCpus < 1 || pl->numConsCpus < 1){
+        return -1;
+    }
+    for (int i = 0; i < pl->numProdCpus + pl->numConsCpus; i++){
+        int cpu = i < pl->numProdCpus ? pl->prodCpus[i] : pl->consCpus[i - pl->numProdCpus];
+        if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)){
+            fprintf(stderr, "cpu %d is not available\n", cpu);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//+
+// Function: placementCpus
+//
+// Purpose:  Chooses the CPUs for producer or consumer threadNum. With CPU
+//           lists each thread gets one CPU, taking the list in turn. With
+//           auto placement producer p gets core complex p, wrapping around,
+//           and consumer c is paired with producer c % numProducers and gets
+//           the same complex.
+//
+// Returns:  1 if set was filled in, 0 if the thread isn't placed
+//-
+
+int placementCpus(const struct placement *pl, int consumer, int threadNum, int numProducers, cpu_set_t *set){
+    CPU_ZERO(set);
+    if (pl->mode == PLACE_LIST){
+        if (!consumer){
+            CPU_SET(pl->prodCpus[threadNum % pl->numProdCpus], set);
+        } else if (pl->sharedList){
+            CPU_SET(pl->consCpus[(numProducers + threadNum) % pl->numConsCpus], set);
+        } else {
+            CPU_SET(pl->consCpus[threadNum % pl->numConsCpus], set);
+        }
+        return 1;
+    }
+    if (pl->mode == PLACE_AUTO){
+        int producer = consumer ? threadNum % numProducers : threadNum;
+        CPU_OR(set, set, &pl->groups[producer % pl->numGroups]);
+        return 1;
+    }
+    return 0;
+}
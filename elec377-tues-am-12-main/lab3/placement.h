@@ -0,0 +1,44 @@
+//+
+// File:    placement.h
+//
+// Purpose: Chooses the CPUs each producer and consumer thread may run on.
+//      Threads can be pinned to explicit CPU lists, or placed automatically
+//      so that each producer shares a core complex (the CPUs behind one L3
+//      cache, or failing that one package) with the consumers that are
+//      paired with it. The topology is read from /sys/devices/system/cpu,
+//      and only CPUs this process is allowed to run on are used.
+//-
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <sched.h>
+#include <stddef.h>
+
+// Ways of placing threads
+#define PLACE_NONE 0
+#define PLACE_LIST 1
+#define PLACE_AUTO 2
+
+struct placement{
+    int mode;
+    // PLACE_LIST, producers take prodCpus in turn and consumers consCpus.
+    // With one list both point at it and consumers follow the producers
+    int *prodCpus;
+    int numProdCpus;
+    int *consCpus;
+    int numConsCpus;
+    int sharedList;
+    // PLACE_AUTO, the CPUs of each core complex
+    cpu_set_t *groups;
+    int numGroups;
+    // what the groups are, "L3 cache", "package" or "machine"
+    const char *groupKind;
+};
+
+int parseCpuList(const char *s, int *cpus, int maxCpus);
+void formatCpuSet(const cpu_set_t *set, char *out, size_t len);
+int placementInit(struct placement *pl, const char *spec);
+int placementCpus(const struct placement *pl, int consumer, int threadNum, int numProducers, cpu_set_t *set);
+
+#endif